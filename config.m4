@@ -1,9 +1,15 @@
 PHP_ARG_ENABLE(kislayphp_config, whether to enable kislayphp_config,
 [  --enable-kislayphp_config   Enable kislayphp_config support])
 
+PHP_ARG_ENABLE(kislayphp-config-usdt, whether to enable USDT probes,
+[  --enable-kislayphp-config-usdt   Enable sys/sdt.h static probes for bpftrace/perf], no, no)
+
 if test "$PHP_KISLAYPHP_CONFIG" != "no"; then
   PHP_REQUIRE_CXX()
   PHP_ADD_LIBRARY(stdc++,, KISLAYPHP_CONFIG_SHARED_LIBADD)
+  PHP_ADD_LIBRARY(pthread,, KISLAYPHP_CONFIG_SHARED_LIBADD)
+  AC_CHECK_HEADER([zlib.h], [], [AC_MSG_ERROR([zlib.h not found; install zlib1g-dev or zlib-devel])])
+  PHP_ADD_LIBRARY(z,, KISLAYPHP_CONFIG_SHARED_LIBADD)
   if test -f ../rpc/gen/platform.pb.cc; then
     RPC_GEN_DIR=`pwd`/../rpc/gen
     PHP_ADD_INCLUDE($RPC_GEN_DIR)
@@ -18,6 +24,11 @@ if test "$PHP_KISLAYPHP_CONFIG" != "no"; then
     RPC_SRCS=""
   fi
 
+  if test "$PHP_KISLAYPHP_CONFIG_USDT" != "no"; then
+    AC_CHECK_HEADER([sys/sdt.h], [], [AC_MSG_ERROR([sys/sdt.h not found; install systemtap-sdt-dev or systemtap-sdt-devel])])
+    CXXFLAGS="$CXXFLAGS -DKISLAYPHP_CONFIG_USDT"
+  fi
+
   PHP_NEW_EXTENSION(kislayphp_config, kislayphp_config.cpp $RPC_SRCS, $ext_shared)
   PHP_SUBST(KISLAYPHP_CONFIG_SHARED_LIBADD)
 fi
@@ -9,25 +9,61 @@ extern "C" {
 #include "php_kislayphp_config.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <map>
+#include <memory>
+#include <random>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <zlib.h>
+
+/*
+ * USDT probes (./configure --enable-kislayphp-config-usdt). Each probe is a nop
+ * until a tracer attaches; match the start/begin and end probes per thread
+ * in the tracer to get latencies. See docs.md for bpftrace examples.
+ */
+#ifdef KISLAYPHP_CONFIG_USDT
+#include <sys/sdt.h>
+#define KISLAY_PROBE1(name, a) DTRACE_PROBE1(kislayphp_config, name, a)
+#define KISLAY_PROBE2(name, a, b) DTRACE_PROBE2(kislayphp_config, name, a, b)
+#define KISLAY_PROBE3(name, a, b, c) DTRACE_PROBE3(kislayphp_config, name, a, b, c)
+#define KISLAY_PROBE4(name, a, b, c, d) DTRACE_PROBE4(kislayphp_config, name, a, b, c, d)
+#else
+/* sizeof keeps probe-only arguments "used" without evaluating them. */
+#define KISLAY_PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define KISLAY_PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define KISLAY_PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#define KISLAY_PROBE4(name, a, b, c, d) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d); } while (0)
+#endif
 
 #ifndef zend_call_method_with_0_params
 static inline void kislay_call_method_with_0_params(
@@ -71,27 +107,479 @@ static inline void kislay_call_method_with_2_params(
     kislay_call_method_with_2_params(obj, obj_ce, fn_proxy, function_name, retval, param1, param2)
 #endif
 
+#define KISLAY_HTTP_TIMEOUT_SEC 10
+#define KISLAY_REPLICATION_BATCH 1000
+#define KISLAY_RESOLVE_BATCH_MAX 10000
+#define KISLAY_CLIENT_RETRY_CAP_MS 30000
+/* Resolve-diff buckets: at most 2^KISLAY_MERKLE_MAX_BITS, and only for snapshots of KISLAY_MERKLE_MIN_KEYS or more. */
+#define KISLAY_MERKLE_MAX_BITS 10
+#define KISLAY_MERKLE_MIN_KEYS 256
+#define KISLAY_DIFF_RETRY_SEC 600
+#define KISLAY_HISTOGRAM_BOUNDS 42
+
 using flat_map_t = std::unordered_map<std::string, std::string>;
-using scope_map_t = std::unordered_map<std::string, flat_map_t>;
+
+/*
+ * Server scope keys and values are interned: every scope holding the same
+ * string shares one NUL-terminated copy, so equal strings compare equal as
+ * pointers. refs is only touched under kislay_string_pool_lock, which scopes
+ * take once per build, copy or release rather than once per string.
+ */
+struct kislay_string_block_t;
+
+struct kislay_istring_t {
+    std::uint64_t hash;
+    std::uint32_t refs;
+    std::uint32_t length;
+    kislay_string_block_t *block;
+    char data[1];
+};
+
+/*
+ * Arena for the keys, or the values, one scope build added to the pool, laid
+ * out back to back after this header. A replaced scope version usually takes
+ * all of its values with it, so the block goes back in a single
+ * free()/munmap() instead of one call per string. Keys get their own block
+ * because they tend to outlive the values they came with, and strings of
+ * KISLAY_STRING_SOLO_BYTES or more get a block each, so a long-lived string
+ * never pins a dead large one. Large blocks are mmap'd so that memory leaves
+ * the process.
+ */
+struct kislay_string_block_t {
+    std::size_t size;
+    std::size_t live;
+    bool mapped;
+};
+
+#define KISLAY_STRING_BLOCK_MMAP_BYTES (64 * 1024)
+#define KISLAY_STRING_SOLO_BYTES 256
+
+struct kislay_string_ref_t {
+    const char *data;
+    std::size_t length;
+};
+
+typedef const kislay_istring_t *kislay_handle_t;
+/* Entries are kept sorted by key handle address, which makes chain merges linear. */
+typedef std::pair<kislay_handle_t, kislay_handle_t> kislay_entry_t;
+typedef std::vector<kislay_entry_t> kislay_entries_t;
+
+/* Open-addressed, linear-probed set shared by every Server in the process. */
+struct kislay_string_pool_t {
+    kislay_istring_t **slots;
+    std::size_t capacity;
+    std::size_t count;
+    std::size_t bytes;
+    std::size_t blocks;
+    std::size_t block_bytes;
+};
+
+static pthread_mutex_t kislay_string_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static kislay_string_pool_t kislay_string_pool = {nullptr, 0, 0, 0, 0, 0};
+
+static inline std::uint64_t kislay_mix64(std::uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Little-endian load, so hashes sent over the wire agree across hosts. */
+static inline std::uint64_t kislay_load64(const char *data) {
+    std::uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/*
+ * MurmurHash64A-style string hash, eight bytes per step. Used by the string
+ * pool, the Merkle buckets and checksums, so all of them hash a string the
+ * same way.
+ */
+static std::uint64_t kislay_string_hash(const char *data, std::size_t length) {
+    const std::uint64_t m = 0xc6a4a7935bd1e995ULL;
+    std::uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (length * m);
+    std::size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        std::uint64_t k = kislay_load64(data + i);
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        hash ^= k;
+        hash *= m;
+    }
+    if (i < length) {
+        char tail[8] = {0};
+        std::memcpy(tail, data + i, length - i);
+        hash ^= kislay_load64(tail);
+        hash *= m;
+    }
+    return kislay_mix64(hash);
+}
+
+static kislay_istring_t **kislay_string_pool_slot_locked(const char *data, std::size_t length, std::uint64_t hash) {
+    std::size_t mask = kislay_string_pool.capacity - 1;
+    for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+        kislay_istring_t *entry = kislay_string_pool.slots[i];
+        if (entry == nullptr || (entry->hash == hash && entry->length == length && std::memcmp(entry->data, data, length) == 0)) {
+            return &kislay_string_pool.slots[i];
+        }
+    }
+}
+
+static void kislay_string_pool_grow_locked() {
+    kislay_istring_t **old_slots = kislay_string_pool.slots;
+    std::size_t old_capacity = kislay_string_pool.capacity;
+    std::size_t capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+    kislay_string_pool.slots = static_cast<kislay_istring_t **>(std::calloc(capacity, sizeof(kislay_istring_t *)));
+    if (kislay_string_pool.slots == nullptr) {
+        throw std::bad_alloc();
+    }
+    kislay_string_pool.capacity = capacity;
+    for (std::size_t i = 0; i < old_capacity; ++i) {
+        if (old_slots[i] != nullptr) {
+            std::size_t j = old_slots[i]->hash & (capacity - 1);
+            while (kislay_string_pool.slots[j] != nullptr) {
+                j = (j + 1) & (capacity - 1);
+            }
+            kislay_string_pool.slots[j] = old_slots[i];
+        }
+    }
+    std::free(old_slots);
+}
+
+static void kislay_intern_addref_locked(kislay_handle_t handle) {
+    const_cast<kislay_istring_t *>(handle)->refs++;
+}
+
+static std::size_t kislay_string_footprint(std::size_t length) {
+    return (offsetof(kislay_istring_t, data) + length + 1 + 7) & ~static_cast<std::size_t>(7);
+}
+
+static kislay_string_block_t *kislay_string_block_alloc(std::size_t bytes) {
+    bool mapped = bytes >= KISLAY_STRING_BLOCK_MMAP_BYTES;
+    void *memory = mapped ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : std::malloc(bytes);
+    if (memory == (mapped ? MAP_FAILED : nullptr)) {
+        throw std::bad_alloc();
+    }
+    kislay_string_block_t *block = static_cast<kislay_string_block_t *>(memory);
+    block->size = bytes;
+    block->live = 0;
+    block->mapped = mapped;
+    kislay_string_pool.blocks++;
+    kislay_string_pool.block_bytes += bytes;
+    return block;
+}
+
+static void kislay_string_block_free(kislay_string_block_t *block) {
+    kislay_string_pool.blocks--;
+    kislay_string_pool.block_bytes -= block->size;
+    if (block->mapped) {
+        munmap(block, block->size);
+    } else {
+        std::free(block);
+    }
+}
+
+/*
+ * Sets out[i] to the pooled copy of strings[i] with one more reference;
+ * strings alternate key, value. New keys are carved from one new block, new
+ * values from another, and large strings get a block each.
+ */
+static void kislay_intern_batch_locked(const kislay_string_ref_t *strings, std::size_t count, kislay_handle_t *out) {
+    std::vector<std::uint64_t> hashes(count);
+    std::vector<std::size_t> pending;
+    for (std::size_t i = 0; i < count; ++i) {
+        hashes[i] = kislay_string_hash(strings[i].data, strings[i].length);
+        kislay_istring_t *found = kislay_string_pool.capacity == 0 ? nullptr :
+            *kislay_string_pool_slot_locked(strings[i].data, strings[i].length, hashes[i]);
+        out[i] = found;
+        if (found != nullptr) {
+            found->refs++;
+        } else {
+            pending.push_back(i);
+        }
+    }
+    if (pending.empty()) {
+        return;
+    }
+
+    /* Equal new strings sort next to each other, so each gets one copy in the block. */
+    std::sort(pending.begin(), pending.end(), [&](std::size_t left, std::size_t right) {
+        if (hashes[left] != hashes[right]) {
+            return hashes[left] < hashes[right];
+        }
+        if (strings[left].length != strings[right].length) {
+            return strings[left].length < strings[right].length;
+        }
+        return std::memcmp(strings[left].data, strings[right].data, strings[left].length) < 0;
+    });
+    std::vector<bool> repeat(pending.size(), false);
+    std::size_t unique = 0;
+    std::size_t bytes[2] = {sizeof(kislay_string_block_t), sizeof(kislay_string_block_t)};
+    for (std::size_t k = 0; k < pending.size(); ++k) {
+        const kislay_string_ref_t &string = strings[pending[k]];
+        if (k > 0) {
+            const kislay_string_ref_t &previous = strings[pending[k - 1]];
+            repeat[k] = hashes[pending[k]] == hashes[pending[k - 1]] && string.length == previous.length &&
+                std::memcmp(string.data, previous.data, string.length) == 0;
+        }
+        if (!repeat[k]) {
+            unique++;
+            if (string.length < KISLAY_STRING_SOLO_BYTES) {
+                bytes[pending[k] & 1] += kislay_string_footprint(string.length);
+            }
+        }
+    }
+    while ((kislay_string_pool.count + unique) * 4 > kislay_string_pool.capacity * 3) {
+        kislay_string_pool_grow_locked();
+    }
+
+    kislay_string_block_t *blocks[2] = {nullptr, nullptr};
+    char *cursors[2] = {nullptr, nullptr};
+    for (int kind = 0; kind < 2; ++kind) {
+        if (bytes[kind] > sizeof(kislay_string_block_t)) {
+            blocks[kind] = kislay_string_block_alloc(bytes[kind]);
+            cursors[kind] = reinterpret_cast<char *>(blocks[kind]) + sizeof(kislay_string_block_t);
+        }
+    }
+    for (std::size_t k = 0; k < pending.size(); ++k) {
+        std::size_t i = pending[k];
+        if (repeat[k]) {
+            out[i] = out[pending[k - 1]];
+            kislay_intern_addref_locked(out[i]);
+            continue;
+        }
+        kislay_string_block_t *block = nullptr;
+        kislay_istring_t *entry = nullptr;
+        if (strings[i].length >= KISLAY_STRING_SOLO_BYTES) {
+            block = kislay_string_block_alloc(sizeof(kislay_string_block_t) + kislay_string_footprint(strings[i].length));
+            entry = reinterpret_cast<kislay_istring_t *>(reinterpret_cast<char *>(block) + sizeof(kislay_string_block_t));
+        } else {
+            block = blocks[i & 1];
+            entry = reinterpret_cast<kislay_istring_t *>(cursors[i & 1]);
+            cursors[i & 1] += kislay_string_footprint(strings[i].length);
+        }
+        entry->hash = hashes[i];
+        entry->refs = 1;
+        entry->length = static_cast<std::uint32_t>(strings[i].length);
+        entry->block = block;
+        std::memcpy(entry->data, strings[i].data, strings[i].length);
+        entry->data[strings[i].length] = '\0';
+        *kislay_string_pool_slot_locked(strings[i].data, strings[i].length, hashes[i]) = entry;
+        block->live++;
+        kislay_string_pool.count++;
+        kislay_string_pool.bytes += strings[i].length;
+        out[i] = entry;
+    }
+}
+
+/* The pooled copy of data without taking a reference, or null when no scope holds it. */
+static kislay_handle_t kislay_intern_find_locked(const std::string &value) {
+    if (kislay_string_pool.count == 0) {
+        return nullptr;
+    }
+    return *kislay_string_pool_slot_locked(value.data(), value.size(), kislay_string_hash(value.data(), value.size()));
+}
+
+/* Drops one reference; the last one frees the string and backward-shifts its probe run. */
+static void kislay_intern_release_locked(kislay_handle_t handle) {
+    kislay_istring_t *entry = const_cast<kislay_istring_t *>(handle);
+    if (--entry->refs > 0) {
+        return;
+    }
+    std::size_t mask = kislay_string_pool.capacity - 1;
+    std::size_t i = entry->hash & mask;
+    while (kislay_string_pool.slots[i] != entry) {
+        i = (i + 1) & mask;
+    }
+    kislay_string_pool.slots[i] = nullptr;
+    for (std::size_t j = (i + 1) & mask; kislay_string_pool.slots[j] != nullptr; j = (j + 1) & mask) {
+        std::size_t home = kislay_string_pool.slots[j]->hash & mask;
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            kislay_string_pool.slots[i] = kislay_string_pool.slots[j];
+            kislay_string_pool.slots[j] = nullptr;
+            i = j;
+        }
+    }
+    kislay_string_pool.count--;
+    kislay_string_pool.bytes -= entry->length;
+    if (--entry->block->live == 0) {
+        kislay_string_block_free(entry->block);
+    }
+}
+
+static bool kislay_entry_key_less(const kislay_entry_t &left, const kislay_entry_t &right) {
+    return std::less<kislay_handle_t>()(left.first, right.first);
+}
+
+struct kislay_node_segment_t;
+
+/* A stored server scope and the revision that last wrote it; holds one pool reference per handle. */
+struct kislay_scope_t {
+    kislay_entries_t entries;
+    std::uint64_t revision = 0;
+    /*
+     * Node scopes only: where a copy of the entries lives in the spill segment.
+     * A cold scope is a stub holding just that location; it is never modified.
+     */
+    std::shared_ptr<kislay_node_segment_t> segment;
+    std::uint64_t segment_offset = 0;
+    std::size_t segment_length = 0;
+    std::size_t segment_keys = 0;
+    bool cold = false;
+
+    kislay_scope_t() {}
+    explicit kislay_scope_t(const flat_map_t &values) {
+        std::vector<kislay_string_ref_t> strings;
+        strings.reserve(values.size() * 2);
+        for (flat_map_t::const_iterator it = values.begin(); it != values.end(); ++it) {
+            strings.push_back(kislay_string_ref_t{it->first.data(), it->first.size()});
+            strings.push_back(kislay_string_ref_t{it->second.data(), it->second.size()});
+        }
+        intern(strings);
+    }
+    kislay_scope_t(const kislay_scope_t &other) : entries(other.entries), revision(other.revision) {
+        pthread_mutex_lock(&kislay_string_pool_lock);
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            kislay_intern_addref_locked(entries[i].first);
+            kislay_intern_addref_locked(entries[i].second);
+        }
+        pthread_mutex_unlock(&kislay_string_pool_lock);
+    }
+    kislay_scope_t &operator=(const kislay_scope_t &) = delete;
+    ~kislay_scope_t() {
+        if (entries.empty()) {
+            return;
+        }
+        pthread_mutex_lock(&kislay_string_pool_lock);
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            kislay_intern_release_locked(entries[i].first);
+            kislay_intern_release_locked(entries[i].second);
+        }
+        pthread_mutex_unlock(&kislay_string_pool_lock);
+    }
+
+    std::size_t size() const {
+        return cold ? segment_keys : entries.size();
+    }
+
+    /* Fills entries from alternating key and value strings, which all come from one build. */
+    void intern(const std::vector<kislay_string_ref_t> &strings) {
+        std::vector<kislay_handle_t> handles(strings.size());
+        pthread_mutex_lock(&kislay_string_pool_lock);
+        kislay_intern_batch_locked(strings.data(), strings.size(), handles.data());
+        pthread_mutex_unlock(&kislay_string_pool_lock);
+        entries.reserve(strings.size() / 2);
+        for (std::size_t i = 0; i + 1 < handles.size(); i += 2) {
+            entries.push_back(kislay_entry_t(handles[i], handles[i + 1]));
+        }
+        std::sort(entries.begin(), entries.end(), kislay_entry_key_less);
+    }
+
+    /* Removes deletes, then upserts set's entries; one pass under the pool lock. */
+    void patch(const kislay_scope_t &set, const std::vector<std::string> &deletes) {
+        pthread_mutex_lock(&kislay_string_pool_lock);
+        for (std::size_t i = 0; i < deletes.size(); ++i) {
+            kislay_handle_t key = kislay_intern_find_locked(deletes[i]);
+            kislay_entries_t::iterator it = std::lower_bound(entries.begin(), entries.end(), kislay_entry_t(key, nullptr), kislay_entry_key_less);
+            if (key != nullptr && it != entries.end() && it->first == key) {
+                kislay_intern_release_locked(it->first);
+                kislay_intern_release_locked(it->second);
+                entries.erase(it);
+            }
+        }
+        if (!set.entries.empty()) {
+            kislay_entries_t merged;
+            merged.reserve(entries.size() + set.entries.size());
+            std::size_t i = 0;
+            std::size_t j = 0;
+            while (i < entries.size() || j < set.entries.size()) {
+                if (j == set.entries.size() || (i < entries.size() && kislay_entry_key_less(entries[i], set.entries[j]))) {
+                    merged.push_back(entries[i++]);
+                    continue;
+                }
+                if (i < entries.size() && entries[i].first == set.entries[j].first) {
+                    kislay_intern_release_locked(entries[i].first);
+                    kislay_intern_release_locked(entries[i].second);
+                    i++;
+                }
+                kislay_intern_addref_locked(set.entries[j].first);
+                kislay_intern_addref_locked(set.entries[j].second);
+                merged.push_back(set.entries[j++]);
+            }
+            entries.swap(merged);
+        }
+        pthread_mutex_unlock(&kislay_string_pool_lock);
+    }
+};
+
+/* Scopes are shared with snapshots; writers swap in a new map unless they hold the only reference. */
+using scope_ptr_t = std::shared_ptr<kislay_scope_t>;
+using scope_map_t = std::unordered_map<std::string, scope_ptr_t>;
 using project_scope_map_t = std::unordered_map<std::string, scope_map_t>;
 using node_scope_map_t = std::unordered_map<std::string, project_scope_map_t>;
 
 static zend_class_entry *kislayphp_config_client_interface_ce;
 static zend_class_entry *kislayphp_config_client_ce;
 static zend_class_entry *kislayphp_config_runtime_ce;
+static zend_class_entry *kislayphp_config_snapshot_ce;
 static zend_class_entry *kislayphp_config_server_ce;
 
 static zend_object_handlers kislayphp_config_client_handlers;
 static zend_object_handlers kislayphp_config_server_handlers;
+static zend_object_handlers kislayphp_config_snapshot_handlers;
 
 static pthread_mutex_t kislay_runtime_lock = PTHREAD_MUTEX_INITIALIZER;
 static flat_map_t kislay_runtime_remote_snapshot;
+/* Merkle leaves of the remote snapshot at KISLAY_MERKLE_MAX_BITS; empty until a diff refresh needs them. */
+static std::vector<std::uint64_t> kislay_runtime_remote_leaves;
+/*
+ * Server that answered a resolve-diff with 404 or 403, and when. Refreshes
+ * against it go straight to a full resolve for KISLAY_DIFF_RETRY_SEC, after
+ * which the diff is tried again in case the server was upgraded.
+ */
+static std::string kislay_runtime_diff_unsupported_url;
+static std::chrono::steady_clock::time_point kislay_runtime_diff_unsupported_at;
 static flat_map_t kislay_runtime_local_overrides;
 static flat_map_t kislay_runtime_runtime_overrides;
-static flat_map_t kislay_runtime_active_snapshot;
 static std::string kislay_runtime_version("0");
-static std::string kislay_runtime_checksum("0");
+/* Keys the last rebuild took from the environment; they win over every other layer. */
+static flat_map_t kislay_runtime_env_snapshot;
+/* Config::setRequestOverride() values of the request this thread is serving; cleared at RSHUTDOWN. */
+static thread_local flat_map_t kislay_request_overrides;
+
+/* Compacted view of the runtime layers, with the version and checksum it was built at. */
+struct kislay_runtime_view_t {
+    flat_map_t values;
+    std::string version = "0";
+    std::string checksum = "0";
+    /* Sum of entry hashes behind `checksum`; kept current as single keys change. */
+    std::uint64_t checksum_sum = 0;
+};
+using kislay_view_ptr_t = std::shared_ptr<const kislay_runtime_view_t>;
+
+/*
+ * The current view. Pinned requests and Config::snapshot() objects share it
+ * read-only; a writer copies it first only while one of them still holds it.
+ */
+static std::shared_ptr<kislay_runtime_view_t> kislay_runtime_view = std::make_shared<kislay_runtime_view_t>();
+/* View this thread's request reads from, pinned on its first read and released at RSHUTDOWN. */
+static thread_local kislay_view_ptr_t kislay_request_pin;
+
+/* Config::snapshot() result: one view, read without the runtime lock for as long as the object lives. */
+struct php_kislayphp_config_snapshot_t {
+    kislay_view_ptr_t view;
+    zend_object std;
+};
 static std::string kislay_runtime_server_url;
+/* Resolve URL that kislay_runtime_version was fetched from; refreshes of the same chain are conditional. */
+static std::string kislay_runtime_fetched_url;
 static std::string kislay_runtime_environment;
 static std::string kislay_runtime_project;
 static std::string kislay_runtime_service;
@@ -100,6 +588,71 @@ static std::string kislay_runtime_cache_file;
 static std::string kislay_runtime_local_file;
 static std::string kislay_runtime_env_prefix("KISLAY_CFG_");
 static bool kislay_runtime_booted = false;
+static long kislay_runtime_retries = 3;
+static long kislay_runtime_retry_base_ms = 200;
+static long kislay_runtime_retry_max_ms = 5000;
+
+/* Where the last boot or refresh spent its time; HTTP phases are summed over retries. */
+struct kislay_runtime_phases_t {
+    bool recorded = false;
+    bool ok = false;
+    std::string source;
+    long attempts = 0;
+    double dns_ms = 0;
+    double connect_ms = 0;
+    double send_ms = 0;
+    double first_byte_ms = 0;
+    double body_ms = 0;
+    double backoff_ms = 0;
+    double parse_ms = 0;
+    double flatten_ms = 0;
+    double rebuild_ms = 0;
+    double checksum_ms = 0;
+    double cache_write_ms = 0;
+    double total_ms = 0;
+};
+
+/*
+ * Getter counters owned by one PHP thread, like the server's metrics shards:
+ * only the owner writes, so the lock-free read path never shares a cache
+ * line with another thread. stats() sums every shard.
+ */
+struct alignas(64) kislay_runtime_reads_t {
+    std::atomic<std::uint64_t> get_hits{0};
+    std::atomic<std::uint64_t> get_misses{0};
+    std::atomic<std::uint64_t> has_hits{0};
+    std::atomic<std::uint64_t> has_misses{0};
+    std::atomic<std::uint64_t> calls_get{0};
+    std::atomic<std::uint64_t> calls_get_string{0};
+    std::atomic<std::uint64_t> calls_get_int{0};
+    std::atomic<std::uint64_t> calls_get_bool{0};
+    std::atomic<std::uint64_t> calls_get_array{0};
+    std::atomic<std::uint64_t> calls_has{0};
+    std::atomic<std::uint64_t> calls_all{0};
+};
+
+/* Config::stats() counters; all but the getter shards are updated under kislay_runtime_lock. */
+struct kislay_runtime_stats_t {
+    /* Every thread's getter counters; registered under the runtime lock, kept after the thread exits. */
+    std::vector<std::unique_ptr<kislay_runtime_reads_t>> reads;
+    std::uint64_t lock_acquisitions = 0;
+    std::uint64_t lock_contended = 0;
+    std::uint64_t lock_wait_ns = 0;
+    std::uint64_t rebuilds = 0;
+    std::uint64_t refreshes = 0;
+    std::uint64_t refresh_failures = 0;
+    std::uint64_t diff_syncs = 0;
+    std::uint64_t diff_fallbacks = 0;
+    std::uint64_t diff_keys = 0;
+    std::uint64_t view_copies = 0;
+    kislay_runtime_phases_t last_boot;
+    kislay_runtime_phases_t last_refresh;
+};
+
+static kislay_runtime_stats_t kislay_runtime_stats;
+static thread_local kislay_runtime_reads_t *kislay_runtime_reads_shard = nullptr;
+/* Phases of the boot or refresh in progress, or null outside them. */
+static kislay_runtime_phases_t *kislay_runtime_phases = nullptr;
 
 struct php_kislayphp_config_client_t {
     flat_map_t values;
@@ -109,29 +662,400 @@ struct php_kislayphp_config_client_t {
     zend_object std;
 };
 
+/*
+ * Write-ahead journal plus periodic checkpoint. Every committed write is
+ * appended to the journal; once the journal crosses a byte or record
+ * threshold the checkpoint thread writes a full snapshot atomically and cuts
+ * the journal back to the records committed after that snapshot.
+ */
+struct kislay_server_persistence_t {
+    std::string journal_file;
+    std::string checkpoint_file;
+    int journal_fd = -1;
+    std::uint64_t journal_bytes = 0;
+    std::uint64_t journal_records = 0;
+    bool journal_torn = false; /* a failed append may have left bytes past journal_bytes */
+    std::uint64_t checkpoint_bytes = 64ULL * 1024ULL * 1024ULL;
+    std::uint64_t checkpoint_records = 10000;
+    std::uint64_t checkpoints = 0;
+    std::uint64_t last_checkpoint_revision = 0;
+    std::uint64_t last_checkpoint_size = 0;
+    double last_checkpoint_ms = 0.0;
+    std::string last_checkpoint_error;
+    pthread_t thread;
+    bool thread_started = false;
+    bool pending = false;
+    bool stopping = false;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t run_lock;
+};
+
+/*
+ * Leader side: a bounded in-memory log of committed records, served from
+ * /v1/replication/log. Follower side: a thread that pulls that log from the
+ * leader and applies it in order. A follower serves reads at the revision it
+ * has applied and rejects writes.
+ */
+struct kislay_server_replication_t {
+    std::deque<std::pair<std::uint64_t, std::string>> log;
+    std::size_t log_limit = 4096;
+    std::uint64_t log_floor = 0;
+    std::string leader_url;
+    long interval_ms = 500;
+    std::uint64_t leader_revision = 0;
+    std::uint64_t records_applied = 0;
+    std::uint64_t snapshots_applied = 0;
+    std::uint64_t errors = 0;
+    std::string last_error;
+    std::chrono::steady_clock::time_point last_sync;
+    bool synced = false;
+    pthread_t thread;
+    bool thread_started = false;
+    bool stopping = false;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * Worker threads for CPU-bound fan-out such as bulk resolve. Started on first
+ * use; parallel_for callers also work on their own job until it is done.
+ */
+struct kislay_worker_pool_t {
+    struct job_t {
+        const std::function<void(std::size_t)> *fn;
+        std::size_t count;
+        std::atomic<std::size_t> next;
+        std::size_t active;
+    };
+    std::vector<pthread_t> threads;
+    std::size_t size = 0;
+    std::deque<job_t *> queue;
+    bool stopping = false;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t done;
+};
+
+/* Endpoint classes with their own concurrency limit; KISLAY_ENDPOINT_OTHER is never limited. */
+enum kislay_endpoint_t {
+    KISLAY_ENDPOINT_RESOLVE = 0,
+    KISLAY_ENDPOINT_RESOLVE_BATCH,
+    KISLAY_ENDPOINT_WRITE,
+    KISLAY_ENDPOINT_REPLICATION,
+    KISLAY_ENDPOINT_OTHER,
+    KISLAY_ENDPOINT_COUNT
+};
+
+struct kislay_endpoint_limit_t {
+    std::size_t limit = 0;
+    std::size_t active = 0;
+    std::uint64_t shed = 0;
+};
+
+/* Accepted sockets waiting for a connection thread; run() feeds it, connection threads drain it. */
+struct kislay_server_connections_t {
+    std::deque<int> pending;
+    std::vector<pthread_t> threads;
+    std::size_t size = 8;
+    std::size_t max_pending = 1024;
+    std::size_t busy = 0;
+    long retry_after_sec = 1;
+    std::uint64_t shed_pending = 0;
+    kislay_endpoint_limit_t endpoints[KISLAY_ENDPOINT_COUNT];
+    bool stopping = false;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+typedef std::array<const void *, 5> kislay_chain_key_t;
+
+struct kislay_chain_key_hash_t {
+    std::size_t operator()(const kislay_chain_key_t &key) const {
+        std::size_t hash = 0;
+        for (std::size_t i = 0; i < key.size(); ++i) {
+            hash = hash * 31 + std::hash<const void *>()(key[i]);
+        }
+        return hash;
+    }
+};
+
+/*
+ * A serialized resolve. It refers to the chain's layers weakly, so a cached
+ * entry does not keep superseded scopes alive; a hit checks that the layers
+ * are still the same objects. The gzip body is made on first demand, once,
+ * and kept only if it is smaller.
+ */
+struct kislay_resolve_entry_t {
+    std::weak_ptr<kislay_scope_t> layers[5];
+    /* A patch edits a scope in place when nothing else holds it, so the pointer alone does not pin the content. */
+    std::uint64_t revisions[5] = {0, 0, 0, 0, 0};
+    kislay_chain_key_t key{};
+    std::shared_ptr<const std::string> payload;
+    std::shared_ptr<const std::string> gzip;
+    bool compressing = false;
+    bool compressed = false;
+    /* Intrusive LRU links; only meaningful while the entry is cached. */
+    kislay_resolve_entry_t *newer = nullptr;
+    kislay_resolve_entry_t *older = nullptr;
+};
+
+/* One resolve being computed; identical requests arriving meanwhile wait for its entry. */
+struct kislay_resolve_flight_t {
+    bool done = false;
+    std::shared_ptr<kislay_resolve_entry_t> entry;
+};
+
+/*
+ * Singleflight for /v1/config/resolve, keyed by the chain's layer pointers.
+ * In-flight requests hold those layers, so until the flight lands a key can
+ * neither be reused by another scope nor patched in place (patches copy
+ * scopes that are shared).
+ */
+struct kislay_server_coalescer_t {
+    std::unordered_map<kislay_chain_key_t, std::shared_ptr<kislay_resolve_flight_t>, kislay_chain_key_hash_t> inflight;
+    std::unordered_map<kislay_chain_key_t, std::shared_ptr<kislay_resolve_entry_t>, kislay_chain_key_hash_t> cache;
+    /* Ends of the LRU list threaded through the cached entries. */
+    kislay_resolve_entry_t *newest = nullptr;
+    kislay_resolve_entry_t *oldest = nullptr;
+    std::size_t cache_bytes = 0;
+    std::size_t cache_limit = 64 * 1024 * 1024;
+    std::uint64_t computed = 0;
+    std::uint64_t coalesced = 0;
+    std::uint64_t cached = 0;
+    std::uint64_t compressed = 0;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* One resolve tuple mirrored from the upstream by a caching agent. */
+struct kislay_agent_entry_t {
+    std::shared_ptr<kislay_resolve_entry_t> response;
+    std::string version;
+    std::chrono::steady_clock::time_point last_used;
+    bool loaded = false;
+};
+
+/*
+ * Caching agent: mirrors upstream resolves for the tuples local workers ask
+ * for, keyed by their canonical query. A background thread revalidates them
+ * with if_version; while the upstream is unreachable the last copy is served.
+ */
+struct kislay_server_agent_t {
+    std::string upstream_url;
+    long interval_ms = 1000;
+    long idle_sec = 600;
+    std::unordered_map<std::string, std::shared_ptr<kislay_agent_entry_t>> entries;
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t updates = 0;
+    std::uint64_t errors = 0;
+    std::string last_error;
+    std::chrono::steady_clock::time_point last_sync;
+    bool synced = false;
+    /* Upstream /v1/config/version body, reused for interval_ms; served stale while the upstream is down. */
+    std::string version_body;
+    std::chrono::steady_clock::time_point version_fetched;
+    bool version_fetching = false;
+    pthread_t thread;
+    bool thread_started = false;
+    bool stopping = false;
+    pthread_mutex_t lock;
+    /* Signals first fetches landing; the refresh thread sleeps on `timer` so these do not wake it. */
+    pthread_cond_t cond;
+    pthread_cond_t timer;
+};
+
+/* Routes as labelled in /metrics; KISLAY_ROUTE_NOT_FOUND also covers unknown methods. */
+enum kislay_route_t {
+    KISLAY_ROUTE_HEALTH = 0,
+    KISLAY_ROUTE_VERSION,
+    KISLAY_ROUTE_RESOLVE,
+    KISLAY_ROUTE_RESOLVE_BATCH,
+    KISLAY_ROUTE_RESOLVE_DIFF,
+    KISLAY_ROUTE_BATCH,
+    KISLAY_ROUTE_PUT,
+    KISLAY_ROUTE_PATCH,
+    KISLAY_ROUTE_REPLICATION_LOG,
+    KISLAY_ROUTE_REPLICATION_SNAPSHOT,
+    KISLAY_ROUTE_REPLICATION_STATUS,
+    KISLAY_ROUTE_STATS,
+    KISLAY_ROUTE_METRICS,
+    KISLAY_ROUTE_NOT_FOUND,
+    KISLAY_ROUTE_COUNT
+};
+
+static const int kislay_metric_statuses[] = {200, 304, 400, 403, 404, 405, 410, 413, 500, 502, 503};
+#define KISLAY_METRIC_STATUS_COUNT (sizeof(kislay_metric_statuses) / sizeof(kislay_metric_statuses[0]) + 1)
+
+/*
+ * Log-bucketed latency histogram in microseconds: two buckets per power of two
+ * from 16us to ~25s, plus overflow. Counts are per bucket, not cumulative.
+ */
+struct kislay_histogram_t {
+    std::atomic<std::uint64_t> buckets[KISLAY_HISTOGRAM_BOUNDS + 1];
+    std::atomic<std::uint64_t> count;
+    std::atomic<std::uint64_t> sum_us;
+};
+
+/*
+ * Counters owned by one connection thread. Only the owner writes, so updates are
+ * plain relaxed load/store pairs; /metrics sums all shards when scraped.
+ */
+struct kislay_metrics_shard_t {
+    kislay_histogram_t requests[KISLAY_ROUTE_COUNT];
+    std::atomic<std::uint64_t> responses[KISLAY_ROUTE_COUNT][KISLAY_METRIC_STATUS_COUNT];
+    kislay_histogram_t resolve;
+    kislay_histogram_t serialize;
+    kislay_histogram_t lock_wait;
+    std::atomic<std::uint64_t> bytes_in;
+    std::atomic<std::uint64_t> bytes_out;
+    int last_status;
+};
+
+struct kislay_server_metrics_t {
+    std::vector<std::unique_ptr<kislay_metrics_shard_t>> shards;
+    pthread_mutex_t lock;
+};
+
+#define KISLAY_NODE_SEGMENT_RESERVE (64ULL << 30)
+#define KISLAY_NODE_SEGMENT_CHUNK (16ULL << 20)
+/* A segment this large is rewritten once less than half of it is still referenced. */
+#define KISLAY_NODE_SEGMENT_COMPACT_BYTES (64ULL << 20)
+
+/*
+ * Append-only, unlinked spill file for cold node scopes. Its address range is
+ * reserved up front and mapped chunk by chunk as it grows, so a record never
+ * moves while a stub or snapshot still points into it.
+ */
+struct kislay_node_segment_t {
+    int fd = -1;
+    char *base = nullptr;
+    std::size_t size = 0;
+    std::size_t mapped = 0;
+
+    ~kislay_node_segment_t() {
+        if (base != nullptr) {
+            munmap(base, KISLAY_NODE_SEGMENT_RESERVE);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+struct kislay_node_resident_t {
+    const kislay_scope_t *scope = nullptr;
+    std::size_t bytes = 0;
+    std::uint64_t tick = 0;
+};
+
+/* Node scopes kept in memory under max_resident_bytes; guarded by the server lock. */
+struct kislay_node_tier_t {
+    std::size_t max_resident_bytes = 0;
+    std::string segment_dir;
+    std::shared_ptr<kislay_node_segment_t> segment;
+    std::unordered_map<scope_ptr_t *, kislay_node_resident_t> resident;
+    std::size_t resident_bytes = 0;
+    std::size_t live_bytes = 0;
+    std::uint64_t tick = 0;
+    std::uint64_t loads = 0;
+    std::uint64_t spills = 0;
+    std::uint64_t compactions = 0;
+    std::string last_error;
+};
+
 struct php_kislayphp_config_server_t {
-    flat_map_t global_scope;
+    scope_ptr_t global_scope;
     scope_map_t environment_scopes;
     scope_map_t project_scopes;
     project_scope_map_t service_scopes;
     node_scope_map_t node_scopes;
     std::string host;
     zend_long port;
+    int socket_mode;
     int listen_fd;
     bool running;
     std::uint64_t revision;
     std::string version;
     pthread_mutex_t lock;
+    kislay_server_persistence_t persistence;
+    kislay_server_replication_t replication;
+    kislay_worker_pool_t workers;
+    kislay_server_connections_t connections;
+    kislay_server_coalescer_t coalescer;
+    kislay_server_agent_t agent;
+    kislay_node_tier_t tier;
+    kislay_server_metrics_t metrics;
     zend_object std;
 };
 
+/* Point-in-time copy of the scope tree; scopes are shared, never copied. */
+struct kislay_server_snapshot_t {
+    std::uint64_t revision;
+    std::string version;
+    scope_ptr_t global_scope;
+    scope_map_t environment_scopes;
+    scope_map_t project_scopes;
+    project_scope_map_t service_scopes;
+    node_scope_map_t node_scopes;
+};
+
+/*
+ * One scope write; scope is the path under /v1/config, e.g. {"projects", "commerce"}.
+ * set replaces the scope with values; patch upserts values and erases deletes.
+ */
+struct kislay_scope_op_t {
+    std::vector<std::string> scope;
+    scope_ptr_t values;
+    bool patch = false;
+    std::vector<std::string> deletes;
+};
+
+#define KISLAY_HTTP_MAX_HEADERS 32
+#define KISLAY_HTTP_MAX_HEADER_BYTES (64 * 1024)
+#define KISLAY_HTTP_MAX_BODY_BYTES (256 * 1024 * 1024)
+/* A connection thread frees a request buffer that grew past this instead of keeping it. */
+#define KISLAY_HTTP_KEEP_BUFFER_BYTES (1024 * 1024)
+/* Smaller resolves are sent uncompressed. */
+#define KISLAY_GZIP_MIN_BYTES 1024
+
+/* Offset and length into kislay_http_request_t::buffer; offsets survive buffer growth. */
+struct kislay_http_span_t {
+    std::uint32_t offset;
+    std::uint32_t length;
+};
+
+struct kislay_http_header_t {
+    kislay_http_span_t name;
+    kislay_http_span_t value;
+};
+
+enum kislay_http_parse_t {
+    KISLAY_HTTP_INCOMPLETE,
+    KISLAY_HTTP_COMPLETE,
+    KISLAY_HTTP_INVALID
+};
+
+/*
+ * A request parsed in place over its receive buffer. buffer.size() is the
+ * capacity and `length` the bytes received; connection threads reuse one
+ * request, so steady-state parsing allocates nothing. A buffer grown past
+ * KISLAY_HTTP_KEEP_BUFFER_BYTES by a large body is released after use.
+ */
 struct kislay_http_request_t {
-    std::string method;
-    std::string uri;
-    std::string path;
-    std::string query;
-    std::string body;
-    std::map<std::string, std::string> headers;
+    std::string buffer;
+    std::size_t length = 0;
+    std::size_t scanned = 0;
+    std::size_t header_end = 0;
+    std::size_t content_length = 0;
+    kislay_http_span_t method = {0, 0};
+    kislay_http_span_t uri = {0, 0};
+    kislay_http_span_t path = {0, 0};
+    kislay_http_span_t query = {0, 0};
+    kislay_http_span_t body = {0, 0};
+    kislay_http_header_t headers[KISLAY_HTTP_MAX_HEADERS];
+    std::size_t header_count = 0;
 };
 
 struct kislay_scoped_pthread_lock_t {
@@ -146,22 +1070,128 @@ struct kislay_scoped_pthread_lock_t {
     }
 };
 
+/* Set on connection threads only; everywhere else metrics recording is a no-op. */
+static thread_local kislay_metrics_shard_t *kislay_metrics_shard = nullptr;
+
+static inline void kislay_metric_add(std::atomic<std::uint64_t> &counter, std::uint64_t delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+static std::uint64_t kislay_histogram_bound_us(std::size_t index) {
+    std::uint64_t power = std::uint64_t(1) << (4 + index / 2);
+    return index % 2 == 0 ? power : power + power / 2;
+}
+
+static void kislay_histogram_record(kislay_histogram_t &histogram, std::uint64_t value_us) {
+    std::size_t index = 0;
+    if (value_us > 16) {
+        std::size_t exponent = 63 - static_cast<std::size_t>(__builtin_clzll(value_us - 1));
+        index = (exponent - 4) * 2 + (value_us <= (std::uint64_t(3) << (exponent - 1)) ? 1 : 2);
+        index = std::min(index, static_cast<std::size_t>(KISLAY_HISTOGRAM_BOUNDS));
+    }
+    kislay_metric_add(histogram.buckets[index], 1);
+    kislay_metric_add(histogram.count, 1);
+    kislay_metric_add(histogram.sum_us, value_us);
+}
+
+static std::uint64_t kislay_elapsed_us(std::chrono::steady_clock::time_point since) {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count());
+}
+
+/* Takes kislay_runtime_lock; only contended acquisitions pay for a clock read. */
+struct kislay_runtime_guard_t {
+    kislay_runtime_guard_t() {
+        if (pthread_mutex_trylock(&kislay_runtime_lock) != 0) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            pthread_mutex_lock(&kislay_runtime_lock);
+            kislay_runtime_stats.lock_contended++;
+            kislay_runtime_stats.lock_wait_ns += static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+        kislay_runtime_stats.lock_acquisitions++;
+    }
+
+    ~kislay_runtime_guard_t() {
+        pthread_mutex_unlock(&kislay_runtime_lock);
+    }
+};
+
+static double kislay_elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+/* Collects phases for one boot or refresh and stores them in `target` when it ends. */
+struct kislay_runtime_phase_scope_t {
+    kislay_runtime_phases_t *target;
+    kislay_runtime_phases_t current;
+    std::chrono::steady_clock::time_point start;
+
+    explicit kislay_runtime_phase_scope_t(kislay_runtime_phases_t *destination)
+        : target(destination), start(std::chrono::steady_clock::now()) {
+        current.recorded = true;
+        kislay_runtime_phases = &current;
+    }
+
+    ~kislay_runtime_phase_scope_t() {
+        current.total_ms = kislay_elapsed_ms(start);
+        *target = current;
+        kislay_runtime_phases = nullptr;
+    }
+};
+
+/* An http:// URL, or a unix:// URL where unix_path names the socket and path is the HTTP path after it. */
 struct kislay_http_url_t {
     std::string host;
     int port;
     std::string path;
+    std::string unix_path;
 };
 
+#define KISLAY_UNIX_PREFIX "unix://"
+
 static inline php_kislayphp_config_client_t *php_kislayphp_config_client_from_obj(zend_object *obj) {
     return reinterpret_cast<php_kislayphp_config_client_t *>(
         reinterpret_cast<char *>(obj) - XtOffsetOf(php_kislayphp_config_client_t, std));
 }
 
+static inline php_kislayphp_config_snapshot_t *php_kislayphp_config_snapshot_from_obj(zend_object *obj) {
+    return reinterpret_cast<php_kislayphp_config_snapshot_t *>(
+        reinterpret_cast<char *>(obj) - XtOffsetOf(php_kislayphp_config_snapshot_t, std));
+}
+
 static inline php_kislayphp_config_server_t *php_kislayphp_config_server_from_obj(zend_object *obj) {
     return reinterpret_cast<php_kislayphp_config_server_t *>(
         reinterpret_cast<char *>(obj) - XtOffsetOf(php_kislayphp_config_server_t, std));
 }
 
+/* Takes server->lock, timing the wait when called from a connection thread. */
+static void kislay_server_lock(php_kislayphp_config_server_t *server) {
+    kislay_metrics_shard_t *shard = kislay_metrics_shard;
+    if (shard == nullptr) {
+        pthread_mutex_lock(&server->lock);
+        return;
+    }
+    if (pthread_mutex_trylock(&server->lock) == 0) {
+        kislay_histogram_record(shard->lock_wait, 0);
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pthread_mutex_lock(&server->lock);
+    kislay_histogram_record(shard->lock_wait, kislay_elapsed_us(start));
+}
+
+struct kislay_server_lock_guard_t {
+    php_kislayphp_config_server_t *server;
+
+    explicit kislay_server_lock_guard_t(php_kislayphp_config_server_t *target) : server(target) {
+        kislay_server_lock(server);
+    }
+
+    ~kislay_server_lock_guard_t() {
+        pthread_mutex_unlock(&server->lock);
+    }
+};
+
 static bool kislay_call_function(const char *name, zval *retval, uint32_t param_count, zval params[]) {
     zval function_name;
     ZVAL_STRING(&function_name, name);
@@ -226,6 +1256,13 @@ static std::string kislay_to_lower(std::string value) {
     return value;
 }
 
+static inline int kislay_hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
 static std::string kislay_url_decode(const std::string &value) {
     std::string result;
     result.reserve(value.size());
@@ -249,6 +1286,23 @@ static std::string kislay_url_decode(const std::string &value) {
     return result;
 }
 
+static std::string kislay_url_encode(const std::string &value) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string result;
+    result.reserve(value.size());
+    for (std::size_t i = 0; i < value.size(); ++i) {
+        unsigned char ch = static_cast<unsigned char>(value[i]);
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' || ch == '_' || ch == '.' || ch == '~') {
+            result.push_back(static_cast<char>(ch));
+        } else {
+            result.push_back('%');
+            result.push_back(hex[ch >> 4]);
+            result.push_back(hex[ch & 15]);
+        }
+    }
+    return result;
+}
+
 static std::vector<std::string> kislay_split(const std::string &value, char delimiter) {
     std::vector<std::string> parts;
     std::stringstream stream(value);
@@ -259,23 +1313,6 @@ static std::vector<std::string> kislay_split(const std::string &value, char deli
     return parts;
 }
 
-static std::map<std::string, std::string> kislay_parse_query(const std::string &query) {
-    std::map<std::string, std::string> out;
-    std::vector<std::string> pairs = kislay_split(query, '&');
-    for (std::size_t i = 0; i < pairs.size(); ++i) {
-        if (pairs[i].empty()) {
-            continue;
-        }
-        std::size_t eq = pairs[i].find('=');
-        if (eq == std::string::npos) {
-            out[kislay_url_decode(pairs[i])] = "";
-        } else {
-            out[kislay_url_decode(pairs[i].substr(0, eq))] = kislay_url_decode(pairs[i].substr(eq + 1));
-        }
-    }
-    return out;
-}
-
 static std::string kislay_env_key_to_config_key(const std::string &env_key, const std::string &prefix) {
     if (env_key.size() < prefix.size() || env_key.compare(0, prefix.size(), prefix) != 0) {
         return std::string();
@@ -387,35 +1424,113 @@ static void kislay_merge_flat_map(flat_map_t *target, const flat_map_t &source)
     }
 }
 
-static std::string kislay_checksum_for_map(const flat_map_t &values) {
-    std::vector<std::string> keys;
-    keys.reserve(values.size());
-    for (flat_map_t::const_iterator it = values.begin(); it != values.end(); ++it) {
-        keys.push_back(it->first);
-    }
-    std::sort(keys.begin(), keys.end());
-    std::uint64_t hash = 1469598103934665603ULL;
-    for (std::size_t i = 0; i < keys.size(); ++i) {
-        const std::string &key = keys[i];
-        const std::string &value = values.find(key)->second;
-        const std::string combined = key + "=" + value + "\n";
-        for (std::size_t j = 0; j < combined.size(); ++j) {
-            hash ^= static_cast<unsigned char>(combined[j]);
-            hash *= 1099511628211ULL;
-        }
-    }
-    std::ostringstream oss;
-    oss << std::hex << hash;
-    return oss.str();
+/*
+ * Strong per-entry hash. Checksums are the sum of these over a map, so they
+ * do not depend on order and one changed key is a subtract and an add.
+ */
+static inline std::uint64_t kislay_entry_hash(std::uint64_t key_hash, std::uint64_t value_hash) {
+    return kislay_mix64(key_hash ^ kislay_mix64(value_hash + 0x9e3779b97f4a7c15ULL));
 }
 
-static bool kislay_write_text_file(const std::string &path, const std::string &body) {
-    std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
-    if (!out.is_open()) {
-        return false;
-    }
-    out << body;
-    return out.good();
+static inline std::uint64_t kislay_entry_hash(const std::string &key, const std::string &value) {
+    return kislay_entry_hash(kislay_string_hash(key.data(), key.size()), kislay_string_hash(value.data(), value.size()));
+}
+
+static std::string kislay_checksum_hex(std::uint64_t sum) {
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%llx", static_cast<unsigned long long>(sum));
+    return buffer;
+}
+
+static std::uint64_t kislay_checksum_sum_for_map(const flat_map_t &values) {
+    std::uint64_t sum = 0;
+    for (flat_map_t::const_iterator it = values.begin(); it != values.end(); ++it) {
+        sum += kislay_entry_hash(it->first, it->second);
+    }
+    return sum;
+}
+
+static std::string kislay_checksum_for_map(const flat_map_t &values) {
+    return kislay_checksum_hex(kislay_checksum_sum_for_map(values));
+}
+
+/* Same digest as kislay_checksum_for_map, from the hashes the string pool already holds. */
+static std::string kislay_checksum_for_entries(const kislay_entries_t &entries) {
+    std::uint64_t sum = 0;
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        sum += kislay_entry_hash(entries[i].first->hash, entries[i].second->hash);
+    }
+    return kislay_checksum_hex(sum);
+}
+
+/*
+ * Merkle tree over a resolved map for /v1/config/resolve-diff. A key lands in
+ * the bucket named by the top bits of its mixed hash, a bucket's hash is the
+ * sum of its entry hashes, and each parent is the sum of its children, so any
+ * level can be folded from the leaves and entries can be added or removed
+ * without rehashing the rest. The root is the map's checksum.
+ */
+
+static inline std::size_t kislay_merkle_bucket(std::uint64_t key_hash, int bits) {
+    return static_cast<std::size_t>(kislay_mix64(key_hash) >> (64 - bits));
+}
+
+/* Bucket depth for a map of `keys` entries: about 32 keys per bucket. */
+static int kislay_merkle_bits(std::size_t keys) {
+    int bits = 1;
+    while (bits < KISLAY_MERKLE_MAX_BITS && (keys >> (bits + 5)) > 1) {
+        ++bits;
+    }
+    return bits;
+}
+
+static std::string kislay_merkle_hex(std::uint64_t hash) {
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(hash));
+    return std::string(buffer, 16);
+}
+
+/* Overlays source on target, both sorted by key handle; the result borrows the scopes' references. */
+static void kislay_merge_entries(kislay_entries_t *target, const kislay_entries_t &source) {
+    if (source.empty()) {
+        return;
+    }
+    if (target->empty()) {
+        *target = source;
+        return;
+    }
+    kislay_entries_t merged;
+    merged.reserve(target->size() + source.size());
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i < target->size() || j < source.size()) {
+        if (j == source.size() || (i < target->size() && kislay_entry_key_less((*target)[i], source[j]))) {
+            merged.push_back((*target)[i++]);
+            continue;
+        }
+        if (i < target->size() && (*target)[i].first == source[j].first) {
+            i++;
+        }
+        merged.push_back(source[j++]);
+    }
+    target->swap(merged);
+}
+
+static void kislay_entries_to_array(const kislay_entries_t &entries, zval *return_value) {
+    array_init_size(return_value, static_cast<uint32_t>(entries.size()));
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        add_assoc_stringl_ex(return_value, entries[i].first->data, entries[i].first->length,
+            entries[i].second->data, entries[i].second->length);
+    }
+}
+
+static bool kislay_write_text_file(const std::string &path, const std::string &body) {
+    std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
+    if (!out.is_open()) {
+        return false;
+    }
+    out << body;
+    return out.good();
 }
 
 static bool kislay_read_text_file(const std::string &path, std::string *body) {
@@ -429,466 +1544,3438 @@ static bool kislay_read_text_file(const std::string &path, std::string *body) {
     return true;
 }
 
-static bool kislay_parse_http_url(const std::string &url, kislay_http_url_t *parsed) {
-    std::string work = url;
-    const std::string http_prefix("http://");
-    if (work.compare(0, http_prefix.size(), http_prefix) == 0) {
-        work = work.substr(http_prefix.size());
-    }
-    std::size_t slash = work.find('/');
-    std::string authority = slash == std::string::npos ? work : work.substr(0, slash);
-    parsed->path = slash == std::string::npos ? "/" : work.substr(slash);
-    std::size_t colon = authority.rfind(':');
-    if (colon == std::string::npos) {
-        parsed->host = authority;
-        parsed->port = 80;
-    } else {
-        parsed->host = authority.substr(0, colon);
-        parsed->port = std::atoi(authority.substr(colon + 1).c_str());
-        if (parsed->port <= 0) {
-            parsed->port = 80;
-        }
-    }
-    return !parsed->host.empty();
+static void kislay_json_append_utf16(std::string *out, std::uint32_t unit) {
+    static const char hex[] = "0123456789abcdef";
+    out->append("\\u");
+    out->push_back(hex[(unit >> 12) & 0xF]);
+    out->push_back(hex[(unit >> 8) & 0xF]);
+    out->push_back(hex[(unit >> 4) & 0xF]);
+    out->push_back(hex[unit & 0xF]);
 }
 
-static bool kislay_http_request(const std::string &method, const std::string &url, const std::string &body, int *status_code, std::string *response_body, std::string *error) {
-    kislay_http_url_t parsed;
-    if (!kislay_parse_http_url(url, &parsed)) {
-        if (error != nullptr) {
-            *error = "Invalid URL";
+/*
+ * Mirrors json_encode() with default flags so payloads produced off the PHP
+ * thread are byte-identical to the ones PHP would produce. Invalid UTF-8 is
+ * replaced with U+FFFD instead of failing the whole document.
+ */
+static void kislay_json_append_string(std::string *out, const char *value, std::size_t size) {
+    out->push_back('"');
+    std::size_t i = 0;
+    while (i < size) {
+        unsigned char ch = static_cast<unsigned char>(value[i]);
+        if (ch < 0x80) {
+            switch (ch) {
+                case '"': out->append("\\\""); break;
+                case '\\': out->append("\\\\"); break;
+                case '/': out->append("\\/"); break;
+                case '\b': out->append("\\b"); break;
+                case '\f': out->append("\\f"); break;
+                case '\n': out->append("\\n"); break;
+                case '\r': out->append("\\r"); break;
+                case '\t': out->append("\\t"); break;
+                default:
+                    if (ch < 0x20) {
+                        kislay_json_append_utf16(out, ch);
+                    } else {
+                        out->push_back(static_cast<char>(ch));
+                    }
+            }
+            i++;
+            continue;
         }
-        return false;
-    }
-
-    struct addrinfo hints;
-    std::memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
 
-    struct addrinfo *result = nullptr;
-    std::string port = std::to_string(parsed.port);
-    if (getaddrinfo(parsed.host.c_str(), port.c_str(), &hints, &result) != 0) {
-        if (error != nullptr) {
-            *error = "getaddrinfo failed";
+        std::uint32_t codepoint = 0;
+        std::size_t length = 0;
+        if ((ch & 0xE0) == 0xC0) {
+            codepoint = ch & 0x1F;
+            length = 2;
+        } else if ((ch & 0xF0) == 0xE0) {
+            codepoint = ch & 0x0F;
+            length = 3;
+        } else if ((ch & 0xF8) == 0xF0) {
+            codepoint = ch & 0x07;
+            length = 4;
         }
-        return false;
-    }
-
-    int fd = -1;
-    for (struct addrinfo *rp = result; rp != nullptr; rp = rp->ai_next) {
-        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (fd == -1) {
-            continue;
+        bool valid = length != 0 && i + length <= size;
+        for (std::size_t j = 1; valid && j < length; ++j) {
+            unsigned char next = static_cast<unsigned char>(value[i + j]);
+            if ((next & 0xC0) != 0x80) {
+                valid = false;
+            } else {
+                codepoint = (codepoint << 6) | (next & 0x3F);
+            }
         }
-        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
-            break;
+        if (valid && ((length == 2 && codepoint < 0x80) ||
+                      (length == 3 && (codepoint < 0x800 || (codepoint >= 0xD800 && codepoint <= 0xDFFF))) ||
+                      (length == 4 && (codepoint < 0x10000 || codepoint > 0x10FFFF)))) {
+            valid = false;
         }
-        close(fd);
-        fd = -1;
+        if (!valid) {
+            codepoint = 0xFFFD;
+            length = 1;
+        }
+        if (codepoint >= 0x10000) {
+            codepoint -= 0x10000;
+            kislay_json_append_utf16(out, 0xD800 + (codepoint >> 10));
+            kislay_json_append_utf16(out, 0xDC00 + (codepoint & 0x3FF));
+        } else {
+            kislay_json_append_utf16(out, codepoint);
+        }
+        i += length;
     }
-    freeaddrinfo(result);
+    out->push_back('"');
+}
 
-    if (fd == -1) {
-        if (error != nullptr) {
-            *error = "connect failed";
+static void kislay_json_append_string(std::string *out, const std::string &value) {
+    kislay_json_append_string(out, value.data(), value.size());
+}
+
+static void kislay_json_append_flat_map(std::string *out, const flat_map_t &values) {
+    out->push_back('{');
+    bool first = true;
+    for (flat_map_t::const_iterator it = values.begin(); it != values.end(); ++it) {
+        if (!first) {
+            out->push_back(',');
         }
-        return false;
+        first = false;
+        kislay_json_append_string(out, it->first);
+        out->push_back(':');
+        kislay_json_append_string(out, it->second);
     }
+    out->push_back('}');
+}
 
-    std::ostringstream request;
-    request << method << " " << parsed.path << " HTTP/1.1\r\n";
-    request << "Host: " << parsed.host << "\r\n";
-    request << "Connection: close\r\n";
-    if (!body.empty()) {
-        request << "Content-Type: application/json\r\n";
-        request << "Content-Length: " << body.size() << "\r\n";
+static void kislay_json_append_entries(std::string *out, const kislay_entries_t &entries) {
+    out->push_back('{');
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        if (i > 0) {
+            out->push_back(',');
+        }
+        kislay_json_append_string(out, entries[i].first->data, entries[i].first->length);
+        out->push_back(':');
+        kislay_json_append_string(out, entries[i].second->data, entries[i].second->length);
     }
-    request << "\r\n";
-    request << body;
+    out->push_back('}');
+}
 
-    const std::string wire = request.str();
-    std::size_t sent = 0;
-    while (sent < wire.size()) {
-        ssize_t wrote = send(fd, wire.data() + sent, wire.size() - sent, 0);
-        if (wrote <= 0) {
-            if (error != nullptr) {
-                *error = "send failed";
-            }
-            close(fd);
-            return false;
+static void kislay_json_append_string_list(std::string *out, const std::vector<std::string> &values) {
+    out->push_back('[');
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        if (i > 0) {
+            out->push_back(',');
         }
-        sent += static_cast<std::size_t>(wrote);
+        kislay_json_append_string(out, values[i]);
     }
+    out->push_back(']');
+}
 
-    std::string response;
-    char buffer[4096];
-    for (;;) {
-        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
-        if (received == 0) {
-            break;
-        }
-        if (received < 0) {
-            if (error != nullptr) {
-                *error = "recv failed";
+/*
+ * Minimal JSON reader for code that runs off the PHP thread (replication,
+ * checkpoint restore), where json_decode() is not available. Numbers keep
+ * their source text; kislay_json_scalar_string() converts like PHP would.
+ */
+struct kislay_json_value_t {
+    enum kind_t { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+    kind_t kind = JSON_NULL;
+    bool boolean = false;
+    std::string text;
+    std::vector<kislay_json_value_t> items;
+    std::vector<std::pair<std::string, kislay_json_value_t>> members;
+
+    const kislay_json_value_t *find(const char *key) const {
+        for (std::size_t i = 0; i < members.size(); ++i) {
+            if (members[i].first == key) {
+                return &members[i].second;
             }
-            close(fd);
-            return false;
         }
-        response.append(buffer, static_cast<std::size_t>(received));
+        return nullptr;
     }
-    close(fd);
+};
 
-    std::size_t header_end = response.find("\r\n\r\n");
-    if (header_end == std::string::npos) {
-        if (error != nullptr) {
-            *error = "Invalid HTTP response";
-        }
-        return false;
-    }
+struct kislay_json_reader_t {
+    const char *cur;
+    const char *end;
+    int depth;
 
-    std::string headers = response.substr(0, header_end);
-    if (response_body != nullptr) {
-        *response_body = response.substr(header_end + 4);
+    void skip_ws() {
+        while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r' || *cur == '\n')) {
+            cur++;
+        }
     }
 
-    std::size_t first_space = headers.find(' ');
-    if (first_space == std::string::npos) {
-        if (error != nullptr) {
-            *error = "Invalid status line";
+    static void append_utf8(std::string *out, std::uint32_t cp) {
+        if (cp < 0x80) {
+            out->push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            out->push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            out->push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out->push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            out->push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out->push_back(static_cast<char>(0x80 | (cp & 0x3F)));
         }
-        return false;
-    }
-    std::size_t second_space = headers.find(' ', first_space + 1);
-    std::string code = headers.substr(first_space + 1, second_space == std::string::npos ? std::string::npos : (second_space - first_space - 1));
-    if (status_code != nullptr) {
-        *status_code = std::atoi(code.c_str());
     }
-    return true;
-}
 
-static bool kislay_http_read_request(int fd, kislay_http_request_t *request) {
-    std::string incoming;
-    char buffer[4096];
-    std::size_t header_end = std::string::npos;
-    while ((header_end = incoming.find("\r\n\r\n")) == std::string::npos) {
-        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
-        if (received <= 0) {
+    bool read_hex4(std::uint32_t *out) {
+        if (end - cur < 4) {
             return false;
         }
-        incoming.append(buffer, static_cast<std::size_t>(received));
-        if (incoming.size() > 1024 * 1024) {
-            return false;
+        std::uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            char ch = cur[i];
+            value <<= 4;
+            if (ch >= '0' && ch <= '9') {
+                value |= static_cast<std::uint32_t>(ch - '0');
+            } else if (ch >= 'a' && ch <= 'f') {
+                value |= static_cast<std::uint32_t>(ch - 'a' + 10);
+            } else if (ch >= 'A' && ch <= 'F') {
+                value |= static_cast<std::uint32_t>(ch - 'A' + 10);
+            } else {
+                return false;
+            }
         }
+        cur += 4;
+        *out = value;
+        return true;
     }
 
-    std::string header_block = incoming.substr(0, header_end);
-    std::string body = incoming.substr(header_end + 4);
-
-    std::istringstream stream(header_block);
-    std::string request_line;
-    if (!std::getline(stream, request_line)) {
+    bool parse_string(std::string *out) {
+        if (cur >= end || *cur != '"') {
+            return false;
+        }
+        cur++;
+        while (cur < end) {
+            const char *run = cur;
+            while (cur < end && *cur != '"' && *cur != '\\' && static_cast<unsigned char>(*cur) >= 0x20) {
+                cur++;
+            }
+            out->append(run, static_cast<std::size_t>(cur - run));
+            if (cur >= end || static_cast<unsigned char>(*cur) < 0x20) {
+                return false;
+            }
+            if (*cur == '"') {
+                cur++;
+                return true;
+            }
+            cur++;
+            if (cur >= end) {
+                return false;
+            }
+            char escape = *cur++;
+            switch (escape) {
+                case '"': out->push_back('"'); break;
+                case '\\': out->push_back('\\'); break;
+                case '/': out->push_back('/'); break;
+                case 'b': out->push_back('\b'); break;
+                case 'f': out->push_back('\f'); break;
+                case 'n': out->push_back('\n'); break;
+                case 'r': out->push_back('\r'); break;
+                case 't': out->push_back('\t'); break;
+                case 'u': {
+                    std::uint32_t cp = 0;
+                    if (!read_hex4(&cp)) {
+                        return false;
+                    }
+                    if (cp >= 0xD800 && cp <= 0xDBFF) {
+                        std::uint32_t low = 0;
+                        if (end - cur < 2 || cur[0] != '\\' || cur[1] != 'u') {
+                            return false;
+                        }
+                        cur += 2;
+                        if (!read_hex4(&low) || low < 0xDC00 || low > 0xDFFF) {
+                            return false;
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                        return false;
+                    }
+                    append_utf8(out, cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
         return false;
     }
-    if (!request_line.empty() && request_line[request_line.size() - 1] == '\r') {
-        request_line.erase(request_line.size() - 1);
-    }
-    std::istringstream line_stream(request_line);
-    line_stream >> request->method >> request->uri;
 
-    std::string header_line;
-    std::size_t content_length = 0;
-    while (std::getline(stream, header_line)) {
-        if (!header_line.empty() && header_line[header_line.size() - 1] == '\r') {
-            header_line.erase(header_line.size() - 1);
+    bool parse_number(std::string *out) {
+        const char *start = cur;
+        if (cur < end && *cur == '-') {
+            cur++;
         }
-        std::size_t colon = header_line.find(':');
-        if (colon == std::string::npos) {
-            continue;
+        if (cur < end && *cur == '0') {
+            cur++;
+        } else if (cur < end && *cur >= '1' && *cur <= '9') {
+            while (cur < end && *cur >= '0' && *cur <= '9') {
+                cur++;
+            }
+        } else {
+            return false;
+        }
+        if (cur < end && *cur == '.') {
+            cur++;
+            if (cur >= end || *cur < '0' || *cur > '9') {
+                return false;
+            }
+            while (cur < end && *cur >= '0' && *cur <= '9') {
+                cur++;
+            }
         }
-        std::string key = kislay_to_lower(kislay_trim(header_line.substr(0, colon)));
-        std::string value = kislay_trim(header_line.substr(colon + 1));
-        request->headers[key] = value;
-        if (key == "content-length") {
-            content_length = static_cast<std::size_t>(std::strtoull(value.c_str(), nullptr, 10));
+        if (cur < end && (*cur == 'e' || *cur == 'E')) {
+            cur++;
+            if (cur < end && (*cur == '+' || *cur == '-')) {
+                cur++;
+            }
+            if (cur >= end || *cur < '0' || *cur > '9') {
+                return false;
+            }
+            while (cur < end && *cur >= '0' && *cur <= '9') {
+                cur++;
+            }
         }
+        out->assign(start, static_cast<std::size_t>(cur - start));
+        return true;
     }
 
-    while (body.size() < content_length) {
-        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
-        if (received <= 0) {
+    bool match(const char *literal) {
+        std::size_t len = std::strlen(literal);
+        if (static_cast<std::size_t>(end - cur) < len || std::memcmp(cur, literal, len) != 0) {
             return false;
         }
-        body.append(buffer, static_cast<std::size_t>(received));
+        cur += len;
+        return true;
     }
-    request->body = body.substr(0, content_length);
 
-    std::size_t q = request->uri.find('?');
-    request->path = q == std::string::npos ? request->uri : request->uri.substr(0, q);
-    request->query = q == std::string::npos ? std::string() : request->uri.substr(q + 1);
-    return true;
-}
+    bool parse_value(kislay_json_value_t *out) {
+        skip_ws();
+        if (cur >= end) {
+            return false;
+        }
+        switch (*cur) {
+            case '{': {
+                if (++depth > 64) {
+                    return false;
+                }
+                cur++;
+                out->kind = kislay_json_value_t::JSON_OBJECT;
+                skip_ws();
+                if (cur < end && *cur == '}') {
+                    cur++;
+                    depth--;
+                    return true;
+                }
+                for (;;) {
+                    skip_ws();
+                    out->members.push_back(std::make_pair(std::string(), kislay_json_value_t()));
+                    if (!parse_string(&out->members.back().first)) {
+                        return false;
+                    }
+                    skip_ws();
+                    if (cur >= end || *cur != ':') {
+                        return false;
+                    }
+                    cur++;
+                    if (!parse_value(&out->members.back().second)) {
+                        return false;
+                    }
+                    skip_ws();
+                    if (cur < end && *cur == ',') {
+                        cur++;
+                        continue;
+                    }
+                    if (cur < end && *cur == '}') {
+                        cur++;
+                        depth--;
+                        return true;
+                    }
+                    return false;
+                }
+            }
+            case '[': {
+                if (++depth > 64) {
+                    return false;
+                }
+                cur++;
+                out->kind = kislay_json_value_t::JSON_ARRAY;
+                skip_ws();
+                if (cur < end && *cur == ']') {
+                    cur++;
+                    depth--;
+                    return true;
+                }
+                for (;;) {
+                    out->items.push_back(kislay_json_value_t());
+                    if (!parse_value(&out->items.back())) {
+                        return false;
+                    }
+                    skip_ws();
+                    if (cur < end && *cur == ',') {
+                        cur++;
+                        continue;
+                    }
+                    if (cur < end && *cur == ']') {
+                        cur++;
+                        depth--;
+                        return true;
+                    }
+                    return false;
+                }
+            }
+            case '"':
+                out->kind = kislay_json_value_t::JSON_STRING;
+                return parse_string(&out->text);
+            case 't':
+                out->kind = kislay_json_value_t::JSON_BOOL;
+                out->boolean = true;
+                return match("true");
+            case 'f':
+                out->kind = kislay_json_value_t::JSON_BOOL;
+                out->boolean = false;
+                return match("false");
+            case 'n':
+                out->kind = kislay_json_value_t::JSON_NULL;
+                return match("null");
+            default:
+                out->kind = kislay_json_value_t::JSON_NUMBER;
+                return parse_number(&out->text);
+        }
+    }
+};
 
-static void kislay_http_send_response(int fd, int status_code, const std::string &content_type, const std::string &body) {
-    std::ostringstream response;
-    const char *status_text = "OK";
-    if (status_code == 400) status_text = "Bad Request";
-    if (status_code == 404) status_text = "Not Found";
-    if (status_code == 405) status_text = "Method Not Allowed";
-    if (status_code == 500) status_text = "Internal Server Error";
-    response << "HTTP/1.1 " << status_code << ' ' << status_text << "\r\n";
-    response << "Content-Type: " << content_type << "\r\n";
-    response << "Content-Length: " << body.size() << "\r\n";
-    response << "Connection: close\r\n\r\n";
-    response << body;
-    const std::string wire = response.str();
-    send(fd, wire.data(), wire.size(), 0);
+static bool kislay_json_parse(const char *data, std::size_t size, kislay_json_value_t *out) {
+    kislay_json_reader_t reader;
+    reader.cur = data;
+    reader.end = data + size;
+    reader.depth = 0;
+    if (!reader.parse_value(out)) {
+        return false;
+    }
+    reader.skip_ws();
+    return reader.cur == reader.end;
 }
 
-static void kislay_server_bump_version(php_kislayphp_config_server_t *server) {
-    server->revision++;
-    server->version = std::to_string(static_cast<unsigned long long>(server->revision));
+static bool kislay_json_parse(const std::string &json, kislay_json_value_t *out) {
+    return kislay_json_parse(json.data(), json.size(), out);
 }
 
-static flat_map_t kislay_server_resolve_locked(php_kislayphp_config_server_t *server, const std::string &environment, const std::string &project, const std::string &service, const std::string &node) {
-    flat_map_t result;
-    kislay_merge_flat_map(&result, server->global_scope);
-
-    scope_map_t::const_iterator env_it = server->environment_scopes.find(environment);
-    if (env_it != server->environment_scopes.end()) {
-        kislay_merge_flat_map(&result, env_it->second);
+/* (string) of a json_decode()d scalar: ints stay ints, floats use precision=14. */
+static std::string kislay_json_scalar_string(const kislay_json_value_t &value) {
+    switch (value.kind) {
+        case kislay_json_value_t::JSON_NULL:
+            return "null";
+        case kislay_json_value_t::JSON_BOOL:
+            return value.boolean ? "true" : "false";
+        case kislay_json_value_t::JSON_STRING:
+            return value.text;
+        case kislay_json_value_t::JSON_NUMBER: {
+            if (value.text.find_first_of(".eE") == std::string::npos) {
+                errno = 0;
+                long long parsed = std::strtoll(value.text.c_str(), nullptr, 10);
+                if (errno != ERANGE) {
+                    return std::to_string(parsed);
+                }
+            }
+            char buffer[64];
+            std::snprintf(buffer, sizeof(buffer), "%.14G", std::strtod(value.text.c_str(), nullptr));
+            std::string out(buffer);
+            std::size_t exponent = out.find('E');
+            if (exponent != std::string::npos) {
+                std::string mantissa = out.substr(0, exponent);
+                if (mantissa.find('.') == std::string::npos) {
+                    mantissa += ".0";
+                }
+                std::size_t digits = exponent + 2;
+                while (digits + 1 < out.size() && out[digits] == '0') {
+                    digits++;
+                }
+                out = mantissa + "E" + out[exponent + 1] + out.substr(digits);
+            }
+            return out;
+        }
+        default:
+            return std::string();
     }
+}
 
-    scope_map_t::const_iterator project_it = server->project_scopes.find(project);
-    if (project_it != server->project_scopes.end()) {
-        kislay_merge_flat_map(&result, project_it->second);
+static scope_ptr_t kislay_scope_from_json(const kislay_json_value_t &value) {
+    flat_map_t values;
+    for (std::size_t i = 0; i < value.members.size(); ++i) {
+        values[value.members[i].first] = kislay_json_scalar_string(value.members[i].second);
     }
+    return std::make_shared<kislay_scope_t>(values);
+}
 
-    project_scope_map_t::const_iterator service_project_it = server->service_scopes.find(project);
-    if (service_project_it != server->service_scopes.end()) {
-        scope_map_t::const_iterator service_it = service_project_it->second.find(service);
-        if (service_it != service_project_it->second.end()) {
-            kislay_merge_flat_map(&result, service_it->second);
-        }
+/* json_decode(..., true) turns {"0":..,"1":..} into a list; json_encode then writes it back as one. */
+static bool kislay_json_is_list(const kislay_json_value_t &value) {
+    if (value.kind == kislay_json_value_t::JSON_ARRAY) {
+        return true;
     }
-
-    node_scope_map_t::const_iterator node_project_it = server->node_scopes.find(project);
-    if (node_project_it != server->node_scopes.end()) {
-        project_scope_map_t::const_iterator node_service_map_it = node_project_it->second.find(service);
-        if (node_service_map_it != node_project_it->second.end()) {
-            scope_map_t::const_iterator node_it = node_service_map_it->second.find(node);
-            if (node_it != node_service_map_it->second.end()) {
-                kislay_merge_flat_map(&result, node_it->second);
-            }
+    for (std::size_t i = 0; i < value.members.size(); ++i) {
+        if (value.members[i].first != std::to_string(static_cast<unsigned long long>(i))) {
+            return false;
         }
     }
-
-    return result;
+    return true;
 }
 
-static void kislay_runtime_rebuild_locked() {
-    kislay_runtime_active_snapshot.clear();
-    kislay_merge_flat_map(&kislay_runtime_active_snapshot, kislay_runtime_remote_snapshot);
-    kislay_merge_flat_map(&kislay_runtime_active_snapshot, kislay_runtime_local_overrides);
-    kislay_merge_flat_map(&kislay_runtime_active_snapshot, kislay_runtime_runtime_overrides);
+/* json_encode() of a decoded float with serialize_precision=-1. */
+static void kislay_json_append_double(std::string *out, double value) {
+    if (value == 0.0 || !std::isfinite(value)) {
+        out->append(std::signbit(value) ? "-0" : "0");
+        return;
+    }
+    char buffer[40];
+    for (int precision = 1; precision <= 17; ++precision) {
+        std::snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+        if (std::strtod(buffer, nullptr) == value) {
+            break;
+        }
+    }
+    std::string mantissa(buffer, std::strchr(buffer, 'e') - buffer);
+    int exponent = std::atoi(std::strchr(buffer, 'e') + 1);
+    if (mantissa[0] == '-') {
+        out->push_back('-');
+        mantissa.erase(0, 1);
+    }
+    std::string digits;
+    for (std::size_t i = 0; i < mantissa.size(); ++i) {
+        if (mantissa[i] != '.') {
+            digits.push_back(mantissa[i]);
+        }
+    }
+    while (digits.size() > 1 && digits[digits.size() - 1] == '0') {
+        digits.erase(digits.size() - 1);
+    }
+    int decpt = exponent + 1;
+    if (decpt < -3 || decpt > 17) {
+        out->push_back(digits[0]);
+        out->push_back('.');
+        out->append(digits.size() > 1 ? digits.substr(1) : std::string("0"));
+        out->append(exponent < 0 ? "e-" : "e+");
+        out->append(std::to_string(exponent < 0 ? -exponent : exponent));
+    } else if (decpt <= 0) {
+        out->append("0.");
+        out->append(static_cast<std::size_t>(-decpt), '0');
+        out->append(digits);
+    } else if (static_cast<std::size_t>(decpt) >= digits.size()) {
+        out->append(digits);
+        out->append(static_cast<std::size_t>(decpt) - digits.size(), '0');
+    } else {
+        out->append(digits, 0, static_cast<std::size_t>(decpt));
+        out->push_back('.');
+        out->append(digits, static_cast<std::size_t>(decpt), std::string::npos);
+    }
+}
 
-    extern char **environ;
-    if (!kislay_runtime_env_prefix.empty()) {
-        for (char **env = environ; env != nullptr && *env != nullptr; ++env) {
-            std::string item(*env);
-            std::size_t eq = item.find('=');
-            if (eq == std::string::npos) {
-                continue;
+/* Re-encodes a parsed value the way json_encode(json_decode($body, true)) would. */
+static void kislay_json_append_value(std::string *out, const kislay_json_value_t &value) {
+    switch (value.kind) {
+        case kislay_json_value_t::JSON_NULL:
+            out->append("null");
+            return;
+        case kislay_json_value_t::JSON_BOOL:
+            out->append(value.boolean ? "true" : "false");
+            return;
+        case kislay_json_value_t::JSON_STRING:
+            kislay_json_append_string(out, value.text);
+            return;
+        case kislay_json_value_t::JSON_NUMBER: {
+            std::string scalar = kislay_json_scalar_string(value);
+            if (scalar.find_first_of(".EN") == std::string::npos) {
+                out->append(scalar);
+            } else {
+                kislay_json_append_double(out, std::strtod(value.text.c_str(), nullptr));
             }
-            std::string key = item.substr(0, eq);
-            std::string value = item.substr(eq + 1);
-            std::string config_key = kislay_env_key_to_config_key(key, kislay_runtime_env_prefix);
-            if (!config_key.empty()) {
-                kislay_runtime_active_snapshot[config_key] = value;
+            return;
+        }
+        case kislay_json_value_t::JSON_ARRAY:
+            out->push_back('[');
+            for (std::size_t i = 0; i < value.items.size(); ++i) {
+                if (i > 0) {
+                    out->push_back(',');
+                }
+                kislay_json_append_value(out, value.items[i]);
             }
+            out->push_back(']');
+            return;
+        case kislay_json_value_t::JSON_OBJECT: {
+            bool list = kislay_json_is_list(value);
+            out->push_back(list ? '[' : '{');
+            for (std::size_t i = 0; i < value.members.size(); ++i) {
+                if (i > 0) {
+                    out->push_back(',');
+                }
+                if (!list) {
+                    kislay_json_append_string(out, value.members[i].first);
+                    out->push_back(':');
+                }
+                kislay_json_append_value(out, value.members[i].second);
+            }
+            out->push_back(list ? ']' : '}');
+            return;
         }
     }
-
-    kislay_runtime_checksum = kislay_checksum_for_map(kislay_runtime_active_snapshot);
 }
 
-static bool kislay_runtime_save_cache_locked() {
-    if (kislay_runtime_cache_file.empty()) {
-        return true;
+/* Same flattening as kislay_flatten_zval, for bodies parsed off the PHP thread. */
+static void kislay_json_flatten(const kislay_json_value_t &value, const std::string &prefix, flat_map_t *out) {
+    if (value.kind == kislay_json_value_t::JSON_ARRAY || value.kind == kislay_json_value_t::JSON_OBJECT) {
+        if (kislay_json_is_list(value)) {
+            if (!prefix.empty()) {
+                kislay_json_append_value(&(*out)[prefix], value);
+            }
+            return;
+        }
+        for (std::size_t i = 0; i < value.members.size(); ++i) {
+            std::string next = prefix;
+            if (!next.empty()) {
+                next.push_back('.');
+            }
+            next.append(value.members[i].first);
+            kislay_json_flatten(value.members[i].second, next, out);
+        }
+        return;
     }
-    zval root;
-    zval config;
-    array_init(&root);
-    add_assoc_string(&root, "version", const_cast<char *>(kislay_runtime_version.c_str()));
-    kislay_flat_map_to_array(kislay_runtime_remote_snapshot, &config);
-    add_assoc_zval(&root, "config", &config);
-    std::string json;
-    bool ok = kislay_json_encode_zval(&root, &json);
-    zval_ptr_dtor(&root);
-    if (!ok) {
+
+    if (!prefix.empty()) {
+        (*out)[prefix] = kislay_json_scalar_string(value);
+    }
+}
+
+static bool kislay_json_to_flat_map(const kislay_json_value_t &value, flat_map_t *out) {
+    if (value.kind != kislay_json_value_t::JSON_ARRAY && value.kind != kislay_json_value_t::JSON_OBJECT) {
         return false;
     }
-    return kislay_write_text_file(kislay_runtime_cache_file, json);
+    out->clear();
+    kislay_json_flatten(value, std::string(), out);
+    return true;
 }
 
-static bool kislay_runtime_load_cache_locked(std::string *error) {
-    if (kislay_runtime_cache_file.empty()) {
-        if (error) {
-            *error = "No cache file configured";
+static bool kislay_write_all(int fd, const char *data, std::size_t size) {
+    std::size_t written = 0;
+    while (written < size) {
+        ssize_t wrote = write(fd, data + written, size - written);
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
         }
-        return false;
+        written += static_cast<std::size_t>(wrote);
     }
-    std::string body;
-    if (!kislay_read_text_file(kislay_runtime_cache_file, &body)) {
-        if (error) {
-            *error = "Unable to read cache file";
+    return true;
+}
+
+static void kislay_fsync_parent_dir(const std::string &path) {
+    std::size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* temp file + fsync + rename, so readers see either the old or the new file. */
+static bool kislay_write_file_atomic(const std::string &path, const std::string &body, std::string *error) {
+    const std::string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        if (error != nullptr) {
+            *error = "Unable to open " + temp + ": " + std::strerror(errno);
         }
         return false;
     }
-    zval decoded;
-    ZVAL_UNDEF(&decoded);
-    if (!kislay_json_decode_assoc(body, &decoded) || Z_TYPE(decoded) != IS_ARRAY) {
-        if (!Z_ISUNDEF(decoded)) {
-            zval_ptr_dtor(&decoded);
+    if (!kislay_write_all(fd, body.data(), body.size()) || fsync(fd) != 0) {
+        if (error != nullptr) {
+            *error = "Unable to write " + temp + ": " + std::strerror(errno);
         }
-        if (error) {
-            *error = "Invalid cache payload";
+        close(fd);
+        unlink(temp.c_str());
+        return false;
+    }
+    close(fd);
+    if (rename(temp.c_str(), path.c_str()) != 0) {
+        if (error != nullptr) {
+            *error = "Unable to rename " + temp + ": " + std::strerror(errno);
         }
+        unlink(temp.c_str());
         return false;
     }
+    kislay_fsync_parent_dir(path);
+    return true;
+}
 
-    zval *version = zend_hash_str_find(Z_ARRVAL(decoded), "version", sizeof("version") - 1);
-    zval *config = zend_hash_str_find(Z_ARRVAL(decoded), "config", sizeof("config") - 1);
-    if (version != nullptr) {
-        kislay_runtime_version = kislay_string_from_zval(version);
-    }
-    if (config == nullptr || Z_TYPE_P(config) != IS_ARRAY) {
-        zval_ptr_dtor(&decoded);
-        if (error) {
-            *error = "Cache missing config";
+/*
+ * unix:///run/kislay.sock/v1/config/resolve has no marker between the socket
+ * path and the HTTP path, so the socket is the longest leading path that
+ * names a socket on disk. Falls back to the whole path, which then fails to
+ * connect with a clear error.
+ */
+static void kislay_split_unix_url(const std::string &rest, kislay_http_url_t *parsed) {
+    std::size_t split = rest.size();
+    struct stat info;
+    while (split != std::string::npos && split > 0) {
+        if (stat(rest.substr(0, split).c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+            break;
         }
-        return false;
+        split = rest.rfind('/', split - 1);
+    }
+    if (split == std::string::npos || split == 0) {
+        split = rest.size();
     }
+    parsed->unix_path = rest.substr(0, split);
+    parsed->path = split < rest.size() ? rest.substr(split) : std::string("/");
+    parsed->host = "localhost";
+    parsed->port = 0;
+}
 
-    kislay_runtime_remote_snapshot.clear();
-    HashTable *ht = Z_ARRVAL_P(config);
-    zend_string *key = nullptr;
-    zend_ulong index = 0;
-    zval *entry = nullptr;
-    ZEND_HASH_FOREACH_KEY_VAL(ht, index, key, entry) {
-        if (key != nullptr) {
-            kislay_runtime_remote_snapshot[std::string(ZSTR_VAL(key), ZSTR_LEN(key))] = kislay_string_from_zval(entry);
+static bool kislay_parse_http_url(const std::string &url, kislay_http_url_t *parsed) {
+    if (url.compare(0, sizeof(KISLAY_UNIX_PREFIX) - 1, KISLAY_UNIX_PREFIX) == 0) {
+        kislay_split_unix_url(url.substr(sizeof(KISLAY_UNIX_PREFIX) - 1), parsed);
+        return !parsed->unix_path.empty();
+    }
+    std::string work = url;
+    const std::string http_prefix("http://");
+    if (work.compare(0, http_prefix.size(), http_prefix) == 0) {
+        work = work.substr(http_prefix.size());
+    }
+    std::size_t slash = work.find('/');
+    std::string authority = slash == std::string::npos ? work : work.substr(0, slash);
+    parsed->path = slash == std::string::npos ? "/" : work.substr(slash);
+    std::size_t colon = authority.rfind(':');
+    if (colon == std::string::npos) {
+        parsed->host = authority;
+        parsed->port = 80;
+    } else {
+        parsed->host = authority.substr(0, colon);
+        parsed->port = std::atoi(authority.substr(colon + 1).c_str());
+        if (parsed->port <= 0) {
+            parsed->port = 80;
         }
-    } ZEND_HASH_FOREACH_END();
+    }
+    return !parsed->host.empty();
+}
 
-    zval_ptr_dtor(&decoded);
-    return true;
+/* Uniform in [0, bound]; per thread so connection threads and PHP threads never share a generator. */
+static std::uint64_t kislay_jitter(std::uint64_t bound) {
+    thread_local std::mt19937_64 generator(std::random_device{}());
+    return std::uniform_int_distribution<std::uint64_t>(0, bound)(generator);
 }
 
-static bool kislay_runtime_load_local_file_locked(const std::string &path, std::string *error) {
-    std::string body;
-    if (!kislay_read_text_file(path, &body)) {
-        if (error) {
-            *error = "Unable to read local config file";
-        }
-        return false;
+/* Streaming gunzip for HTTP response bodies; output is capped at KISLAY_HTTP_MAX_BODY_BYTES. */
+struct kislay_gzip_inflater_t {
+    z_stream stream;
+    bool active = false;
+    bool finished = false;
+
+    kislay_gzip_inflater_t() {
+        std::memset(&stream, 0, sizeof(stream));
     }
 
-    zval decoded;
-    ZVAL_UNDEF(&decoded);
-    if (!kislay_json_decode_assoc(body, &decoded) || Z_TYPE(decoded) != IS_ARRAY) {
-        if (!Z_ISUNDEF(decoded)) {
-            zval_ptr_dtor(&decoded);
-        }
-        if (error) {
-            *error = "Invalid local config JSON";
+    ~kislay_gzip_inflater_t() {
+        if (active) {
+            inflateEnd(&stream);
         }
-        return false;
     }
 
-    flat_map_t flattened;
-    if (!kislay_zval_to_flat_map(&decoded, &flattened, error)) {
-        zval_ptr_dtor(&decoded);
-        return false;
+    bool start() {
+        active = inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK;
+        return active;
     }
-    kislay_runtime_local_overrides = flattened;
-    zval_ptr_dtor(&decoded);
-    return true;
-}
 
-static bool kislay_runtime_fetch_remote_locked(std::string *error) {
-    if (kislay_runtime_server_url.empty()) {
-        kislay_runtime_remote_snapshot.clear();
-        kislay_runtime_version = "local";
+    bool feed(const char *data, std::size_t size, std::string *out) {
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        stream.avail_in = static_cast<uInt>(size);
+        char chunk[16384];
+        do {
+            stream.next_out = reinterpret_cast<Bytef *>(chunk);
+            stream.avail_out = sizeof(chunk);
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result == Z_BUF_ERROR) {
+                break;
+            }
+            if (result != Z_OK && result != Z_STREAM_END) {
+                return false;
+            }
+            out->append(chunk, sizeof(chunk) - stream.avail_out);
+            if (out->size() > KISLAY_HTTP_MAX_BODY_BYTES) {
+                return false;
+            }
+            finished = result == Z_STREAM_END;
+        } while (!finished && (stream.avail_in > 0 || stream.avail_out == 0));
         return true;
     }
+};
 
-    std::ostringstream url;
-    url << kislay_runtime_server_url << "/v1/config/resolve?environment=" << kislay_runtime_environment
-        << "&project=" << kislay_runtime_project
-        << "&service=" << kislay_runtime_service
-        << "&node=" << kislay_runtime_node;
+static void kislay_http_set_timeouts(int fd) {
+    struct timeval timeout;
+    timeout.tv_sec = KISLAY_HTTP_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
 
-    int status = 0;
-    std::string body;
-    if (!kislay_http_request("GET", url.str(), std::string(), &status, &body, error)) {
-        return false;
+/* Connected socket for parsed, or -1 with error set. */
+static int kislay_http_connect(const kislay_http_url_t &parsed, std::string *error, kislay_runtime_phases_t *phases) {
+    std::chrono::steady_clock::time_point phase_start = std::chrono::steady_clock::now();
+    if (!parsed.unix_path.empty()) {
+        struct sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (parsed.unix_path.size() >= sizeof(address.sun_path)) {
+            if (error != nullptr) {
+                *error = "unix socket path too long";
+            }
+            return -1;
+        }
+        std::memcpy(address.sun_path, parsed.unix_path.c_str(), parsed.unix_path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1) {
+            kislay_http_set_timeouts(fd);
+            if (connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (phases != nullptr) {
+            phases->connect_ms += kislay_elapsed_ms(phase_start);
+        }
+        if (fd == -1 && error != nullptr) {
+            *error = "connect failed";
+        }
+        return fd;
     }
-    if (status != 200) {
+
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result = nullptr;
+    std::string port = std::to_string(parsed.port);
+    int resolved = getaddrinfo(parsed.host.c_str(), port.c_str(), &hints, &result);
+    if (phases != nullptr) {
+        phases->dns_ms += kislay_elapsed_ms(phase_start);
+    }
+    if (resolved != 0) {
         if (error != nullptr) {
-            *error = "Remote config request failed with HTTP " + std::to_string(status);
+            *error = "getaddrinfo failed";
         }
-        return false;
+        return -1;
     }
 
-    zval decoded;
-    ZVAL_UNDEF(&decoded);
-    if (!kislay_json_decode_assoc(body, &decoded) || Z_TYPE(decoded) != IS_ARRAY) {
-        if (!Z_ISUNDEF(decoded)) {
-            zval_ptr_dtor(&decoded);
+    int fd = -1;
+    phase_start = std::chrono::steady_clock::now();
+    for (struct addrinfo *rp = result; rp != nullptr; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd == -1) {
+            continue;
         }
-        if (error != nullptr) {
-            *error = "Invalid remote config JSON";
+        kislay_http_set_timeouts(fd);
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
         }
-        return false;
+        close(fd);
+        fd = -1;
     }
-
-    zval *version = zend_hash_str_find(Z_ARRVAL(decoded), "version", sizeof("version") - 1);
-    zval *config = zend_hash_str_find(Z_ARRVAL(decoded), "config", sizeof("config") - 1);
-    if (version != nullptr) {
-        kislay_runtime_version = kislay_string_from_zval(version);
+    freeaddrinfo(result);
+    if (phases != nullptr) {
+        phases->connect_ms += kislay_elapsed_ms(phase_start);
     }
-    if (config == nullptr || Z_TYPE_P(config) != IS_ARRAY) {
-        zval_ptr_dtor(&decoded);
+    if (fd == -1 && error != nullptr) {
+        *error = "connect failed";
+    }
+    return fd;
+}
+
+static bool kislay_http_request(const std::string &method, const std::string &url, const std::string &body, int *status_code, std::string *response_body, std::string *error, long *retry_after_sec = nullptr, kislay_runtime_phases_t *phases = nullptr) {
+    KISLAY_PROBE2(http__request__start, method.c_str(), url.c_str());
+    kislay_http_url_t parsed;
+    if (!kislay_parse_http_url(url, &parsed)) {
         if (error != nullptr) {
-            *error = "Remote payload missing config";
+            *error = "Invalid URL";
         }
         return false;
     }
 
-    kislay_runtime_remote_snapshot.clear();
-    HashTable *ht = Z_ARRVAL_P(config);
-    zend_string *key = nullptr;
-    zend_ulong index = 0;
-    zval *entry = nullptr;
-    ZEND_HASH_FOREACH_KEY_VAL(ht, index, key, entry) {
-        if (key != nullptr) {
-            kislay_runtime_remote_snapshot[std::string(ZSTR_VAL(key), ZSTR_LEN(key))] = kislay_string_from_zval(entry);
-        }
-    } ZEND_HASH_FOREACH_END();
-
-    zval_ptr_dtor(&decoded);
-    return true;
-}
-
-static bool kislay_hash_find_string(HashTable *ht, const char *key, std::string *out) {
-    zval *value = zend_hash_str_find(ht, key, std::strlen(key));
-    if (value == nullptr || Z_TYPE_P(value) == IS_NULL) {
+    int fd = kislay_http_connect(parsed, error, phases);
+    if (fd == -1) {
         return false;
     }
-    *out = kislay_string_from_zval(value);
-    return true;
-}
+
+    std::ostringstream request;
+    request << method << " " << parsed.path << " HTTP/1.1\r\n";
+    request << "Host: " << parsed.host << "\r\n";
+    request << "Connection: close\r\n";
+    if (parsed.unix_path.empty()) {
+        request << "Accept-Encoding: gzip\r\n";
+    }
+    if (!body.empty()) {
+        request << "Content-Type: application/json\r\n";
+        request << "Content-Length: " << body.size() << "\r\n";
+    }
+    request << "\r\n";
+    request << body;
+
+    const std::string wire = request.str();
+    std::chrono::steady_clock::time_point phase_start = std::chrono::steady_clock::now();
+    std::size_t sent = 0;
+    while (sent < wire.size()) {
+        ssize_t wrote = send(fd, wire.data() + sent, wire.size() - sent, 0);
+        if (wrote <= 0) {
+            if (error != nullptr) {
+                *error = "send failed";
+            }
+            close(fd);
+            return false;
+        }
+        sent += static_cast<std::size_t>(wrote);
+    }
+
+    if (phases != nullptr) {
+        phases->send_ms += kislay_elapsed_ms(phase_start);
+        phase_start = std::chrono::steady_clock::now();
+    }
+
+    /* A gzip body is inflated as it arrives, so only the decoded body is buffered. */
+    std::string response;
+    std::string inflated;
+    std::size_t header_end = std::string::npos;
+    kislay_gzip_inflater_t inflater;
+    char buffer[16384];
+    for (;;) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (phases != nullptr && response.empty()) {
+            phases->first_byte_ms += kislay_elapsed_ms(phase_start);
+            phase_start = std::chrono::steady_clock::now();
+        }
+        if (received == 0) {
+            break;
+        }
+        if (received < 0) {
+            if (error != nullptr) {
+                *error = "recv failed";
+            }
+            close(fd);
+            return false;
+        }
+        bool inflated_ok = true;
+        if (inflater.active) {
+            inflated_ok = inflater.feed(buffer, static_cast<std::size_t>(received), &inflated);
+        } else {
+            response.append(buffer, static_cast<std::size_t>(received));
+            if (header_end == std::string::npos) {
+                std::size_t from = response.size() > static_cast<std::size_t>(received) + 3 ? response.size() - static_cast<std::size_t>(received) - 3 : 0;
+                header_end = response.find("\r\n\r\n", from);
+                if (header_end != std::string::npos && kislay_to_lower(response.substr(0, header_end)).find("\r\ncontent-encoding: gzip") != std::string::npos) {
+                    inflated_ok = inflater.start() && inflater.feed(response.data() + header_end + 4, response.size() - header_end - 4, &inflated);
+                    response.resize(header_end + 4);
+                }
+            }
+        }
+        if (!inflated_ok) {
+            if (error != nullptr) {
+                *error = "gzip decode failed";
+            }
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    if (phases != nullptr) {
+        phases->body_ms += kislay_elapsed_ms(phase_start);
+    }
+    KISLAY_PROBE2(http__request__end, url.c_str(), response.size() + inflated.size());
+
+    if (header_end == std::string::npos) {
+        if (error != nullptr) {
+            *error = "Invalid HTTP response";
+        }
+        return false;
+    }
+    if (inflater.active && !inflater.finished) {
+        if (error != nullptr) {
+            *error = "gzip decode failed";
+        }
+        return false;
+    }
+
+    std::string headers = response.substr(0, header_end);
+    if (response_body != nullptr) {
+        *response_body = inflater.active ? std::move(inflated) : response.substr(header_end + 4);
+    }
+
+    std::size_t first_space = headers.find(' ');
+    if (first_space == std::string::npos) {
+        if (error != nullptr) {
+            *error = "Invalid status line";
+        }
+        return false;
+    }
+    std::size_t second_space = headers.find(' ', first_space + 1);
+    std::string code = headers.substr(first_space + 1, second_space == std::string::npos ? std::string::npos : (second_space - first_space - 1));
+    if (status_code != nullptr) {
+        *status_code = std::atoi(code.c_str());
+    }
+    if (retry_after_sec != nullptr) {
+        *retry_after_sec = -1;
+        std::string lower = kislay_to_lower(headers);
+        std::size_t at = lower.find("\r\nretry-after:");
+        if (at != std::string::npos) {
+            *retry_after_sec = std::strtol(headers.c_str() + at + sizeof("\r\nretry-after:") - 1, nullptr, 10);
+        }
+    }
+    return true;
+}
+
+static inline const char *kislay_http_data(const kislay_http_request_t &request, kislay_http_span_t span) {
+    return request.buffer.data() + span.offset;
+}
+
+static inline bool kislay_http_is(const kislay_http_request_t &request, kislay_http_span_t span, const char *literal) {
+    std::size_t length = std::strlen(literal);
+    return span.length == length && std::memcmp(kislay_http_data(request, span), literal, length) == 0;
+}
+
+static inline bool kislay_http_is_nocase(const kislay_http_request_t &request, kislay_http_span_t span, const char *literal) {
+    std::size_t length = std::strlen(literal);
+    return span.length == length && strncasecmp(kislay_http_data(request, span), literal, length) == 0;
+}
+
+static const kislay_http_header_t *kislay_http_find_header(const kislay_http_request_t &request, const char *name) {
+    for (std::size_t i = 0; i < request.header_count; ++i) {
+        if (kislay_http_is_nocase(request, request.headers[i].name, name)) {
+            return &request.headers[i];
+        }
+    }
+    return nullptr;
+}
+
+static inline kislay_http_span_t kislay_http_span(const char *base, const char *begin, const char *end) {
+    kislay_http_span_t span;
+    span.offset = static_cast<std::uint32_t>(begin - base);
+    span.length = static_cast<std::uint32_t>(end - begin);
+    return span;
+}
+
+static void kislay_http_reset(kislay_http_request_t *request) {
+    request->length = 0;
+    request->scanned = 0;
+    request->header_end = 0;
+    request->content_length = 0;
+    request->header_count = 0;
+    request->method = request->uri = request->path = request->query = request->body = kislay_http_span_t{0, 0};
+}
+
+/* Parses the request line and headers once the blank line has arrived. */
+static kislay_http_parse_t kislay_http_parse_head(kislay_http_request_t *request, const char *base, const char *end) {
+    const char *cursor = base;
+    const char *line_end = static_cast<const char *>(std::memchr(cursor, '\r', static_cast<std::size_t>(end - cursor)));
+    const char *space = static_cast<const char *>(std::memchr(cursor, ' ', static_cast<std::size_t>(line_end - cursor)));
+    if (space == nullptr || space == cursor) {
+        return KISLAY_HTTP_INVALID;
+    }
+    request->method = kislay_http_span(base, cursor, space);
+    cursor = space + 1;
+    space = static_cast<const char *>(std::memchr(cursor, ' ', static_cast<std::size_t>(line_end - cursor)));
+    const char *uri_end = space == nullptr ? line_end : space;
+    if (uri_end == cursor) {
+        return KISLAY_HTTP_INVALID;
+    }
+    request->uri = kislay_http_span(base, cursor, uri_end);
+    const char *question = static_cast<const char *>(std::memchr(cursor, '?', static_cast<std::size_t>(uri_end - cursor)));
+    request->path = kislay_http_span(base, cursor, question == nullptr ? uri_end : question);
+    request->query = question == nullptr ? kislay_http_span(base, uri_end, uri_end) : kislay_http_span(base, question + 1, uri_end);
+
+    for (cursor = line_end + 2; cursor < end; cursor = line_end + 2) {
+        line_end = static_cast<const char *>(std::memchr(cursor, '\r', static_cast<std::size_t>(end - cursor)));
+        if (line_end == nullptr || line_end == cursor) {
+            break;
+        }
+        const char *colon = static_cast<const char *>(std::memchr(cursor, ':', static_cast<std::size_t>(line_end - cursor)));
+        if (colon == nullptr) {
+            continue;
+        }
+        if (request->header_count == KISLAY_HTTP_MAX_HEADERS) {
+            return KISLAY_HTTP_INVALID;
+        }
+        const char *name_end = colon;
+        while (name_end > cursor && (name_end[-1] == ' ' || name_end[-1] == '\t')) {
+            --name_end;
+        }
+        const char *value = colon + 1;
+        const char *value_end = line_end;
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            --value_end;
+        }
+        kislay_http_header_t &header = request->headers[request->header_count++];
+        header.name = kislay_http_span(base, cursor, name_end);
+        header.value = kislay_http_span(base, value, value_end);
+        if (kislay_http_is_nocase(*request, header.name, "content-length")) {
+            std::size_t length = 0;
+            for (const char *digit = value; digit < value_end; ++digit) {
+                if (*digit < '0' || *digit > '9' || length > KISLAY_HTTP_MAX_BODY_BYTES) {
+                    return KISLAY_HTTP_INVALID;
+                }
+                length = length * 10 + static_cast<std::size_t>(*digit - '0');
+            }
+            if (length > KISLAY_HTTP_MAX_BODY_BYTES) {
+                return KISLAY_HTTP_INVALID;
+            }
+            request->content_length = length;
+        }
+    }
+    return KISLAY_HTTP_COMPLETE;
+}
+
+/* Resumable: call again after appending bytes until it stops returning KISLAY_HTTP_INCOMPLETE. */
+static kislay_http_parse_t kislay_http_parse(kislay_http_request_t *request) {
+    const char *base = request->buffer.data();
+    if (request->header_end == 0) {
+        const char *end = base + request->length;
+        const char *blank = nullptr;
+        for (const char *cursor = base + request->scanned; cursor < end; ++cursor) {
+            cursor = static_cast<const char *>(std::memchr(cursor, '\n', static_cast<std::size_t>(end - cursor)));
+            if (cursor == nullptr) {
+                break;
+            }
+            if (cursor - base >= 3 && cursor[-1] == '\r' && cursor[-2] == '\n' && cursor[-3] == '\r') {
+                blank = cursor - 3;
+                break;
+            }
+        }
+        if (blank == nullptr) {
+            request->scanned = request->length;
+            return request->length > KISLAY_HTTP_MAX_HEADER_BYTES ? KISLAY_HTTP_INVALID : KISLAY_HTTP_INCOMPLETE;
+        }
+        request->header_end = static_cast<std::size_t>(blank - base) + 4;
+        if (kislay_http_parse_head(request, base, blank + 2) != KISLAY_HTTP_COMPLETE) {
+            return KISLAY_HTTP_INVALID;
+        }
+    }
+    if (request->length - request->header_end < request->content_length) {
+        return KISLAY_HTTP_INCOMPLETE;
+    }
+    request->body.offset = static_cast<std::uint32_t>(request->header_end);
+    request->body.length = static_cast<std::uint32_t>(request->content_length);
+    return KISLAY_HTTP_COMPLETE;
+}
+
+static bool kislay_http_read_request(int fd, kislay_http_request_t *request) {
+    kislay_http_reset(request);
+    for (;;) {
+        kislay_http_parse_t state = kislay_http_parse(request);
+        if (state == KISLAY_HTTP_COMPLETE) {
+            break;
+        }
+        if (state == KISLAY_HTTP_INVALID) {
+            return false;
+        }
+        std::size_t wanted = request->header_end == 0 ? 4096 : request->header_end + request->content_length - request->length;
+        if (request->buffer.size() - request->length < wanted) {
+            request->buffer.resize(std::max(request->buffer.size() * 2, request->length + std::max<std::size_t>(wanted, 4096)));
+        }
+        ssize_t received = recv(fd, &request->buffer[request->length], request->buffer.size() - request->length, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        request->length += static_cast<std::size_t>(received);
+    }
+    if (kislay_metrics_shard != nullptr) {
+        kislay_metric_add(kislay_metrics_shard->bytes_in, request->length);
+    }
+    return true;
+}
+
+/* Decodes query parameter `name` into out (last occurrence wins); false if absent. */
+static bool kislay_http_query_param(const kislay_http_request_t &request, const char *name, std::string *out) {
+    const char *cursor = kislay_http_data(request, request.query);
+    const char *end = cursor + request.query.length;
+    std::size_t name_length = std::strlen(name);
+    bool found = false;
+    while (cursor < end) {
+        const char *amp = static_cast<const char *>(std::memchr(cursor, '&', static_cast<std::size_t>(end - cursor)));
+        const char *pair_end = amp == nullptr ? end : amp;
+        const char *eq = static_cast<const char *>(std::memchr(cursor, '=', static_cast<std::size_t>(pair_end - cursor)));
+        const char *key_end = eq == nullptr ? pair_end : eq;
+        if (static_cast<std::size_t>(key_end - cursor) == name_length && std::memcmp(cursor, name, name_length) == 0) {
+            found = true;
+            out->clear();
+            for (const char *ch = eq == nullptr ? pair_end : eq + 1; ch < pair_end; ++ch) {
+                int high = 0;
+                int low = 0;
+                if (*ch == '%' && ch + 2 < pair_end && (high = kislay_hex_value(ch[1])) >= 0 && (low = kislay_hex_value(ch[2])) >= 0) {
+                    out->push_back(static_cast<char>(high * 16 + low));
+                    ch += 2;
+                } else {
+                    out->push_back(*ch == '+' ? ' ' : *ch);
+                }
+            }
+        }
+        cursor = pair_end + 1;
+    }
+    return found;
+}
+
+/*
+ * Writes every byte of iov[0..count), resuming after short writes. Non-blocking
+ * sockets wait in poll() for up to KISLAY_HTTP_TIMEOUT_SEC per stall.
+ * sendmsg() is writev() plus MSG_NOSIGNAL, so a vanished peer is an error, not SIGPIPE.
+ */
+static bool kislay_write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = static_cast<std::size_t>(count);
+        ssize_t wrote = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            struct pollfd waiter;
+            waiter.fd = fd;
+            waiter.events = POLLOUT;
+            waiter.revents = 0;
+            int ready = poll(&waiter, 1, KISLAY_HTTP_TIMEOUT_SEC * 1000);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                return false;
+            }
+            continue;
+        }
+        std::size_t left = static_cast<std::size_t>(wrote);
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+/* Headers go in a stack buffer and the body is sent in place, so cached payloads are never copied. */
+static bool kislay_http_send_response(int fd, int status_code, const std::string &content_type, const std::string &body, const std::string &extra_headers = std::string()) {
+    const char *status_text = "OK";
+    if (status_code == 304) status_text = "Not Modified";
+    if (status_code == 400) status_text = "Bad Request";
+    if (status_code == 403) status_text = "Forbidden";
+    if (status_code == 404) status_text = "Not Found";
+    if (status_code == 405) status_text = "Method Not Allowed";
+    if (status_code == 410) status_text = "Gone";
+    if (status_code == 413) status_text = "Payload Too Large";
+    if (status_code == 500) status_text = "Internal Server Error";
+    if (status_code == 502) status_text = "Bad Gateway";
+    if (status_code == 503) status_text = "Service Unavailable";
+
+    char stack_headers[512];
+    std::string heap_headers;
+    const char *format = "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n%sContent-Length: %zu\r\nConnection: close\r\n\r\n";
+    int length = std::snprintf(stack_headers, sizeof(stack_headers), format,
+        status_code, status_text, content_type.c_str(), extra_headers.c_str(), body.size());
+    if (length < 0) {
+        return false;
+    }
+    struct iovec iov[2];
+    iov[0].iov_base = stack_headers;
+    iov[0].iov_len = static_cast<std::size_t>(length);
+    if (static_cast<std::size_t>(length) >= sizeof(stack_headers)) {
+        heap_headers.resize(static_cast<std::size_t>(length) + 1);
+        std::snprintf(&heap_headers[0], heap_headers.size(), format,
+            status_code, status_text, content_type.c_str(), extra_headers.c_str(), body.size());
+        iov[0].iov_base = &heap_headers[0];
+    }
+    iov[1].iov_base = const_cast<char *>(body.data());
+    iov[1].iov_len = body.size();
+    std::size_t total = iov[0].iov_len + iov[1].iov_len;
+    bool sent = kislay_write_all(fd, iov, body.empty() ? 1 : 2);
+    KISLAY_PROBE3(response__sent, fd, status_code, total);
+    if (kislay_metrics_shard != nullptr) {
+        kislay_metrics_shard->last_status = status_code;
+        if (sent) {
+            kislay_metric_add(kislay_metrics_shard->bytes_out, total);
+        }
+    }
+    return sent;
+}
+
+static scope_ptr_t *kislay_server_scope_slot_locked(php_kislayphp_config_server_t *server, const std::vector<std::string> &scope) {
+    if (scope.size() == 1 && scope[0] == "global") {
+        return &server->global_scope;
+    }
+    if (scope.size() == 2 && scope[0] == "environments") {
+        return &server->environment_scopes[scope[1]];
+    }
+    if (scope.size() == 2 && scope[0] == "projects") {
+        return &server->project_scopes[scope[1]];
+    }
+    if (scope.size() == 4 && scope[0] == "projects" && scope[2] == "services") {
+        return &server->service_scopes[scope[1]][scope[3]];
+    }
+    if (scope.size() == 6 && scope[0] == "projects" && scope[2] == "services" && scope[4] == "nodes") {
+        return &server->node_scopes[scope[1]][scope[3]][scope[5]];
+    }
+    return nullptr;
+}
+
+static scope_ptr_t kislay_scope_lookup(const scope_map_t &scopes, const std::string &key) {
+    scope_map_t::const_iterator it = scopes.find(key);
+    return it == scopes.end() ? scope_ptr_t() : it->second;
+}
+
+/* The stored node scope slot, or null; never creates an entry. */
+static scope_ptr_t *kislay_server_node_slot_locked(php_kislayphp_config_server_t *server, const std::string &project, const std::string &service,
+    const std::string &node) {
+    node_scope_map_t::iterator projects = server->node_scopes.find(project);
+    if (projects == server->node_scopes.end()) {
+        return nullptr;
+    }
+    project_scope_map_t::iterator services = projects->second.find(service);
+    if (services == projects->second.end()) {
+        return nullptr;
+    }
+    scope_map_t::iterator it = services->second.find(node);
+    return it == services->second.end() ? nullptr : &it->second;
+}
+
+/* Creates an empty segment file in dir (default $TMPDIR) and unlinks it at once; the mapping keeps it alive. */
+static std::shared_ptr<kislay_node_segment_t> kislay_node_segment_open(const std::string &dir, std::string *error) {
+    const char *tmp = std::getenv("TMPDIR");
+    std::string name = !dir.empty() ? dir : std::string(tmp != nullptr && *tmp != '\0' ? tmp : "/tmp");
+    name.append("/kislay-config-nodes-XXXXXX");
+    std::vector<char> path(name.begin(), name.end());
+    path.push_back('\0');
+    std::shared_ptr<kislay_node_segment_t> segment = std::make_shared<kislay_node_segment_t>();
+    segment->fd = mkstemp(path.data());
+    if (segment->fd < 0) {
+        *error = "Failed to create node segment in " + name.substr(0, name.rfind('/')) + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    unlink(path.data());
+    void *base = mmap(nullptr, KISLAY_NODE_SEGMENT_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        *error = std::string("Failed to reserve node segment: ") + std::strerror(errno);
+        return nullptr;
+    }
+    segment->base = static_cast<char *>(base);
+    return segment;
+}
+
+static bool kislay_node_segment_append(kislay_node_segment_t *segment, const char *data, std::size_t length, std::uint64_t *offset, std::string *error) {
+    if (segment->size + length > KISLAY_NODE_SEGMENT_RESERVE) {
+        *error = "Node segment is full";
+        return false;
+    }
+    std::size_t written = 0;
+    while (written < length) {
+        ssize_t n = pwrite(segment->fd, data + written, length - written, static_cast<off_t>(segment->size + written));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            *error = std::string("Failed to write node segment: ") + std::strerror(errno);
+            return false;
+        }
+        written += static_cast<std::size_t>(n);
+    }
+    while (segment->mapped < segment->size + length) {
+        if (mmap(segment->base + segment->mapped, KISLAY_NODE_SEGMENT_CHUNK, PROT_READ, MAP_SHARED | MAP_FIXED, segment->fd,
+                static_cast<off_t>(segment->mapped)) == MAP_FAILED) {
+            *error = std::string("Failed to map node segment: ") + std::strerror(errno);
+            return false;
+        }
+        segment->mapped += KISLAY_NODE_SEGMENT_CHUNK;
+    }
+    *offset = segment->size;
+    segment->size += length;
+    return true;
+}
+
+/* Segment record: per entry, a 32-bit key length, a 32-bit value length, then the key and value bytes. */
+static void kislay_node_record(const kislay_entries_t &entries, std::string *out) {
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        std::uint32_t lengths[2] = {entries[i].first->length, entries[i].second->length};
+        out->append(reinterpret_cast<const char *>(lengths), sizeof(lengths));
+        out->append(entries[i].first->data, lengths[0]);
+        out->append(entries[i].second->data, lengths[1]);
+    }
+}
+
+/* Calls visit(key, key_length, value, value_length) per entry of a cold scope's record; false if the record is malformed. */
+template <typename Visit>
+static bool kislay_node_record_each(const kislay_scope_t &stub, Visit visit) {
+    const char *p = stub.segment->base + stub.segment_offset;
+    const char *end = p + stub.segment_length;
+    while (p < end) {
+        std::uint32_t lengths[2];
+        if (static_cast<std::size_t>(end - p) < sizeof(lengths)) {
+            return false;
+        }
+        std::memcpy(lengths, p, sizeof(lengths));
+        p += sizeof(lengths);
+        if (static_cast<std::size_t>(end - p) < static_cast<std::size_t>(lengths[0]) + lengths[1]) {
+            return false;
+        }
+        visit(p, lengths[0], p + lengths[0], lengths[1]);
+        p += lengths[0] + lengths[1];
+    }
+    return true;
+}
+
+/* Appends a scope as a JSON object; cold scopes are decoded straight from the segment. */
+static void kislay_json_append_scope(std::string *out, const kislay_scope_t &scope) {
+    if (!scope.cold) {
+        kislay_json_append_entries(out, scope.entries);
+        return;
+    }
+    out->push_back('{');
+    bool first = true;
+    kislay_node_record_each(scope, [&](const char *key, std::size_t key_length, const char *value, std::size_t value_length) {
+        if (!first) {
+            out->push_back(',');
+        }
+        first = false;
+        kislay_json_append_string(out, key, key_length);
+        out->push_back(':');
+        kislay_json_append_string(out, value, value_length);
+    });
+    out->push_back('}');
+}
+
+static std::size_t kislay_scope_resident_bytes(const kislay_scope_t &scope) {
+    std::size_t bytes = sizeof(kislay_scope_t) + scope.entries.capacity() * sizeof(kislay_entry_t);
+    for (std::size_t i = 0; i < scope.entries.size(); ++i) {
+        bytes += scope.entries[i].first->length + scope.entries[i].second->length;
+    }
+    return bytes;
+}
+
+/* Called before a node slot stops pointing at scope: its segment record, if any, is no longer live. */
+static void kislay_node_tier_forget_locked(php_kislayphp_config_server_t *server, const scope_ptr_t &scope) {
+    if (scope && scope->segment && scope->segment == server->tier.segment) {
+        server->tier.live_bytes -= scope->segment_length;
+    }
+}
+
+static scope_ptr_t kislay_node_stub(const kislay_scope_t &scope, const std::shared_ptr<kislay_node_segment_t> &segment, std::uint64_t offset) {
+    scope_ptr_t stub = std::make_shared<kislay_scope_t>();
+    stub->revision = scope.revision;
+    stub->segment = segment;
+    stub->segment_offset = offset;
+    stub->segment_length = scope.segment_length;
+    stub->segment_keys = scope.size();
+    stub->cold = true;
+    return stub;
+}
+
+/* Writes a resident node scope to the segment unless an unchanged copy is already there, then leaves a stub in its slot. */
+static bool kislay_node_tier_spill_locked(php_kislayphp_config_server_t *server, scope_ptr_t *slot) {
+    kislay_node_tier_t &tier = server->tier;
+    kislay_scope_t &scope = **slot;
+    if (!scope.segment) {
+        std::string error;
+        if (!tier.segment && !(tier.segment = kislay_node_segment_open(tier.segment_dir, &error))) {
+            tier.last_error = error;
+            return false;
+        }
+        std::string record;
+        kislay_node_record(scope.entries, &record);
+        std::uint64_t offset = 0;
+        if (!kislay_node_segment_append(tier.segment.get(), record.data(), record.size(), &offset, &error)) {
+            tier.last_error = error;
+            return false;
+        }
+        scope.segment = tier.segment;
+        scope.segment_offset = offset;
+        scope.segment_length = record.size();
+        tier.live_bytes += record.size();
+        tier.spills++;
+    }
+    *slot = kislay_node_stub(scope, scope.segment, scope.segment_offset);
+    return true;
+}
+
+/* Replaces a cold stub with the scope read back from the segment; the copy there stays valid until the scope changes. */
+static bool kislay_node_tier_load_locked(php_kislayphp_config_server_t *server, scope_ptr_t *slot) {
+    const kislay_scope_t &stub = **slot;
+    std::vector<kislay_string_ref_t> strings;
+    strings.reserve(stub.segment_keys * 2);
+    bool valid = kislay_node_record_each(stub, [&](const char *key, std::size_t key_length, const char *value, std::size_t value_length) {
+        strings.push_back(kislay_string_ref_t{key, key_length});
+        strings.push_back(kislay_string_ref_t{value, value_length});
+    });
+    if (!valid) {
+        server->tier.last_error = "Corrupt node segment record at offset " + std::to_string(static_cast<unsigned long long>(stub.segment_offset));
+        return false;
+    }
+    scope_ptr_t scope = std::make_shared<kislay_scope_t>();
+    scope->intern(strings);
+    scope->revision = stub.revision;
+    scope->segment = stub.segment;
+    scope->segment_offset = stub.segment_offset;
+    scope->segment_length = stub.segment_length;
+    *slot = scope;
+    server->tier.loads++;
+    return true;
+}
+
+/*
+ * Starts a new segment holding only the records the tree still points at.
+ * Snapshots that hold stubs into the old segment keep it mapped until they finish.
+ */
+static void kislay_node_tier_compact_locked(php_kislayphp_config_server_t *server) {
+    kislay_node_tier_t &tier = server->tier;
+    std::string error;
+    std::shared_ptr<kislay_node_segment_t> fresh = kislay_node_segment_open(tier.segment_dir, &error);
+    if (!fresh) {
+        tier.last_error = error;
+        return;
+    }
+    std::size_t live = 0;
+    for (node_scope_map_t::iterator project = server->node_scopes.begin(); project != server->node_scopes.end(); ++project) {
+        for (project_scope_map_t::iterator service = project->second.begin(); service != project->second.end(); ++service) {
+            for (scope_map_t::iterator it = service->second.begin(); it != service->second.end(); ++it) {
+                kislay_scope_t &scope = *it->second;
+                if (!scope.cold) {
+                    /* An unchanged resident scope is simply written again on its next eviction. */
+                    scope.segment.reset();
+                    continue;
+                }
+                std::uint64_t offset = 0;
+                if (!kislay_node_segment_append(fresh.get(), scope.segment->base + scope.segment_offset, scope.segment_length, &offset, &error)) {
+                    tier.last_error = error;
+                    return;
+                }
+                it->second = kislay_node_stub(scope, fresh, offset);
+                live += it->second->segment_length;
+            }
+        }
+    }
+    tier.segment = fresh;
+    tier.live_bytes = live;
+    tier.compactions++;
+}
+
+/* changed: the scope in slot was edited in place, so its size must be measured again. */
+static void kislay_node_tier_account_locked(kislay_node_tier_t &tier, scope_ptr_t *slot, bool changed) {
+    kislay_node_resident_t &entry = tier.resident[slot];
+    if (changed || entry.scope != slot->get()) {
+        std::size_t bytes = kislay_scope_resident_bytes(**slot);
+        tier.resident_bytes = tier.resident_bytes - entry.bytes + bytes;
+        entry.scope = slot->get();
+        entry.bytes = bytes;
+    }
+    entry.tick = ++tier.tick;
+}
+
+/* Spills the least recently used node scopes until resident bytes are an eighth under budget. */
+static void kislay_node_tier_trim_locked(php_kislayphp_config_server_t *server) {
+    kislay_node_tier_t &tier = server->tier;
+    if (tier.segment && tier.segment->size >= KISLAY_NODE_SEGMENT_COMPACT_BYTES && tier.live_bytes * 2 < tier.segment->size) {
+        kislay_node_tier_compact_locked(server);
+    }
+    std::vector<std::pair<std::uint64_t, scope_ptr_t *>> order;
+    order.reserve(tier.resident.size());
+    for (std::unordered_map<scope_ptr_t *, kislay_node_resident_t>::const_iterator it = tier.resident.begin(); it != tier.resident.end(); ++it) {
+        order.push_back(std::make_pair(it->second.tick, it->first));
+    }
+    std::sort(order.begin(), order.end());
+    std::size_t target = tier.max_resident_bytes - tier.max_resident_bytes / 8;
+    for (std::size_t i = 0; i < order.size() && tier.resident_bytes > target; ++i) {
+        std::size_t bytes = tier.resident[order[i].second].bytes;
+        if (!kislay_node_tier_spill_locked(server, order[i].second)) {
+            break;
+        }
+        tier.resident.erase(order[i].second);
+        tier.resident_bytes -= bytes;
+    }
+}
+
+/* Marks a resident node slot as just used; evicts colder slots once over max_resident_bytes. */
+static void kislay_node_tier_touch_locked(php_kislayphp_config_server_t *server, scope_ptr_t *slot, bool changed = false) {
+    kislay_node_tier_t &tier = server->tier;
+    if (tier.max_resident_bytes == 0) {
+        return;
+    }
+    kislay_node_tier_account_locked(tier, slot, changed);
+    if (tier.resident_bytes > tier.max_resident_bytes) {
+        kislay_node_tier_trim_locked(server);
+    }
+}
+
+/* After the whole tree was replaced every node scope is resident and nothing points into the segment. */
+static void kislay_node_tier_reset_locked(php_kislayphp_config_server_t *server) {
+    kislay_node_tier_t &tier = server->tier;
+    tier.resident.clear();
+    tier.resident_bytes = 0;
+    tier.live_bytes = 0;
+    if (tier.max_resident_bytes == 0) {
+        return;
+    }
+    for (node_scope_map_t::iterator project = server->node_scopes.begin(); project != server->node_scopes.end(); ++project) {
+        for (project_scope_map_t::iterator service = project->second.begin(); service != project->second.end(); ++service) {
+            for (scope_map_t::iterator it = service->second.begin(); it != service->second.end(); ++it) {
+                kislay_node_tier_account_locked(tier, &it->second, false);
+            }
+        }
+    }
+    if (tier.resident_bytes > tier.max_resident_bytes) {
+        kislay_node_tier_trim_locked(server);
+    }
+}
+
+/* The node scope in slot, read back from the segment if it was spilled. */
+static scope_ptr_t kislay_node_tier_use_locked(php_kislayphp_config_server_t *server, scope_ptr_t *slot) {
+    if (!*slot || ((*slot)->cold && !kislay_node_tier_load_locked(server, slot))) {
+        return *slot;
+    }
+    scope_ptr_t scope = *slot;
+    kislay_node_tier_touch_locked(server, slot);
+    return scope;
+}
+
+/*
+ * Global, environment, project, service and node layers of one resolution
+ * chain; absent scopes are null.
+ */
+static void kislay_server_chain_locked(php_kislayphp_config_server_t *server, const std::string &environment, const std::string &project,
+    const std::string &service, const std::string &node, scope_ptr_t layers[5]) {
+    layers[0] = server->global_scope;
+    layers[1] = kislay_scope_lookup(server->environment_scopes, environment);
+    layers[2] = kislay_scope_lookup(server->project_scopes, project);
+    layers[3].reset();
+    layers[4].reset();
+    project_scope_map_t::const_iterator services = server->service_scopes.find(project);
+    if (services != server->service_scopes.end()) {
+        layers[3] = kislay_scope_lookup(services->second, service);
+    }
+    scope_ptr_t *slot = kislay_server_node_slot_locked(server, project, service, node);
+    if (slot != nullptr) {
+        layers[4] = kislay_node_tier_use_locked(server, slot);
+    }
+}
+
+/* A chain's version is the newest revision among its layers, so writes elsewhere leave it alone. */
+static std::uint64_t kislay_chain_revision(const scope_ptr_t layers[5]) {
+    std::uint64_t revision = 0;
+    for (int i = 0; i < 5; ++i) {
+        if (layers[i] && layers[i]->revision > revision) {
+            revision = layers[i]->revision;
+        }
+    }
+    return revision;
+}
+
+/* Like kislay_server_scope_slot_locked, but never creates an entry; node scopes may be cold. */
+static scope_ptr_t kislay_server_find_scope_locked(php_kislayphp_config_server_t *server, const std::vector<std::string> &scope) {
+    scope_ptr_t layers[5];
+    if (scope.size() == 1 && scope[0] == "global") {
+        return server->global_scope;
+    }
+    if (scope.size() == 2 && scope[0] == "environments") {
+        return kislay_scope_lookup(server->environment_scopes, scope[1]);
+    }
+    if (scope.size() == 2 && scope[0] == "projects") {
+        return kislay_scope_lookup(server->project_scopes, scope[1]);
+    }
+    if (scope.size() == 4 && scope[0] == "projects" && scope[2] == "services") {
+        kislay_server_chain_locked(server, std::string(), scope[1], scope[3], std::string(), layers);
+        return layers[3];
+    }
+    if (scope.size() == 6 && scope[0] == "projects" && scope[2] == "services" && scope[4] == "nodes") {
+        scope_ptr_t *slot = kislay_server_node_slot_locked(server, scope[1], scope[3], scope[5]);
+        return slot != nullptr ? *slot : scope_ptr_t();
+    }
+    return scope_ptr_t();
+}
+
+static bool kislay_server_store_scope_locked(php_kislayphp_config_server_t *server, const std::vector<std::string> &scope, const scope_ptr_t &values) {
+    scope_ptr_t *slot = kislay_server_scope_slot_locked(server, scope);
+    if (slot == nullptr) {
+        return false;
+    }
+    bool node = scope.size() == 6;
+    if (node) {
+        kislay_node_tier_forget_locked(server, *slot);
+    }
+    values->revision = server->revision;
+    *slot = values;
+    return true;
+}
+
+/*
+ * Stored scopes are shared with snapshots, so a patch edits the map in place
+ * only while the server holds the sole reference and copies it otherwise.
+ */
+static bool kislay_server_patch_scope_locked(php_kislayphp_config_server_t *server, const kislay_scope_op_t &op) {
+    scope_ptr_t *slot = kislay_server_scope_slot_locked(server, op.scope);
+    if (slot == nullptr) {
+        return false;
+    }
+    bool node = op.scope.size() == 6;
+    if (node && *slot && (*slot)->cold && !kislay_node_tier_load_locked(server, slot)) {
+        return false;
+    }
+    if (node) {
+        kislay_node_tier_forget_locked(server, *slot);
+    }
+    if (!*slot) {
+        *slot = std::make_shared<kislay_scope_t>();
+    } else if (slot->use_count() > 1) {
+        *slot = std::make_shared<kislay_scope_t>(**slot);
+    }
+    (*slot)->revision = server->revision;
+    (*slot)->segment.reset();
+    (*slot)->patch(*op.values, op.deletes);
+    return true;
+}
+
+/* Node slots are touched by the caller once every op is applied, so no eviction runs between ops. */
+static bool kislay_server_apply_op_locked(php_kislayphp_config_server_t *server, const kislay_scope_op_t &op) {
+    return op.patch ? kislay_server_patch_scope_locked(server, op) : kislay_server_store_scope_locked(server, op.scope, op.values);
+}
+
+static bool kislay_server_scope_is_valid(const std::vector<std::string> &scope) {
+    return (scope.size() == 1 && scope[0] == "global") ||
+        (scope.size() == 2 && (scope[0] == "environments" || scope[0] == "projects")) ||
+        (scope.size() == 4 && scope[0] == "projects" && scope[2] == "services") ||
+        (scope.size() == 6 && scope[0] == "projects" && scope[2] == "services" && scope[4] == "nodes");
+}
+
+static void kislay_server_snapshot_locked(php_kislayphp_config_server_t *server, kislay_server_snapshot_t *snapshot) {
+    snapshot->revision = server->revision;
+    snapshot->version = server->version;
+    snapshot->global_scope = server->global_scope;
+    snapshot->environment_scopes = server->environment_scopes;
+    snapshot->project_scopes = server->project_scopes;
+    snapshot->service_scopes = server->service_scopes;
+    snapshot->node_scopes = server->node_scopes;
+}
+
+typedef std::vector<std::pair<std::vector<std::string>, std::uint64_t>> kislay_scope_revisions_t;
+
+/* Appends {"name":{...},...}; scopes written before `current` are noted in revisions under path + name. */
+static void kislay_json_append_scope_map(std::string *out, const scope_map_t &scopes, std::vector<std::string> path,
+    std::uint64_t current, kislay_scope_revisions_t *revisions) {
+    out->push_back('{');
+    bool first = true;
+    path.push_back(std::string());
+    for (scope_map_t::const_iterator it = scopes.begin(); it != scopes.end(); ++it) {
+        if (!first) {
+            out->push_back(',');
+        }
+        first = false;
+        kislay_json_append_string(out, it->first);
+        out->push_back(':');
+        kislay_json_append_scope(out, *it->second);
+        if (it->second->revision < current) {
+            path.back() = it->first;
+            revisions->push_back(std::make_pair(path, it->second->revision));
+        }
+    }
+    out->push_back('}');
+}
+
+static std::string kislay_server_snapshot_json(const kislay_server_snapshot_t &snapshot) {
+    kislay_scope_revisions_t revisions;
+    if (snapshot.global_scope->revision < snapshot.revision) {
+        revisions.push_back(std::make_pair(std::vector<std::string>{"global"}, snapshot.global_scope->revision));
+    }
+    std::string out;
+    out.append("{\"version\":");
+    kislay_json_append_string(&out, snapshot.version);
+    out.append(",\"revision\":");
+    out.append(std::to_string(static_cast<unsigned long long>(snapshot.revision)));
+    out.append(",\"global\":");
+    kislay_json_append_entries(&out, snapshot.global_scope->entries);
+    out.append(",\"environments\":");
+    kislay_json_append_scope_map(&out, snapshot.environment_scopes, std::vector<std::string>{"environments"}, snapshot.revision, &revisions);
+    out.append(",\"projects\":");
+    kislay_json_append_scope_map(&out, snapshot.project_scopes, std::vector<std::string>{"projects"}, snapshot.revision, &revisions);
+    out.append(",\"services\":{");
+    bool first = true;
+    for (project_scope_map_t::const_iterator pit = snapshot.service_scopes.begin(); pit != snapshot.service_scopes.end(); ++pit) {
+        if (!first) {
+            out.push_back(',');
+        }
+        first = false;
+        kislay_json_append_string(&out, pit->first);
+        out.push_back(':');
+        kislay_json_append_scope_map(&out, pit->second, std::vector<std::string>{"projects", pit->first, "services"}, snapshot.revision, &revisions);
+    }
+    out.append("},\"nodes\":{");
+    first = true;
+    for (node_scope_map_t::const_iterator pit = snapshot.node_scopes.begin(); pit != snapshot.node_scopes.end(); ++pit) {
+        if (!first) {
+            out.push_back(',');
+        }
+        first = false;
+        kislay_json_append_string(&out, pit->first);
+        out.append(":{");
+        bool first_service = true;
+        for (project_scope_map_t::const_iterator sit = pit->second.begin(); sit != pit->second.end(); ++sit) {
+            if (!first_service) {
+                out.push_back(',');
+            }
+            first_service = false;
+            kislay_json_append_string(&out, sit->first);
+            out.push_back(':');
+            kislay_json_append_scope_map(&out, sit->second, std::vector<std::string>{"projects", pit->first, "services", sit->first, "nodes"}, snapshot.revision, &revisions);
+        }
+        out.push_back('}');
+    }
+    out.append("},\"revisions\":[");
+    for (std::size_t i = 0; i < revisions.size(); ++i) {
+        out.append(i > 0 ? ",{\"scope\":" : "{\"scope\":");
+        kislay_json_append_string_list(&out, revisions[i].first);
+        out.append(",\"revision\":");
+        out.append(std::to_string(static_cast<unsigned long long>(revisions[i].second)));
+        out.push_back('}');
+    }
+    out.append("]}");
+    return out;
+}
+
+static std::string kislay_server_journal_record(std::uint64_t revision, const std::vector<kislay_scope_op_t> &ops) {
+    std::string out;
+    out.append("{\"revision\":");
+    out.append(std::to_string(static_cast<unsigned long long>(revision)));
+    out.append(",\"ops\":[");
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        if (i > 0) {
+            out.push_back(',');
+        }
+        out.append(ops[i].patch ? "{\"op\":\"patch\",\"scope\":" : "{\"op\":\"set\",\"scope\":");
+        kislay_json_append_string_list(&out, ops[i].scope);
+        out.append(ops[i].patch ? ",\"set\":" : ",\"config\":");
+        kislay_json_append_entries(&out, ops[i].values->entries);
+        if (ops[i].patch) {
+            out.append(",\"delete\":");
+            kislay_json_append_string_list(&out, ops[i].deletes);
+        }
+        out.push_back('}');
+    }
+    out.append("]}\n");
+    return out;
+}
+
+static void kislay_server_load_scope_map(const kislay_json_value_t *value, scope_map_t *out) {
+    if (value == nullptr || value->kind != kislay_json_value_t::JSON_OBJECT) {
+        return;
+    }
+    for (std::size_t i = 0; i < value->members.size(); ++i) {
+        if (value->members[i].second.kind == kislay_json_value_t::JSON_OBJECT) {
+            (*out)[value->members[i].first] = kislay_scope_from_json(value->members[i].second);
+        }
+    }
+}
+
+/* Replaces the whole scope tree with a save()/checkpoint document. */
+static void kislay_server_load_state_locked(php_kislayphp_config_server_t *obj, const kislay_json_value_t &root) {
+    obj->global_scope = std::make_shared<kislay_scope_t>();
+    obj->environment_scopes.clear();
+    obj->project_scopes.clear();
+    obj->service_scopes.clear();
+    obj->node_scopes.clear();
+
+    const kislay_json_value_t *version = root.find("version");
+    const kislay_json_value_t *revision = root.find("revision");
+    if (version != nullptr) {
+        obj->version = kislay_json_scalar_string(*version);
+    }
+    if (revision != nullptr) {
+        obj->revision = std::strtoull(kislay_json_scalar_string(*revision).c_str(), nullptr, 10);
+    }
+
+    const kislay_json_value_t *global = root.find("global");
+    if (global != nullptr && global->kind == kislay_json_value_t::JSON_OBJECT) {
+        obj->global_scope = kislay_scope_from_json(*global);
+    }
+    kislay_server_load_scope_map(root.find("environments"), &obj->environment_scopes);
+    kislay_server_load_scope_map(root.find("projects"), &obj->project_scopes);
+
+    const kislay_json_value_t *services = root.find("services");
+    if (services != nullptr && services->kind == kislay_json_value_t::JSON_OBJECT) {
+        for (std::size_t i = 0; i < services->members.size(); ++i) {
+            kislay_server_load_scope_map(&services->members[i].second, &obj->service_scopes[services->members[i].first]);
+        }
+    }
+
+    const kislay_json_value_t *nodes = root.find("nodes");
+    if (nodes != nullptr && nodes->kind == kislay_json_value_t::JSON_OBJECT) {
+        for (std::size_t i = 0; i < nodes->members.size(); ++i) {
+            const kislay_json_value_t &service_map = nodes->members[i].second;
+            if (service_map.kind != kislay_json_value_t::JSON_OBJECT) {
+                continue;
+            }
+            project_scope_map_t &project = obj->node_scopes[nodes->members[i].first];
+            for (std::size_t j = 0; j < service_map.members.size(); ++j) {
+                kislay_server_load_scope_map(&service_map.members[j].second, &project[service_map.members[j].first]);
+            }
+        }
+    }
+
+    /* Scopes without an entry in "revisions" were last written at the snapshot revision. */
+    kislay_server_snapshot_t loaded;
+    kislay_server_snapshot_locked(obj, &loaded);
+    loaded.global_scope->revision = obj->revision;
+    const scope_map_t *maps[] = {&loaded.environment_scopes, &loaded.project_scopes};
+    for (int m = 0; m < 2; ++m) {
+        for (scope_map_t::const_iterator it = maps[m]->begin(); it != maps[m]->end(); ++it) {
+            it->second->revision = obj->revision;
+        }
+    }
+    for (project_scope_map_t::const_iterator pit = loaded.service_scopes.begin(); pit != loaded.service_scopes.end(); ++pit) {
+        for (scope_map_t::const_iterator it = pit->second.begin(); it != pit->second.end(); ++it) {
+            it->second->revision = obj->revision;
+        }
+    }
+    for (node_scope_map_t::const_iterator pit = loaded.node_scopes.begin(); pit != loaded.node_scopes.end(); ++pit) {
+        for (project_scope_map_t::const_iterator sit = pit->second.begin(); sit != pit->second.end(); ++sit) {
+            for (scope_map_t::const_iterator it = sit->second.begin(); it != sit->second.end(); ++it) {
+                it->second->revision = obj->revision;
+            }
+        }
+    }
+    const kislay_json_value_t *revisions = root.find("revisions");
+    for (std::size_t i = 0; revisions != nullptr && i < revisions->items.size(); ++i) {
+        const kislay_json_value_t *scope = revisions->items[i].find("scope");
+        const kislay_json_value_t *written = revisions->items[i].find("revision");
+        if (scope == nullptr || written == nullptr) {
+            continue;
+        }
+        std::vector<std::string> path;
+        for (std::size_t j = 0; j < scope->items.size(); ++j) {
+            path.push_back(kislay_json_scalar_string(scope->items[j]));
+        }
+        scope_ptr_t stored = kislay_server_find_scope_locked(obj, path);
+        if (stored) {
+            stored->revision = std::min(obj->revision, static_cast<std::uint64_t>(std::strtoull(written->text.c_str(), nullptr, 10)));
+        }
+    }
+    kislay_node_tier_reset_locked(obj);
+}
+
+/*
+ * Decodes one journal / replication record:
+ * {"revision":N,"ops":[{"op":"set","scope":[...],"config":{...}} | {"op":"patch","scope":[...],"set":{...},"delete":[...]}]}
+ */
+static bool kislay_json_to_record(const kislay_json_value_t &record, std::uint64_t *revision, std::vector<kislay_scope_op_t> *ops) {
+    const kislay_json_value_t *rev = record.find("revision");
+    const kislay_json_value_t *list = record.find("ops");
+    if (rev == nullptr || rev->kind != kislay_json_value_t::JSON_NUMBER || list == nullptr || list->kind != kislay_json_value_t::JSON_ARRAY) {
+        return false;
+    }
+    *revision = std::strtoull(rev->text.c_str(), nullptr, 10);
+    for (std::size_t i = 0; i < list->items.size(); ++i) {
+        const kislay_json_value_t *kind = list->items[i].find("op");
+        const kislay_json_value_t *scope = list->items[i].find("scope");
+        kislay_scope_op_t op;
+        op.patch = kind != nullptr && kind->text == "patch";
+        const kislay_json_value_t *config = list->items[i].find(op.patch ? "set" : "config");
+        const kislay_json_value_t *deletes = op.patch ? list->items[i].find("delete") : nullptr;
+        if (scope == nullptr || scope->kind != kislay_json_value_t::JSON_ARRAY || config == nullptr || config->kind != kislay_json_value_t::JSON_OBJECT ||
+            (op.patch && (deletes == nullptr || deletes->kind != kislay_json_value_t::JSON_ARRAY))) {
+            return false;
+        }
+        for (std::size_t j = 0; j < scope->items.size(); ++j) {
+            op.scope.push_back(kislay_json_scalar_string(scope->items[j]));
+        }
+        if (!kislay_server_scope_is_valid(op.scope)) {
+            return false;
+        }
+        op.values = kislay_scope_from_json(*config);
+        for (std::size_t j = 0; deletes != nullptr && j < deletes->items.size(); ++j) {
+            op.deletes.push_back(kislay_json_scalar_string(deletes->items[j]));
+        }
+        ops->push_back(op);
+    }
+    return true;
+}
+
+static void kislay_server_request_checkpoint(php_kislayphp_config_server_t *server) {
+    kislay_server_persistence_t &persistence = server->persistence;
+    pthread_mutex_lock(&persistence.lock);
+    if (!persistence.pending) {
+        persistence.pending = true;
+        pthread_cond_signal(&persistence.cond);
+    }
+    pthread_mutex_unlock(&persistence.lock);
+}
+
+/*
+ * Appends and fdatasyncs one record. On failure the journal is cut back to
+ * journal_bytes, so a partial line never sits in front of later records.
+ */
+static bool kislay_server_journal_append_locked(php_kislayphp_config_server_t *server, const std::string &record, std::string *error) {
+    kislay_server_persistence_t &persistence = server->persistence;
+    if (persistence.journal_fd < 0) {
+        return true;
+    }
+    const off_t length = static_cast<off_t>(persistence.journal_bytes);
+    if (persistence.journal_torn && ftruncate(persistence.journal_fd, length) != 0) {
+        *error = std::string("journal truncate failed: ") + std::strerror(errno);
+        persistence.last_checkpoint_error = *error;
+        return false;
+    }
+    persistence.journal_torn = false;
+    if (!kislay_write_all(persistence.journal_fd, record.data(), record.size()) || fdatasync(persistence.journal_fd) != 0) {
+        *error = std::string("journal write failed: ") + std::strerror(errno);
+        persistence.last_checkpoint_error = *error;
+        persistence.journal_torn = ftruncate(persistence.journal_fd, length) != 0;
+        return false;
+    }
+    persistence.journal_bytes += record.size();
+    persistence.journal_records++;
+    if ((persistence.checkpoint_bytes > 0 && persistence.journal_bytes >= persistence.checkpoint_bytes) ||
+        (persistence.checkpoint_records > 0 && persistence.journal_records >= persistence.checkpoint_records)) {
+        kislay_server_request_checkpoint(server);
+    }
+    return true;
+}
+
+/* Keeps the last log_limit records so followers can catch up without a full snapshot. */
+static void kislay_server_change_log_append_locked(php_kislayphp_config_server_t *server, const std::string &record) {
+    kislay_server_replication_t &replication = server->replication;
+    if (replication.log_limit == 0) {
+        replication.log_floor = server->revision;
+        return;
+    }
+    replication.log.push_back(std::make_pair(server->revision, record.substr(0, record.size() - 1)));
+    while (replication.log.size() > replication.log_limit) {
+        replication.log_floor = replication.log.front().first;
+        replication.log.pop_front();
+    }
+}
+
+/* Reads back every spilled node scope a patch in ops targets; *failed is the op whose record could not be read. */
+static bool kislay_server_load_targets_locked(php_kislayphp_config_server_t *server, const std::vector<kislay_scope_op_t> &ops, std::size_t *failed, std::string *error) {
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        const std::vector<std::string> &scope = ops[i].scope;
+        if (!ops[i].patch || scope.size() != 6) {
+            continue;
+        }
+        scope_ptr_t *slot = kislay_server_node_slot_locked(server, scope[1], scope[3], scope[5]);
+        if (slot != nullptr && *slot && (*slot)->cold && !kislay_node_tier_load_locked(server, slot)) {
+            if (failed != nullptr) {
+                *failed = i;
+            }
+            *error = "Unable to load node scope " + scope[1] + "/" + scope[3] + "/" + scope[5] + ": " + server->tier.last_error;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Applies ops as revision; callers hold server->lock and have validated every
+ * scope. Spilled patch targets are loaded and the record is journaled before
+ * anything changes, so a false return (with *error set) leaves the revision,
+ * the scopes and the change log as they were.
+ */
+static bool kislay_server_commit_locked(php_kislayphp_config_server_t *server, std::uint64_t revision, const std::vector<kislay_scope_op_t> &ops,
+    std::size_t *failed, std::string *error) {
+    KISLAY_PROBE2(server__publish, revision, ops.size());
+    if (!kislay_server_load_targets_locked(server, ops, failed, error)) {
+        return false;
+    }
+    const std::string record = kislay_server_journal_record(revision, ops);
+    if (!kislay_server_journal_append_locked(server, record, error)) {
+        return false;
+    }
+    server->revision = revision;
+    server->version = std::to_string(static_cast<unsigned long long>(revision));
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        kislay_server_apply_op_locked(server, ops[i]);
+    }
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        const std::vector<std::string> &scope = ops[i].scope;
+        if (scope.size() != 6) {
+            continue;
+        }
+        scope_ptr_t *slot = kislay_server_node_slot_locked(server, scope[1], scope[3], scope[5]);
+        if (slot != nullptr && *slot && !(*slot)->cold) {
+            kislay_node_tier_touch_locked(server, slot, ops[i].patch);
+        }
+    }
+    kislay_server_change_log_append_locked(server, record);
+    return true;
+}
+
+/* Wholesale state replacement: followers behind the change log must start over. */
+static void kislay_server_reset_change_log_locked(php_kislayphp_config_server_t *server) {
+    server->replication.log.clear();
+    server->replication.log_floor = server->revision;
+}
+
+/*
+ * Validates every op before taking the lock, so a batch lands whole under one
+ * revision or not at all. An invalid op leaves *error empty; a commit the
+ * server could not load or record sets it (and *failed, if one op caused it).
+ */
+static bool kislay_server_apply_ops(php_kislayphp_config_server_t *server, const std::vector<kislay_scope_op_t> &ops, std::string *version, std::size_t *failed, std::string *error) {
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        if (!kislay_server_scope_is_valid(ops[i].scope)) {
+            if (failed != nullptr) {
+                *failed = i;
+            }
+            return false;
+        }
+    }
+    kislay_server_lock_guard_t guard(server);
+    if (!ops.empty() && !kislay_server_commit_locked(server, server->revision + 1, ops, failed, error)) {
+        return false;
+    }
+    if (version != nullptr) {
+        *version = server->version;
+    }
+    return true;
+}
+
+static bool kislay_server_write_scope(php_kislayphp_config_server_t *server, const std::vector<std::string> &scope, flat_map_t *flattened, std::string *version, std::string *error) {
+    std::vector<kislay_scope_op_t> ops(1);
+    ops[0].scope = scope;
+    ops[0].values = std::make_shared<kislay_scope_t>(*flattened);
+    return kislay_server_apply_ops(server, ops, version, nullptr, error);
+}
+
+/* Batch ops name scopes as "projects/commerce" or ["projects", "commerce"]; "" and "global" are the global scope. */
+static std::vector<std::string> kislay_scope_from_path(const std::string &path) {
+    std::vector<std::string> scope;
+    std::vector<std::string> parts = kislay_split(path, '/');
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        if (!parts[i].empty()) {
+            scope.push_back(parts[i]);
+        }
+    }
+    if (scope.empty()) {
+        scope.push_back("global");
+    }
+    return scope;
+}
+
+/* Upserts ("set", nested like a PUT body) and dotted keys to remove ("delete") for a patch op. */
+static bool kislay_json_to_patch(const kislay_json_value_t *set, const kislay_json_value_t *deletes, kislay_scope_op_t *op) {
+    op->patch = true;
+    flat_map_t values;
+    if ((set == nullptr && deletes == nullptr) || (set != nullptr && !kislay_json_to_flat_map(*set, &values))) {
+        return false;
+    }
+    op->values = std::make_shared<kislay_scope_t>(values);
+    if (deletes == nullptr) {
+        return true;
+    }
+    if (deletes->kind != kislay_json_value_t::JSON_ARRAY) {
+        return false;
+    }
+    for (std::size_t i = 0; i < deletes->items.size(); ++i) {
+        if (deletes->items[i].kind != kislay_json_value_t::JSON_STRING) {
+            return false;
+        }
+        op->deletes.push_back(deletes->items[i].text);
+    }
+    return true;
+}
+
+/*
+ * Decodes a POST /v1/config/batch body, {"ops":[...]} or the bare list, where
+ * each op is {"scope":...,"config":{...}} or {"op":"patch","scope":...,"set":{...},"delete":[...]}.
+ */
+static bool kislay_json_to_batch(const kislay_json_value_t &root, std::vector<kislay_scope_op_t> *ops, std::size_t *failed) {
+    const kislay_json_value_t *list = root.kind == kislay_json_value_t::JSON_OBJECT ? root.find("ops") : &root;
+    *failed = 0;
+    if (list == nullptr || list->kind != kislay_json_value_t::JSON_ARRAY) {
+        return false;
+    }
+    ops->reserve(list->items.size());
+    for (std::size_t i = 0; i < list->items.size(); ++i) {
+        *failed = i;
+        const kislay_json_value_t &item = list->items[i];
+        const kislay_json_value_t *op = item.find("op");
+        const kislay_json_value_t *scope = item.find("scope");
+        if (item.kind != kislay_json_value_t::JSON_OBJECT || scope == nullptr ||
+            (op != nullptr && (op->kind != kislay_json_value_t::JSON_STRING || (op->text != "set" && op->text != "patch")))) {
+            return false;
+        }
+        kislay_scope_op_t entry;
+        if (scope->kind == kislay_json_value_t::JSON_STRING) {
+            entry.scope = kislay_scope_from_path(scope->text);
+        } else if (scope->kind == kislay_json_value_t::JSON_ARRAY) {
+            for (std::size_t j = 0; j < scope->items.size(); ++j) {
+                entry.scope.push_back(kislay_json_scalar_string(scope->items[j]));
+            }
+        }
+        if (!kislay_server_scope_is_valid(entry.scope)) {
+            return false;
+        }
+        if (op != nullptr && op->text == "patch") {
+            if (!kislay_json_to_patch(item.find("set"), item.find("delete"), &entry)) {
+                return false;
+            }
+        } else {
+            const kislay_json_value_t *config = item.find("config");
+            flat_map_t values;
+            if (config == nullptr || !kislay_json_to_flat_map(*config, &values)) {
+                return false;
+            }
+            entry.values = std::make_shared<kislay_scope_t>(values);
+        }
+        ops->push_back(entry);
+    }
+    return true;
+}
+
+static bool kislay_pread_all(int fd, char *data, std::size_t size, std::uint64_t offset) {
+    std::size_t read_total = 0;
+    while (read_total < size) {
+        ssize_t got = pread(fd, data + read_total, size - read_total, static_cast<off_t>(offset + read_total));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        read_total += static_cast<std::size_t>(got);
+    }
+    return true;
+}
+
+/*
+ * Cuts the journal back to the records appended after byte offset keep_from,
+ * i.e. the writes committed while the checkpoint was being written. The tail
+ * is copied and fsynced into journal.next without the server lock; the lock
+ * is held only to copy the few records appended meanwhile and to switch
+ * writers over to the new file. The rename happens afterwards, and replay
+ * picks up a journal.next left behind by a crash before it.
+ */
+static bool kislay_server_journal_compact(php_kislayphp_config_server_t *server, std::uint64_t keep_from, std::string *error) {
+    kislay_server_persistence_t &persistence = server->persistence;
+    const std::string next_file = persistence.journal_file + ".next";
+    std::uint64_t copied_to = 0;
+    int old_fd = -1;
+    {
+        kislay_server_lock_guard_t guard(server);
+        copied_to = persistence.journal_bytes;
+        old_fd = persistence.journal_fd;
+    }
+    std::string tail(static_cast<std::size_t>(copied_to > keep_from ? copied_to - keep_from : 0), '\0');
+    if (!kislay_pread_all(old_fd, &tail[0], tail.size(), keep_from)) {
+        if (error != nullptr) {
+            *error = std::string("journal read failed: ") + std::strerror(errno);
+        }
+        return false;
+    }
+    struct stat live, pending;
+    if (stat(next_file.c_str(), &pending) == 0 && fstat(old_fd, &live) == 0 && pending.st_dev == live.st_dev && pending.st_ino == live.st_ino &&
+        rename(next_file.c_str(), persistence.journal_file.c_str()) != 0) {
+        /* The last rename failed; truncating journal.next now would cut the live journal. */
+        if (error != nullptr) {
+            *error = "Unable to rename " + next_file + ": " + std::strerror(errno);
+        }
+        return false;
+    }
+    int fd = open(next_file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || !kislay_write_all(fd, tail.data(), tail.size()) || fsync(fd) != 0) {
+        if (error != nullptr) {
+            *error = "Unable to write " + next_file + ": " + std::strerror(errno);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(next_file.c_str());
+        return false;
+    }
+
+    {
+        kislay_server_lock_guard_t guard(server);
+        std::string late(static_cast<std::size_t>(persistence.journal_bytes - copied_to), '\0');
+        if (!kislay_pread_all(old_fd, &late[0], late.size(), copied_to) || !kislay_write_all(fd, late.data(), late.size()) || fdatasync(fd) != 0) {
+            if (error != nullptr) {
+                *error = std::string("journal copy failed: ") + std::strerror(errno);
+            }
+            close(fd);
+            unlink(next_file.c_str());
+            return false;
+        }
+        persistence.journal_fd = fd;
+        persistence.journal_torn = false;
+        persistence.journal_bytes = tail.size() + late.size();
+        persistence.journal_records = static_cast<std::uint64_t>(std::count(tail.begin(), tail.end(), '\n') + std::count(late.begin(), late.end(), '\n'));
+    }
+    close(old_fd);
+    if (rename(next_file.c_str(), persistence.journal_file.c_str()) != 0) {
+        /* Writers already append to journal.next, so replay still finds every record. */
+        if (error != nullptr) {
+            *error = "Unable to rename " + next_file + ": " + std::strerror(errno);
+        }
+        return false;
+    }
+    kislay_fsync_parent_dir(persistence.journal_file);
+    return true;
+}
+
+/*
+ * Takes a point-in-time view under the lock (pointer copies only), then
+ * serializes and fsyncs it without holding the lock, so resolves keep going.
+ * Safe to call from the checkpoint thread: nothing here touches the engine.
+ */
+static bool kislay_server_checkpoint(php_kislayphp_config_server_t *server, std::string *error) {
+    kislay_server_persistence_t &persistence = server->persistence;
+    if (persistence.checkpoint_file.empty()) {
+        if (error != nullptr) {
+            *error = "No checkpoint file configured";
+        }
+        return false;
+    }
+    kislay_scoped_pthread_lock_t run_guard(&persistence.run_lock);
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    kislay_server_snapshot_t snapshot;
+    std::uint64_t journal_offset = 0;
+    kislay_server_lock(server);
+    kislay_server_snapshot_locked(server, &snapshot);
+    journal_offset = persistence.journal_bytes;
+    pthread_mutex_unlock(&server->lock);
+
+    const std::string body = kislay_server_snapshot_json(snapshot);
+    std::string failure;
+    bool ok = kislay_write_file_atomic(persistence.checkpoint_file, body, &failure);
+
+    if (ok && persistence.journal_fd >= 0) {
+        ok = kislay_server_journal_compact(server, journal_offset, &failure);
+    }
+    kislay_server_lock_guard_t guard(server);
+    persistence.last_checkpoint_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    if (ok) {
+        persistence.checkpoints++;
+        persistence.last_checkpoint_revision = snapshot.revision;
+        persistence.last_checkpoint_size = body.size();
+        persistence.last_checkpoint_error.clear();
+    } else {
+        persistence.last_checkpoint_error = failure;
+        if (error != nullptr) {
+            *error = failure;
+        }
+    }
+    return ok;
+}
+
+static void *kislay_server_checkpoint_main(void *arg) {
+    php_kislayphp_config_server_t *server = static_cast<php_kislayphp_config_server_t *>(arg);
+    kislay_server_persistence_t &persistence = server->persistence;
+    pthread_mutex_lock(&persistence.lock);
+    while (!persistence.stopping) {
+        if (!persistence.pending) {
+            pthread_cond_wait(&persistence.cond, &persistence.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&persistence.lock);
+        kislay_server_checkpoint(server, nullptr);
+        pthread_mutex_lock(&persistence.lock);
+        persistence.pending = false;
+    }
+    pthread_mutex_unlock(&persistence.lock);
+    return nullptr;
+}
+
+static void kislay_server_stop_checkpoint_thread(php_kislayphp_config_server_t *server) {
+    kislay_server_persistence_t &persistence = server->persistence;
+    if (!persistence.thread_started) {
+        return;
+    }
+    pthread_mutex_lock(&persistence.lock);
+    persistence.stopping = true;
+    pthread_cond_signal(&persistence.cond);
+    pthread_mutex_unlock(&persistence.lock);
+    pthread_join(persistence.thread, nullptr);
+    persistence.thread_started = false;
+}
+
+static void kislay_worker_pool_drain(kislay_worker_pool_t::job_t *job) {
+    for (;;) {
+        std::size_t index = job->next.fetch_add(1);
+        if (index >= job->count) {
+            return;
+        }
+        (*job->fn)(index);
+    }
+}
+
+static void *kislay_worker_pool_main(void *arg) {
+    kislay_worker_pool_t *pool = static_cast<kislay_worker_pool_t *>(arg);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && pool->queue.empty()) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        kislay_worker_pool_t::job_t *job = pool->queue.front();
+        job->active++;
+        pthread_mutex_unlock(&pool->lock);
+        kislay_worker_pool_drain(job);
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->queue.empty() && pool->queue.front() == job) {
+            pool->queue.pop_front();
+        }
+        job->active--;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return nullptr;
+}
+
+/* Calls fn(i) for every i in [0, count) across the pool and the calling thread. */
+static void kislay_worker_pool_run(kislay_worker_pool_t *pool, std::size_t count, const std::function<void(std::size_t)> &fn) {
+    kislay_worker_pool_t::job_t job;
+    job.fn = &fn;
+    job.count = count;
+    job.next = 0;
+    job.active = 0;
+    bool shared = pool->size > 1 && count > 1;
+    if (shared) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->threads.size() + 1 < pool->size) {
+            pthread_t thread;
+            if (pthread_create(&thread, nullptr, kislay_worker_pool_main, pool) != 0) {
+                break;
+            }
+            pool->threads.push_back(thread);
+        }
+        pool->queue.push_back(&job);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    kislay_worker_pool_drain(&job);
+    if (shared) {
+        pthread_mutex_lock(&pool->lock);
+        std::deque<kislay_worker_pool_t::job_t *>::iterator it = std::find(pool->queue.begin(), pool->queue.end(), &job);
+        if (it != pool->queue.end()) {
+            pool->queue.erase(it);
+        }
+        while (job.active > 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void kislay_worker_pool_stop(kislay_worker_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (std::size_t i = 0; i < pool->threads.size(); ++i) {
+        pthread_join(pool->threads[i], nullptr);
+    }
+    pool->threads.clear();
+}
+
+/* Lets the connection threads finish the accepted backlog, then joins them. */
+static void kislay_server_stop_connections(php_kislayphp_config_server_t *server) {
+    kislay_server_connections_t &connections = server->connections;
+    pthread_mutex_lock(&connections.lock);
+    connections.stopping = true;
+    pthread_cond_broadcast(&connections.cond);
+    pthread_mutex_unlock(&connections.lock);
+    for (std::size_t i = 0; i < connections.threads.size(); ++i) {
+        pthread_join(connections.threads[i], nullptr);
+    }
+    connections.threads.clear();
+}
+
+/* Captured layers stay valid after the lock is released: patches copy shared scopes. */
+/* The merged entries borrow the layers' handles, so keep layers alive while using them. */
+static kislay_entries_t kislay_merge_chain(const scope_ptr_t layers[5]) {
+    kislay_entries_t result;
+    for (int i = 0; i < 5; ++i) {
+        if (layers[i]) {
+            kislay_merge_entries(&result, layers[i]->entries);
+        }
+    }
+    return result;
+}
+
+/*
+ * The active view is a stack of layers, lowest first: a key takes its value
+ * from the highest layer that has it. kislay_runtime_view holds the
+ * compacted merge of the stack. It is rebuilt on the first read after a
+ * layer was replaced wholesale, and patched key by key when single keys
+ * change.
+ */
+static flat_map_t *const kislay_runtime_layers[] = {
+    &kislay_runtime_remote_snapshot,
+    &kislay_runtime_local_overrides,
+    &kislay_runtime_runtime_overrides,
+    &kislay_runtime_env_snapshot,
+};
+static bool kislay_runtime_view_stale = false;
+
+static const std::string *kislay_runtime_layer_lookup_locked(const std::string &key) {
+    for (std::size_t i = sizeof(kislay_runtime_layers) / sizeof(kislay_runtime_layers[0]); i-- > 0;) {
+        flat_map_t::const_iterator it = kislay_runtime_layers[i]->find(key);
+        if (it != kislay_runtime_layers[i]->end()) {
+            return &it->second;
+        }
+    }
+    return nullptr;
+}
+
+/* Rescans the environment layer and marks the view stale; called after a layer was replaced. */
+static void kislay_runtime_rebuild_locked() {
+    extern char **environ;
+    kislay_request_pin.reset();
+    kislay_runtime_env_snapshot.clear();
+    if (!kislay_runtime_env_prefix.empty()) {
+        for (char **env = environ; env != nullptr && *env != nullptr; ++env) {
+            std::string item(*env);
+            std::size_t eq = item.find('=');
+            if (eq == std::string::npos) {
+                continue;
+            }
+            std::string key = item.substr(0, eq);
+            std::string value = item.substr(eq + 1);
+            std::string config_key = kislay_env_key_to_config_key(key, kislay_runtime_env_prefix);
+            if (!config_key.empty()) {
+                kislay_runtime_env_snapshot[config_key] = value;
+            }
+        }
+    }
+    kislay_runtime_view_stale = true;
+}
+
+/* The current view for writing, copied first if a pin or snapshot still shares it. */
+static kislay_runtime_view_t &kislay_runtime_writable_view_locked() {
+    if (kislay_runtime_view.use_count() > 1) {
+        kislay_runtime_view = std::make_shared<kislay_runtime_view_t>(*kislay_runtime_view);
+        kislay_runtime_stats.view_copies++;
+    } else {
+        /* Pins are dropped without the lock; see their reads before writing over them. */
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *kislay_runtime_view;
+}
+
+static void kislay_runtime_compact_locked() {
+    KISLAY_PROBE1(runtime__rebuild__start, kislay_runtime_stats.rebuilds);
+    std::chrono::steady_clock::time_point phase_start = std::chrono::steady_clock::now();
+    kislay_runtime_stats.rebuilds++;
+    if (kislay_runtime_view.use_count() > 1) {
+        kislay_runtime_view = std::make_shared<kislay_runtime_view_t>();
+    }
+    kislay_runtime_view_t &view = kislay_runtime_writable_view_locked();
+    view.values.clear();
+    for (std::size_t i = 0; i < sizeof(kislay_runtime_layers) / sizeof(kislay_runtime_layers[0]); ++i) {
+        kislay_merge_flat_map(&view.values, *kislay_runtime_layers[i]);
+    }
+    view.version = kislay_runtime_version;
+    if (kislay_runtime_phases != nullptr) {
+        kislay_runtime_phases->rebuild_ms += kislay_elapsed_ms(phase_start);
+        phase_start = std::chrono::steady_clock::now();
+    }
+    view.checksum_sum = kislay_checksum_sum_for_map(view.values);
+    view.checksum = kislay_checksum_hex(view.checksum_sum);
+    if (kislay_runtime_phases != nullptr) {
+        kislay_runtime_phases->checksum_ms += kislay_elapsed_ms(phase_start);
+    }
+    kislay_runtime_view_stale = false;
+    KISLAY_PROBE2(runtime__rebuild__end, view.values.size(), view.checksum.c_str());
+}
+
+static const kislay_runtime_view_t &kislay_runtime_view_locked() {
+    if (kislay_runtime_view_stale) {
+        kislay_runtime_compact_locked();
+    }
+    return *kislay_runtime_view;
+}
+
+/*
+ * Re-resolves one key through the layers after it changed in one of them,
+ * patching the view and checksum in place. Returns whether the key's
+ * effective value changed; always false while the view is stale.
+ */
+static bool kislay_runtime_restack_key_locked(const std::string &key) {
+    /* A request always reads its own writes, so writing drops this thread's pin. */
+    kislay_request_pin.reset();
+    if (kislay_runtime_view_stale) {
+        return false;
+    }
+    const std::string *value = kislay_runtime_layer_lookup_locked(key);
+    flat_map_t::const_iterator current = kislay_runtime_view->values.find(key);
+    bool present = current != kislay_runtime_view->values.end();
+    if (present ? value != nullptr && current->second == *value : value == nullptr) {
+        return false;
+    }
+    kislay_runtime_view_t &view = kislay_runtime_writable_view_locked();
+    std::uint64_t key_hash = kislay_string_hash(key.data(), key.size());
+    flat_map_t::iterator it = view.values.find(key);
+    if (it != view.values.end()) {
+        view.checksum_sum -= kislay_entry_hash(key_hash, kislay_string_hash(it->second.data(), it->second.size()));
+        if (value == nullptr) {
+            view.values.erase(it);
+        } else {
+            it->second = *value;
+        }
+    } else {
+        view.values.emplace(key, *value);
+    }
+    if (value != nullptr) {
+        view.checksum_sum += kislay_entry_hash(key_hash, kislay_string_hash(value->data(), value->size()));
+    }
+    view.checksum = kislay_checksum_hex(view.checksum_sum);
+    return true;
+}
+
+/* Copies a decoded "config" object; json_decode() turns numeric keys into integers, so those are written back as text. */
+static void kislay_runtime_snapshot_from_array(HashTable *ht, flat_map_t *out) {
+    zend_string *key = nullptr;
+    zend_ulong index = 0;
+    zval *entry = nullptr;
+    ZEND_HASH_FOREACH_KEY_VAL(ht, index, key, entry) {
+        if (key != nullptr) {
+            (*out)[std::string(ZSTR_VAL(key), ZSTR_LEN(key))] = kislay_string_from_zval(entry);
+        } else {
+            (*out)[std::to_string(static_cast<long long>(index))] = kislay_string_from_zval(entry);
+        }
+    } ZEND_HASH_FOREACH_END();
+}
+
+static bool kislay_runtime_save_cache_locked() {
+    if (kislay_runtime_cache_file.empty()) {
+        return true;
+    }
+    std::chrono::steady_clock::time_point phase_start = std::chrono::steady_clock::now();
+    zval root;
+    zval config;
+    array_init(&root);
+    add_assoc_string(&root, "version", const_cast<char *>(kislay_runtime_version.c_str()));
+    kislay_flat_map_to_array(kislay_runtime_remote_snapshot, &config);
+    add_assoc_zval(&root, "config", &config);
+    std::string json;
+    bool ok = kislay_json_encode_zval(&root, &json);
+    zval_ptr_dtor(&root);
+    if (ok) {
+        ok = kislay_write_text_file(kislay_runtime_cache_file, json);
+    }
+    if (kislay_runtime_phases != nullptr) {
+        kislay_runtime_phases->cache_write_ms += kislay_elapsed_ms(phase_start);
+    }
+    return ok;
+}
+
+static bool kislay_runtime_load_cache_locked(std::string *error) {
+    if (kislay_runtime_cache_file.empty()) {
+        if (error) {
+            *error = "No cache file configured";
+        }
+        return false;
+    }
+    std::string body;
+    if (!kislay_read_text_file(kislay_runtime_cache_file, &body)) {
+        if (error) {
+            *error = "Unable to read cache file";
+        }
+        return false;
+    }
+    zval decoded;
+    ZVAL_UNDEF(&decoded);
+    if (!kislay_json_decode_assoc(body, &decoded) || Z_TYPE(decoded) != IS_ARRAY) {
+        if (!Z_ISUNDEF(decoded)) {
+            zval_ptr_dtor(&decoded);
+        }
+        if (error) {
+            *error = "Invalid cache payload";
+        }
+        return false;
+    }
+
+    zval *version = zend_hash_str_find(Z_ARRVAL(decoded), "version", sizeof("version") - 1);
+    zval *config = zend_hash_str_find(Z_ARRVAL(decoded), "config", sizeof("config") - 1);
+    if (version != nullptr) {
+        kislay_runtime_version = kislay_string_from_zval(version);
+    }
+    kislay_runtime_fetched_url.clear();
+    if (config == nullptr || Z_TYPE_P(config) != IS_ARRAY) {
+        zval_ptr_dtor(&decoded);
+        if (error) {
+            *error = "Cache missing config";
+        }
+        return false;
+    }
+
+    kislay_runtime_remote_snapshot.clear();
+    kislay_runtime_remote_leaves.clear();
+    kislay_runtime_snapshot_from_array(Z_ARRVAL_P(config), &kislay_runtime_remote_snapshot);
+
+    zval_ptr_dtor(&decoded);
+    return true;
+}
+
+static bool kislay_runtime_load_local_file_locked(const std::string &path, std::string *error) {
+    std::string body;
+    if (!kislay_read_text_file(path, &body)) {
+        if (error) {
+            *error = "Unable to read local config file";
+        }
+        return false;
+    }
+
+    zval decoded;
+    ZVAL_UNDEF(&decoded);
+    if (!kislay_json_decode_assoc(body, &decoded) || Z_TYPE(decoded) != IS_ARRAY) {
+        if (!Z_ISUNDEF(decoded)) {
+            zval_ptr_dtor(&decoded);
+        }
+        if (error) {
+            *error = "Invalid local config JSON";
+        }
+        return false;
+    }
+
+    flat_map_t flattened;
+    if (!kislay_zval_to_flat_map(&decoded, &flattened, error)) {
+        zval_ptr_dtor(&decoded);
+        return false;
+    }
+    kislay_runtime_local_overrides = flattened;
+    zval_ptr_dtor(&decoded);
+    return true;
+}
+
+/* Full-jitter exponential backoff before retry `attempt`; a server Retry-After hint is the floor. */
+static void kislay_runtime_backoff(long attempt, long retry_after_sec) {
+    std::uint64_t cap = static_cast<std::uint64_t>(kislay_runtime_retry_base_ms) << std::min(attempt, 20L);
+    cap = std::min(cap, static_cast<std::uint64_t>(kislay_runtime_retry_max_ms));
+    std::uint64_t delay_ms = kislay_jitter(cap);
+    if (retry_after_sec > 0) {
+        delay_ms = std::max(delay_ms, static_cast<std::uint64_t>(retry_after_sec) * 1000 + kislay_jitter(1000));
+    }
+    delay_ms = std::min(delay_ms, static_cast<std::uint64_t>(KISLAY_CLIENT_RETRY_CAP_MS));
+    struct timespec remaining;
+    remaining.tv_sec = static_cast<time_t>(delay_ms / 1000);
+    remaining.tv_nsec = static_cast<long>(delay_ms % 1000) * 1000000L;
+    while (nanosleep(&remaining, &remaining) != 0 && errno == EINTR) {
+    }
+}
+
+static const std::vector<std::uint64_t> &kislay_runtime_remote_leaves_locked() {
+    if (kislay_runtime_remote_leaves.empty()) {
+        kislay_runtime_remote_leaves.assign(static_cast<std::size_t>(1) << KISLAY_MERKLE_MAX_BITS, 0);
+        for (flat_map_t::const_iterator it = kislay_runtime_remote_snapshot.begin(); it != kislay_runtime_remote_snapshot.end(); ++it) {
+            std::uint64_t key_hash = kislay_string_hash(it->first.data(), it->first.size());
+            kislay_runtime_remote_leaves[kislay_merkle_bucket(key_hash, KISLAY_MERKLE_MAX_BITS)] +=
+                kislay_entry_hash(key_hash, kislay_string_hash(it->second.data(), it->second.size()));
+        }
+    }
+    return kislay_runtime_remote_leaves;
+}
+
+/*
+ * Refreshes the remote snapshot through POST /v1/config/resolve-diff: sends
+ * the bucket hashes of the snapshot and replaces only the buckets the server
+ * reports as different. The patched leaves must add up to the server's root
+ * before anything is committed. One attempt only; on any failure the caller
+ * falls back to a full resolve, which does its own retries.
+ */
+static bool kislay_runtime_diff_sync_locked(const std::string &query) {
+    const std::vector<std::uint64_t> &leaves = kislay_runtime_remote_leaves_locked();
+    int bits = kislay_merkle_bits(kislay_runtime_remote_snapshot.size());
+    std::size_t fold = static_cast<std::size_t>(1) << (KISLAY_MERKLE_MAX_BITS - bits);
+    std::string request("{\"bits\":" + std::to_string(bits) + ",\"buckets\":[");
+    for (std::size_t b = 0; b < leaves.size(); b += fold) {
+        std::uint64_t hash = 0;
+        for (std::size_t i = 0; i < fold; ++i) {
+            hash += leaves[b + i];
+        }
+        if (b > 0) {
+            request.push_back(',');
+        }
+        request.push_back('"');
+        request.append(kislay_merkle_hex(hash));
+        request.push_back('"');
+    }
+    request.append("]}");
+
+    if (kislay_runtime_phases != nullptr) {
+        kislay_runtime_phases->attempts++;
+    }
+    int status = 0;
+    std::string body;
+    std::string error;
+    if (!kislay_http_request("POST", kislay_runtime_server_url + "/v1/config/resolve-diff?" + query + "&if_version=" + kislay_runtime_version,
+            request, &status, &body, &error, nullptr, kislay_runtime_phases)) {
+        return false;
+    }
+    if (status == 304) {
+        return true;
+    }
+    if (status == 404 || status == 403) {
+        kislay_runtime_diff_unsupported_url = kislay_runtime_server_url;
+        kislay_runtime_diff_unsupported_at = std::chrono::steady_clock::now();
+        return false;
+    }
+    if (status != 200) {
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point phase_start = std::chrono::steady_clock::now();
+    zval decoded;
+    ZVAL_UNDEF(&decoded);
+    bool parsed = kislay_json_decode_assoc(body, &decoded) && Z_TYPE(decoded) == IS_ARRAY;
+    if (kislay_runtime_phases != nullptr) {
+        kislay_runtime_phases->parse_ms += kislay_elapsed_ms(phase_start);
+    }
+    zval *version = parsed ? zend_hash_str_find(Z_ARRVAL(decoded), "version", sizeof("version") - 1) : nullptr;
+    zval *reply_bits = parsed ? zend_hash_str_find(Z_ARRVAL(decoded), "bits", sizeof("bits") - 1) : nullptr;
+    zval *root = parsed ? zend_hash_str_find(Z_ARRVAL(decoded), "root", sizeof("root") - 1) : nullptr;
+    zval *buckets = parsed ? zend_hash_str_find(Z_ARRVAL(decoded), "buckets", sizeof("buckets") - 1) : nullptr;
+    zval *config = parsed ? zend_hash_str_find(Z_ARRVAL(decoded), "config", sizeof("config") - 1) : nullptr;
+    if (version == nullptr || reply_bits == nullptr || Z_TYPE_P(reply_bits) != IS_LONG || Z_LVAL_P(reply_bits) != bits
+        || root == nullptr || Z_TYPE_P(root) != IS_STRING || buckets == nullptr || Z_TYPE_P(buckets) != IS_ARRAY
+        || config == nullptr || Z_TYPE_P(config) != IS_ARRAY) {
+        if (!Z_ISUNDEF(decoded)) {
+            zval_ptr_dtor(&decoded);
+        }
+        return false;
+    }
+
+    phase_start = std::chrono::steady_clock::now();
+    std::vector<char> differs(static_cast<std::size_t>(1) << bits, 0);
+    zval *bucket = nullptr;
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(buckets), bucket) {
+        zend_long index = zval_get_long(bucket);
+        if (index >= 0 && static_cast<std::size_t>(index) < differs.size()) {
+            differs[static_cast<std::size_t>(index)] = 1;
+        }
+    } ZEND_HASH_FOREACH_END();
+    flat_map_t received;
+    kislay_runtime_snapshot_from_array(Z_ARRVAL_P(config), &received);
+    std::uint64_t expected = std::strtoull(Z_STRVAL_P(root), nullptr, 16);
+    std::string next_version = kislay_string_from_zval(version);
+    zval_ptr_dtor(&decoded);
+
+    std::vector<std::uint64_t> next(leaves);
+    std::vector<flat_map_t::iterator> removed;
+    for (flat_map_t::iterator it = kislay_runtime_remote_snapshot.begin(); it != kislay_runtime_remote_snapshot.end(); ++it) {
+        std::uint64_t key_hash = kislay_string_hash(it->first.data(), it->first.size());
+        std::size_t leaf = kislay_merkle_bucket(key_hash, KISLAY_MERKLE_MAX_BITS);
+        if (differs[leaf / fold]) {
+            next[leaf] -= kislay_entry_hash(key_hash, kislay_string_hash(it->second.data(), it->second.size()));
+            removed.push_back(it);
+        }
+    }
+    bool consistent = true;
+    for (flat_map_t::const_iterator it = received.begin(); it != received.end() && consistent; ++it) {
+        std::uint64_t key_hash = kislay_string_hash(it->first.data(), it->first.size());
+        std::size_t leaf = kislay_merkle_bucket(key_hash, KISLAY_MERKLE_MAX_BITS);
+        consistent = differs[leaf / fold] != 0;
+        next[leaf] += kislay_entry_hash(key_hash, kislay_string_hash(it->second.data(), it->second.size()));
+    }
+    std::uint64_t sum = 0;
+    for (std::size_t i = 0; i < next.size(); ++i) {
+        sum += next[i];
+    }
+    if (!consistent || sum != expected) {
+        return false;
+    }
+
+    for (std::size_t i = 0; i < removed.size(); ++i) {
+        kislay_runtime_remote_snapshot.erase(removed[i]);
+    }
+    for (flat_map_t::iterator it = received.begin(); it != received.end(); ++it) {
+        kislay_runtime_remote_snapshot[it->first].swap(it->second);
+    }
+    kislay_runtime_remote_leaves.swap(next);
+    kislay_runtime_version = next_version;
+    kislay_runtime_stats.diff_syncs++;
+    kislay_runtime_stats.diff_keys += received.size();
+    if (kislay_runtime_phases != nullptr) {
+        kislay_runtime_phases->flatten_ms += kislay_elapsed_ms(phase_start);
+    }
+    KISLAY_PROBE2(runtime__snapshot__swap, kislay_runtime_version.c_str(), kislay_runtime_remote_snapshot.size());
+    return true;
+}
+
+static bool kislay_runtime_fetch_remote_locked(std::string *error) {
+    if (kislay_runtime_server_url.empty()) {
+        kislay_runtime_remote_snapshot.clear();
+        kislay_runtime_remote_leaves.clear();
+        kislay_runtime_version = "local";
+        kislay_runtime_fetched_url.clear();
+        return true;
+    }
+
+    std::ostringstream query;
+    query << "environment=" << kislay_runtime_environment
+          << "&project=" << kislay_runtime_project
+          << "&service=" << kislay_runtime_service
+          << "&node=" << kislay_runtime_node;
+    std::string fetched_url = kislay_runtime_server_url + "/v1/config/resolve?" + query.str();
+    std::string request_url = fetched_url;
+    bool conditional = request_url == kislay_runtime_fetched_url;
+    if (conditional) {
+        bool diff_supported = kislay_runtime_diff_unsupported_url != kislay_runtime_server_url ||
+            std::chrono::steady_clock::now() - kislay_runtime_diff_unsupported_at >= std::chrono::seconds(KISLAY_DIFF_RETRY_SEC);
+        if (kislay_runtime_remote_snapshot.size() >= KISLAY_MERKLE_MIN_KEYS && diff_supported) {
+            if (kislay_runtime_diff_sync_locked(query.str())) {
+                return true;
+            }
+            kislay_runtime_stats.diff_fallbacks++;
+        }
+        request_url += "&if_version=" + kislay_runtime_version;
+    }
+
+    int status = 0;
+    std::string body;
+    for (long attempt = 0;; ++attempt) {
+        long retry_after_sec = -1;
+        if (kislay_runtime_phases != nullptr) {
+            kislay_runtime_phases->attempts++;
+        }
+        bool answered = kislay_http_request("GET", request_url, std::string(), &status, &body, error, &retry_after_sec, kislay_runtime_phases);
+        bool retryable = !answered || status == 429 || status == 502 || status == 503 || status == 504;
+        if (!retryable || attempt >= kislay_runtime_retries) {
+            if (!answered) {
+                return false;
+            }
+            break;
+        }
+        std::chrono::steady_clock::time_point backoff_start = std::chrono::steady_clock::now();
+        kislay_runtime_backoff(attempt, retry_after_sec);
+        if (kislay_runtime_phases != nullptr) {
+            kislay_runtime_phases->backoff_ms += kislay_elapsed_ms(backoff_start);
+        }
+    }
+    if (conditional && status == 304) {
+        return true;
+    }
+    if (status != 200) {
+        if (error != nullptr) {
+            *error = "Remote config request failed with HTTP " + std::to_string(status);
+        }
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point phase_start = std::chrono::steady_clock::now();
+    zval decoded;
+    ZVAL_UNDEF(&decoded);
+    bool parsed = kislay_json_decode_assoc(body, &decoded);
+    if (kislay_runtime_phases != nullptr) {
+        kislay_runtime_phases->parse_ms += kislay_elapsed_ms(phase_start);
+    }
+    if (!parsed || Z_TYPE(decoded) != IS_ARRAY) {
+        if (!Z_ISUNDEF(decoded)) {
+            zval_ptr_dtor(&decoded);
+        }
+        if (error != nullptr) {
+            *error = "Invalid remote config JSON";
+        }
+        return false;
+    }
+
+    zval *version = zend_hash_str_find(Z_ARRVAL(decoded), "version", sizeof("version") - 1);
+    zval *config = zend_hash_str_find(Z_ARRVAL(decoded), "config", sizeof("config") - 1);
+    if (version != nullptr) {
+        kislay_runtime_version = kislay_string_from_zval(version);
+    }
+    if (config == nullptr || Z_TYPE_P(config) != IS_ARRAY) {
+        zval_ptr_dtor(&decoded);
+        if (error != nullptr) {
+            *error = "Remote payload missing config";
+        }
+        return false;
+    }
+
+    phase_start = std::chrono::steady_clock::now();
+    kislay_runtime_remote_snapshot.clear();
+    kislay_runtime_remote_leaves.clear();
+    kislay_runtime_snapshot_from_array(Z_ARRVAL_P(config), &kislay_runtime_remote_snapshot);
+
+    zval_ptr_dtor(&decoded);
+    if (kislay_runtime_phases != nullptr) {
+        kislay_runtime_phases->flatten_ms += kislay_elapsed_ms(phase_start);
+    }
+    KISLAY_PROBE2(runtime__snapshot__swap, kislay_runtime_version.c_str(), kislay_runtime_remote_snapshot.size());
+    kislay_runtime_fetched_url = fetched_url;
+    return true;
+}
+
+static bool kislay_server_is_follower(php_kislayphp_config_server_t *server) {
+    return !server->replication.leader_url.empty();
+}
+
+static std::string kislay_server_follower_error_json(php_kislayphp_config_server_t *server) {
+    std::string out("{\"error\":\"read-only follower\",\"leader\":");
+    kislay_json_append_string(&out, server->replication.leader_url);
+    out.push_back('}');
+    return out;
+}
+
+/* Leader side of /v1/replication/log: records after `after`, or 410 if the follower must resync. */
+static int kislay_server_change_log_json(php_kislayphp_config_server_t *server, std::uint64_t after, std::string *out) {
+    kislay_server_lock_guard_t guard(server);
+    kislay_server_replication_t &replication = server->replication;
+    if (after < replication.log_floor || after > server->revision) {
+        *out = "{\"error\":\"revision not in change log\"}";
+        return 410;
+    }
+    out->append("{\"revision\":");
+    out->append(std::to_string(static_cast<unsigned long long>(server->revision)));
+    out->append(",\"records\":[");
+    std::deque<std::pair<std::uint64_t, std::string>>::const_iterator it = std::upper_bound(
+        replication.log.begin(), replication.log.end(), after,
+        [](std::uint64_t revision, const std::pair<std::uint64_t, std::string> &entry) { return revision < entry.first; });
+    for (std::size_t count = 0; it != replication.log.end() && count < KISLAY_REPLICATION_BATCH; ++it, ++count) {
+        if (count > 0) {
+            out->push_back(',');
+        }
+        out->append(it->second);
+    }
+    out->append("]}");
+    return 200;
+}
+
+static std::string kislay_server_replication_status_json(php_kislayphp_config_server_t *server) {
+    kislay_server_lock_guard_t guard(server);
+    kislay_server_replication_t &replication = server->replication;
+    std::string out("{\"role\":");
+    out.append(kislay_server_is_follower(server) ? "\"follower\"" : "\"leader\"");
+    out.append(",\"revision\":");
+    out.append(std::to_string(static_cast<unsigned long long>(server->revision)));
+    if (kislay_server_is_follower(server)) {
+        std::uint64_t lag = replication.leader_revision > server->revision ? replication.leader_revision - server->revision : 0;
+        out.append(",\"leader\":");
+        kislay_json_append_string(&out, replication.leader_url);
+        out.append(",\"leader_revision\":");
+        out.append(std::to_string(static_cast<unsigned long long>(replication.leader_revision)));
+        out.append(",\"lag_revisions\":");
+        out.append(std::to_string(static_cast<unsigned long long>(lag)));
+        out.append(",\"last_sync_age_ms\":");
+        out.append(replication.synced
+            ? std::to_string(static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - replication.last_sync).count()))
+            : std::string("-1"));
+        out.append(",\"errors\":");
+        out.append(std::to_string(static_cast<unsigned long long>(replication.errors)));
+        out.append(",\"last_error\":");
+        kislay_json_append_string(&out, replication.last_error);
+    }
+    out.push_back('}');
+    return out;
+}
+
+static bool kislay_server_follower_get(php_kislayphp_config_server_t *server, const std::string &path, int *status, kislay_json_value_t *out, std::string *error) {
+    std::string body;
+    if (!kislay_http_request("GET", server->replication.leader_url + path, std::string(), status, &body, error)) {
+        return false;
+    }
+    if (*status != 200) {
+        return true;
+    }
+    if (!kislay_json_parse(body, out) || out->kind != kislay_json_value_t::JSON_OBJECT) {
+        if (error != nullptr) {
+            *error = "Invalid replication payload from leader";
+        }
+        return false;
+    }
+    return true;
+}
+
+/*
+ * One pull from the leader. Returns the number of records applied, or -1 on
+ * error. A 410 from the log endpoint means we fell behind the leader's log
+ * (or the leader was reloaded) and the next step installs a full snapshot.
+ */
+static long kislay_server_follower_step(php_kislayphp_config_server_t *server, bool *need_snapshot, std::string *error) {
+    kislay_server_replication_t &replication = server->replication;
+    int status = 0;
+    kislay_json_value_t payload;
+
+    if (*need_snapshot) {
+        if (!kislay_server_follower_get(server, "/v1/replication/snapshot", &status, &payload, error)) {
+            return -1;
+        }
+        if (status != 200) {
+            *error = "Leader snapshot request failed with HTTP " + std::to_string(status);
+            return -1;
+        }
+        kislay_server_lock(server);
+        kislay_server_load_state_locked(server, payload);
+        kislay_server_reset_change_log_locked(server);
+        replication.leader_revision = server->revision;
+        replication.snapshots_applied++;
+        bool journaled = server->persistence.journal_fd >= 0;
+        pthread_mutex_unlock(&server->lock);
+        *need_snapshot = false;
+        if (journaled && !kislay_server_checkpoint(server, error)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    kislay_server_lock(server);
+    std::uint64_t after = server->revision;
+    pthread_mutex_unlock(&server->lock);
+    if (!kislay_server_follower_get(server, "/v1/replication/log?after=" + std::to_string(static_cast<unsigned long long>(after)), &status, &payload, error)) {
+        return -1;
+    }
+    if (status == 410) {
+        *need_snapshot = true;
+        return 0;
+    }
+    if (status != 200) {
+        *error = "Leader log request failed with HTTP " + std::to_string(status);
+        return -1;
+    }
+    const kislay_json_value_t *leader_revision = payload.find("revision");
+    const kislay_json_value_t *records = payload.find("records");
+    if (leader_revision == nullptr || records == nullptr || records->kind != kislay_json_value_t::JSON_ARRAY) {
+        *error = "Invalid replication log from leader";
+        return -1;
+    }
+
+    long applied = 0;
+    kislay_server_lock_guard_t guard(server);
+    for (std::size_t i = 0; i < records->items.size(); ++i) {
+        std::uint64_t revision = 0;
+        std::vector<kislay_scope_op_t> ops;
+        if (!kislay_json_to_record(records->items[i], &revision, &ops)) {
+            *error = "Invalid replication record from leader";
+            return -1;
+        }
+        if (revision <= server->revision) {
+            continue;
+        }
+        if (!kislay_server_commit_locked(server, revision, ops, nullptr, error)) {
+            replication.records_applied += static_cast<std::uint64_t>(applied);
+            return -1;
+        }
+        applied++;
+    }
+    replication.leader_revision = std::strtoull(leader_revision->text.c_str(), nullptr, 10);
+    replication.records_applied += static_cast<std::uint64_t>(applied);
+    return static_cast<long>(records->items.size());
+}
+
+static void *kislay_server_follower_main(void *arg) {
+    php_kislayphp_config_server_t *server = static_cast<php_kislayphp_config_server_t *>(arg);
+    kislay_server_replication_t &replication = server->replication;
+
+    kislay_server_lock(server);
+    bool need_snapshot = server->revision == 0;
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_mutex_lock(&replication.lock);
+    while (!replication.stopping) {
+        pthread_mutex_unlock(&replication.lock);
+        std::string error;
+        long pulled = kislay_server_follower_step(server, &need_snapshot, &error);
+        kislay_server_lock(server);
+        if (pulled < 0) {
+            replication.errors++;
+            replication.last_error = error;
+        } else {
+            replication.synced = true;
+            replication.last_sync = std::chrono::steady_clock::now();
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        pthread_mutex_lock(&replication.lock);
+        if (need_snapshot || pulled >= KISLAY_REPLICATION_BATCH || replication.stopping) {
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += replication.interval_ms / 1000;
+        deadline.tv_nsec += (replication.interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&replication.cond, &replication.lock, &deadline);
+    }
+    pthread_mutex_unlock(&replication.lock);
+    return nullptr;
+}
+
+static void kislay_server_stop_follower_thread(php_kislayphp_config_server_t *server) {
+    kislay_server_replication_t &replication = server->replication;
+    if (!replication.thread_started) {
+        return;
+    }
+    pthread_mutex_lock(&replication.lock);
+    replication.stopping = true;
+    pthread_cond_signal(&replication.cond);
+    pthread_mutex_unlock(&replication.lock);
+    pthread_join(replication.thread, nullptr);
+    replication.thread_started = false;
+}
+
+static bool kislay_server_is_agent(php_kislayphp_config_server_t *server) {
+    return !server->agent.upstream_url.empty();
+}
+
+static std::string kislay_server_agent_error_json(php_kislayphp_config_server_t *server) {
+    std::string out("{\"error\":\"read-only caching agent\",\"upstream\":");
+    kislay_json_append_string(&out, server->agent.upstream_url);
+    out.push_back('}');
+    return out;
+}
+
+static std::string kislay_agent_key(const std::string &environment, const std::string &project, const std::string &service, const std::string &node) {
+    return "environment=" + kislay_url_encode(environment) + "&project=" + kislay_url_encode(project)
+        + "&service=" + kislay_url_encode(service) + "&node=" + kislay_url_encode(node);
+}
+
+/* The version of a resolve payload; upstream payloads are this server's own {"version":"N",...}. */
+static bool kislay_resolve_payload_version(const std::string &payload, std::string *version) {
+    static const char prefix[] = "{\"version\":\"";
+    if (payload.compare(0, sizeof(prefix) - 1, prefix) != 0) {
+        return false;
+    }
+    std::size_t end = payload.find('"', sizeof(prefix) - 1);
+    if (end == std::string::npos) {
+        return false;
+    }
+    version->assign(payload, sizeof(prefix) - 1, end - (sizeof(prefix) - 1));
+    return true;
+}
+
+/*
+ * GET resolve for key from the upstream. Returns the HTTP status (304 when
+ * if_version still matches), or 0 with error set when the upstream is
+ * unreachable or answers something unusable.
+ */
+static int kislay_agent_fetch(php_kislayphp_config_server_t *server, const std::string &key, const std::string &if_version,
+    std::shared_ptr<kislay_resolve_entry_t> *response, std::string *version, std::string *error) {
+    std::string url = server->agent.upstream_url + "/v1/config/resolve?" + key;
+    if (!if_version.empty()) {
+        url += "&if_version=" + kislay_url_encode(if_version);
+    }
+    int status = 0;
+    std::string body;
+    if (!kislay_http_request("GET", url, std::string(), &status, &body, error)) {
+        return 0;
+    }
+    if (status == 304) {
+        return status;
+    }
+    if (status != 200 || !kislay_resolve_payload_version(body, version)) {
+        *error = "Upstream resolve failed with HTTP " + std::to_string(status);
+        return 0;
+    }
+    std::shared_ptr<kislay_resolve_entry_t> entry = std::make_shared<kislay_resolve_entry_t>();
+    entry->payload = std::make_shared<const std::string>(std::move(body));
+    *response = entry;
+    return status;
+}
+
+/*
+ * The mirrored resolve for key, fetched from the upstream on first use.
+ * Concurrent first requests for one key share a single upstream fetch.
+ * False when that fetch fails.
+ */
+static bool kislay_server_agent_resolve(php_kislayphp_config_server_t *server, const std::string &key, std::shared_ptr<kislay_resolve_entry_t> *response, std::string *version) {
+    kislay_server_agent_t &agent = server->agent;
+    pthread_mutex_lock(&agent.lock);
+    std::unordered_map<std::string, std::shared_ptr<kislay_agent_entry_t>>::iterator it = agent.entries.find(key);
+    if (it != agent.entries.end()) {
+        std::shared_ptr<kislay_agent_entry_t> entry = it->second;
+        while (!entry->loaded && (it = agent.entries.find(key)) != agent.entries.end() && it->second == entry) {
+            pthread_cond_wait(&agent.cond, &agent.lock);
+        }
+        bool loaded = entry->loaded;
+        if (loaded) {
+            agent.hits++;
+            entry->last_used = std::chrono::steady_clock::now();
+            *response = entry->response;
+            *version = entry->version;
+        }
+        pthread_mutex_unlock(&agent.lock);
+        return loaded;
+    }
+    std::shared_ptr<kislay_agent_entry_t> entry = std::make_shared<kislay_agent_entry_t>();
+    agent.entries[key] = entry;
+    agent.misses++;
+    pthread_mutex_unlock(&agent.lock);
+
+    std::string error;
+    int status = kislay_agent_fetch(server, key, std::string(), response, version, &error);
+
+    pthread_mutex_lock(&agent.lock);
+    if (status == 200) {
+        entry->response = *response;
+        entry->version = *version;
+        entry->last_used = std::chrono::steady_clock::now();
+        entry->loaded = true;
+    } else {
+        agent.errors++;
+        agent.last_error = error;
+        agent.entries.erase(key);
+    }
+    pthread_cond_broadcast(&agent.cond);
+    pthread_mutex_unlock(&agent.lock);
+    return status == 200;
+}
+
+/*
+ * The upstream's global version, fetched at most once per interval_ms. While
+ * one request refetches, or when the refetch fails, the last body is served.
+ * False only when there has never been a body.
+ */
+static bool kislay_server_agent_version(php_kislayphp_config_server_t *server, std::string *body) {
+    kislay_server_agent_t &agent = server->agent;
+    pthread_mutex_lock(&agent.lock);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool fresh = !agent.version_body.empty() && now - agent.version_fetched < std::chrono::milliseconds(agent.interval_ms);
+    if (fresh || (agent.version_fetching && !agent.version_body.empty())) {
+        *body = agent.version_body;
+        pthread_mutex_unlock(&agent.lock);
+        return true;
+    }
+    agent.version_fetching = true;
+    pthread_mutex_unlock(&agent.lock);
+
+    int status = 0;
+    std::string fetched;
+    std::string error;
+    bool ok = kislay_http_request("GET", agent.upstream_url + "/v1/config/version", std::string(), &status, &fetched, &error) && status == 200;
+
+    pthread_mutex_lock(&agent.lock);
+    agent.version_fetching = false;
+    if (ok) {
+        agent.version_body = fetched;
+        agent.version_fetched = std::chrono::steady_clock::now();
+    } else {
+        agent.errors++;
+        agent.last_error = error.empty() ? "Upstream version failed with HTTP " + std::to_string(status) : error;
+    }
+    *body = agent.version_body;
+    pthread_mutex_unlock(&agent.lock);
+    return !body->empty();
+}
+
+/* Revalidates every mirrored tuple once and drops tuples idle for longer than idle_sec. */
+static void kislay_server_agent_step(php_kislayphp_config_server_t *server) {
+    kislay_server_agent_t &agent = server->agent;
+    std::vector<std::pair<std::string, std::shared_ptr<kislay_agent_entry_t>>> loaded;
+    pthread_mutex_lock(&agent.lock);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (std::unordered_map<std::string, std::shared_ptr<kislay_agent_entry_t>>::iterator it = agent.entries.begin(); it != agent.entries.end();) {
+        if (it->second->loaded && now - it->second->last_used > std::chrono::seconds(agent.idle_sec)) {
+            it = agent.entries.erase(it);
+            continue;
+        }
+        if (it->second->loaded) {
+            loaded.push_back(*it);
+        }
+        ++it;
+    }
+    pthread_mutex_unlock(&agent.lock);
+
+    bool failed = false;
+    for (std::size_t i = 0; i < loaded.size(); ++i) {
+        pthread_mutex_lock(&agent.lock);
+        std::string if_version = loaded[i].second->version;
+        bool stopping = agent.stopping;
+        pthread_mutex_unlock(&agent.lock);
+        if (stopping) {
+            return;
+        }
+        std::shared_ptr<kislay_resolve_entry_t> response;
+        std::string version;
+        std::string error;
+        int status = kislay_agent_fetch(server, loaded[i].first, if_version, &response, &version, &error);
+        pthread_mutex_lock(&agent.lock);
+        if (status == 200) {
+            loaded[i].second->response = response;
+            loaded[i].second->version = version;
+            agent.updates++;
+        } else if (status == 0) {
+            agent.errors++;
+            agent.last_error = error;
+            failed = true;
+        }
+        pthread_mutex_unlock(&agent.lock);
+    }
+    if (!failed) {
+        pthread_mutex_lock(&agent.lock);
+        agent.synced = true;
+        agent.last_sync = std::chrono::steady_clock::now();
+        pthread_mutex_unlock(&agent.lock);
+    }
+}
+
+static void *kislay_server_agent_main(void *arg) {
+    php_kislayphp_config_server_t *server = static_cast<php_kislayphp_config_server_t *>(arg);
+    kislay_server_agent_t &agent = server->agent;
+
+    pthread_mutex_lock(&agent.lock);
+    while (!agent.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += agent.interval_ms / 1000;
+        deadline.tv_nsec += (agent.interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!agent.stopping && pthread_cond_timedwait(&agent.timer, &agent.lock, &deadline) != ETIMEDOUT) {
+        }
+        if (agent.stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&agent.lock);
+        kislay_server_agent_step(server);
+        pthread_mutex_lock(&agent.lock);
+    }
+    pthread_mutex_unlock(&agent.lock);
+    return nullptr;
+}
+
+static void kislay_server_stop_agent_thread(php_kislayphp_config_server_t *server) {
+    kislay_server_agent_t &agent = server->agent;
+    if (!agent.thread_started) {
+        return;
+    }
+    pthread_mutex_lock(&agent.lock);
+    agent.stopping = true;
+    pthread_cond_broadcast(&agent.timer);
+    pthread_mutex_unlock(&agent.lock);
+    pthread_join(agent.thread, nullptr);
+    agent.thread_started = false;
+}
+
+static bool kislay_hash_find_string(HashTable *ht, const char *key, std::string *out) {
+    zval *value = zend_hash_str_find(ht, key, std::strlen(key));
+    if (value == nullptr || Z_TYPE_P(value) == IS_NULL) {
+        return false;
+    }
+    *out = kislay_string_from_zval(value);
+    return true;
+}
 
 static zend_object *kislayphp_config_client_create_object(zend_class_entry *ce) {
     php_kislayphp_config_client_t *obj = static_cast<php_kislayphp_config_client_t *>(
@@ -903,6 +4990,22 @@ static zend_object *kislayphp_config_client_create_object(zend_class_entry *ce)
     return &obj->std;
 }
 
+static zend_object *kislayphp_config_snapshot_create_object(zend_class_entry *ce) {
+    php_kislayphp_config_snapshot_t *obj = static_cast<php_kislayphp_config_snapshot_t *>(
+        ecalloc(1, sizeof(php_kislayphp_config_snapshot_t) + zend_object_properties_size(ce)));
+    zend_object_std_init(&obj->std, ce);
+    object_properties_init(&obj->std, ce);
+    new (&obj->view) kislay_view_ptr_t();
+    obj->std.handlers = &kislayphp_config_snapshot_handlers;
+    return &obj->std;
+}
+
+static void kislayphp_config_snapshot_free_obj(zend_object *object) {
+    php_kislayphp_config_snapshot_t *obj = php_kislayphp_config_snapshot_from_obj(object);
+    obj->view.~shared_ptr();
+    zend_object_std_dtor(&obj->std);
+}
+
 static void kislayphp_config_client_free_obj(zend_object *object) {
     php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(object);
     if (obj->has_client) {
@@ -918,18 +5021,46 @@ static zend_object *kislayphp_config_server_create_object(zend_class_entry *ce)
         ecalloc(1, sizeof(php_kislayphp_config_server_t) + zend_object_properties_size(ce)));
     zend_object_std_init(&obj->std, ce);
     object_properties_init(&obj->std, ce);
-    new (&obj->global_scope) flat_map_t();
+    new (&obj->global_scope) scope_ptr_t(std::make_shared<kislay_scope_t>());
     new (&obj->environment_scopes) scope_map_t();
     new (&obj->project_scopes) scope_map_t();
     new (&obj->service_scopes) project_scope_map_t();
     new (&obj->node_scopes) node_scope_map_t();
-    obj->host = "127.0.0.1";
+    new (&obj->host) std::string("127.0.0.1");
     obj->port = 9011;
+    obj->socket_mode = -1;
     obj->listen_fd = -1;
     obj->running = false;
     obj->revision = 0;
-    obj->version = "0";
+    new (&obj->version) std::string("0");
     pthread_mutex_init(&obj->lock, nullptr);
+    new (&obj->persistence) kislay_server_persistence_t();
+    pthread_mutex_init(&obj->persistence.lock, nullptr);
+    pthread_cond_init(&obj->persistence.cond, nullptr);
+    pthread_mutex_init(&obj->persistence.run_lock, nullptr);
+    new (&obj->replication) kislay_server_replication_t();
+    pthread_mutex_init(&obj->replication.lock, nullptr);
+    pthread_cond_init(&obj->replication.cond, nullptr);
+    new (&obj->workers) kislay_worker_pool_t();
+    obj->workers.size = static_cast<std::size_t>(std::min(8L, std::max(1L, sysconf(_SC_NPROCESSORS_ONLN))));
+    pthread_mutex_init(&obj->workers.lock, nullptr);
+    pthread_cond_init(&obj->workers.cond, nullptr);
+    pthread_cond_init(&obj->workers.done, nullptr);
+    new (&obj->metrics) kislay_server_metrics_t();
+    pthread_mutex_init(&obj->metrics.lock, nullptr);
+    new (&obj->connections) kislay_server_connections_t();
+    obj->connections.endpoints[KISLAY_ENDPOINT_RESOLVE_BATCH].limit = 2;
+    obj->connections.endpoints[KISLAY_ENDPOINT_REPLICATION].limit = 2;
+    pthread_mutex_init(&obj->connections.lock, nullptr);
+    pthread_cond_init(&obj->connections.cond, nullptr);
+    new (&obj->coalescer) kislay_server_coalescer_t();
+    pthread_mutex_init(&obj->coalescer.lock, nullptr);
+    pthread_cond_init(&obj->coalescer.cond, nullptr);
+    new (&obj->agent) kislay_server_agent_t();
+    pthread_mutex_init(&obj->agent.lock, nullptr);
+    pthread_cond_init(&obj->agent.cond, nullptr);
+    pthread_cond_init(&obj->agent.timer, nullptr);
+    new (&obj->tier) kislay_node_tier_t();
     obj->std.handlers = &kislayphp_config_server_handlers;
     return &obj->std;
 }
@@ -940,11 +5071,45 @@ static void kislayphp_config_server_free_obj(zend_object *object) {
         close(obj->listen_fd);
         obj->listen_fd = -1;
     }
-    obj->global_scope.~unordered_map();
+    kislay_server_stop_follower_thread(obj);
+    kislay_server_stop_agent_thread(obj);
+    kislay_server_stop_checkpoint_thread(obj);
+    kislay_server_stop_connections(obj);
+    kislay_worker_pool_stop(&obj->workers);
+    if (obj->persistence.journal_fd >= 0) {
+        close(obj->persistence.journal_fd);
+    }
+    pthread_mutex_destroy(&obj->persistence.lock);
+    pthread_cond_destroy(&obj->persistence.cond);
+    pthread_mutex_destroy(&obj->persistence.run_lock);
+    obj->persistence.~kislay_server_persistence_t();
+    pthread_mutex_destroy(&obj->replication.lock);
+    pthread_cond_destroy(&obj->replication.cond);
+    obj->replication.~kislay_server_replication_t();
+    pthread_mutex_destroy(&obj->workers.lock);
+    pthread_cond_destroy(&obj->workers.cond);
+    pthread_cond_destroy(&obj->workers.done);
+    obj->workers.~kislay_worker_pool_t();
+    pthread_mutex_destroy(&obj->connections.lock);
+    pthread_cond_destroy(&obj->connections.cond);
+    obj->connections.~kislay_server_connections_t();
+    pthread_mutex_destroy(&obj->coalescer.lock);
+    pthread_cond_destroy(&obj->coalescer.cond);
+    obj->coalescer.~kislay_server_coalescer_t();
+    pthread_mutex_destroy(&obj->agent.lock);
+    pthread_cond_destroy(&obj->agent.cond);
+    pthread_cond_destroy(&obj->agent.timer);
+    obj->agent.~kislay_server_agent_t();
+    obj->tier.~kislay_node_tier_t();
+    pthread_mutex_destroy(&obj->metrics.lock);
+    obj->metrics.~kislay_server_metrics_t();
+    obj->global_scope.~scope_ptr_t();
     obj->environment_scopes.~unordered_map();
     obj->project_scopes.~unordered_map();
     obj->service_scopes.~unordered_map();
     obj->node_scopes.~unordered_map();
+    obj->host.~basic_string();
+    obj->version.~basic_string();
     pthread_mutex_destroy(&obj->lock);
     zend_object_std_dtor(&obj->std);
 }
@@ -1007,11 +5172,20 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_config_set_override, 0, 0, 2)
     ZEND_ARG_INFO(0, value)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_config_set_overrides, 0, 0, 1)
+    ZEND_ARG_ARRAY_INFO(0, values, 0)
+    ZEND_ARG_TYPE_INFO(0, replace, _IS_BOOL, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_config_clear_overrides, 0, 0, 0)
+    ZEND_ARG_ARRAY_INFO(0, keys, 1)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_construct, 0, 0, 0)
     ZEND_ARG_ARRAY_INFO(0, options, 1)
 ZEND_END_ARG_INFO()
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_listen, 0, 0, 2)
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_listen, 0, 0, 1)
     ZEND_ARG_TYPE_INFO(0, host, IS_STRING, 0)
     ZEND_ARG_TYPE_INFO(0, port, IS_LONG, 0)
 ZEND_END_ARG_INFO()
@@ -1025,462 +5199,863 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_environment_scope, 0, 0, 2)
     ZEND_ARG_ARRAY_INFO(0, config, 0)
 ZEND_END_ARG_INFO()
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_project_scope, 0, 0, 2)
-    ZEND_ARG_TYPE_INFO(0, project, IS_STRING, 0)
-    ZEND_ARG_ARRAY_INFO(0, config, 0)
-ZEND_END_ARG_INFO()
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_project_scope, 0, 0, 2)
+    ZEND_ARG_TYPE_INFO(0, project, IS_STRING, 0)
+    ZEND_ARG_ARRAY_INFO(0, config, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_service_scope, 0, 0, 3)
+    ZEND_ARG_TYPE_INFO(0, project, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 0)
+    ZEND_ARG_ARRAY_INFO(0, config, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_node_scope, 0, 0, 4)
+    ZEND_ARG_TYPE_INFO(0, project, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 0)
+    ZEND_ARG_TYPE_INFO(0, node, IS_STRING, 0)
+    ZEND_ARG_ARRAY_INFO(0, config, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_apply, 0, 0, 1)
+    ZEND_ARG_ARRAY_INFO(0, ops, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_resolve, 0, 0, 0)
+    ZEND_ARG_TYPE_INFO(0, environment, IS_STRING, 1)
+    ZEND_ARG_TYPE_INFO(0, project, IS_STRING, 1)
+    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 1)
+    ZEND_ARG_TYPE_INFO(0, node, IS_STRING, 1)
+ZEND_END_ARG_INFO()
+
+static zval *kislayphp_config_client_get_value(php_kislayphp_config_client_t *obj, const char *key, size_t key_len, zval *default_val, zval *return_value) {
+    if (obj->has_client) {
+        zval key_zv;
+        ZVAL_STRINGL(&key_zv, key, key_len);
+        zval retval;
+        ZVAL_UNDEF(&retval);
+        if (default_val != nullptr) {
+            zend_call_method_with_2_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "get", &retval, &key_zv, default_val);
+        } else {
+            zend_call_method_with_1_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "get", &retval, &key_zv);
+        }
+        zval_ptr_dtor(&key_zv);
+        if (Z_ISUNDEF(retval)) {
+            if (default_val != nullptr) {
+                ZVAL_COPY(return_value, default_val);
+            } else {
+                ZVAL_NULL(return_value);
+            }
+        } else {
+            ZVAL_COPY_VALUE(return_value, &retval);
+        }
+        return return_value;
+    }
+
+    std::string value;
+    bool found = false;
+    pthread_mutex_lock(&obj->lock);
+    flat_map_t::iterator it = obj->values.find(std::string(key, key_len));
+    if (it != obj->values.end()) {
+        value = it->second;
+        found = true;
+    }
+    pthread_mutex_unlock(&obj->lock);
+
+    if (!found) {
+        if (default_val != nullptr) {
+            ZVAL_COPY(return_value, default_val);
+        } else {
+            ZVAL_NULL(return_value);
+        }
+        return return_value;
+    }
+    ZVAL_STRING(return_value, value.c_str());
+    return return_value;
+}
+
+PHP_METHOD(KislayPHPConfigClient, __construct) {
+    ZEND_PARSE_PARAMETERS_NONE();
+}
+
+PHP_METHOD(KislayPHPConfigClient, setClient) {
+    zval *client = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_ZVAL(client)
+    ZEND_PARSE_PARAMETERS_END();
+
+    if (client == nullptr || Z_TYPE_P(client) != IS_OBJECT || !instanceof_function(Z_OBJCE_P(client), kislayphp_config_client_interface_ce)) {
+        zend_throw_exception(zend_ce_exception, "Client must implement Kislay\\Config\\ClientInterface", 0);
+        RETURN_FALSE;
+    }
+
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    if (obj->has_client) {
+        zval_ptr_dtor(&obj->client);
+    }
+    ZVAL_COPY(&obj->client, client);
+    obj->has_client = true;
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPConfigClient, set) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    char *value = nullptr;
+    size_t value_len = 0;
+    ZEND_PARSE_PARAMETERS_START(2, 2)
+        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_STRING(value, value_len)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    if (obj->has_client) {
+        zval key_zv;
+        zval value_zv;
+        zval retval;
+        ZVAL_STRINGL(&key_zv, key, key_len);
+        ZVAL_STRINGL(&value_zv, value, value_len);
+        ZVAL_UNDEF(&retval);
+        zend_call_method_with_2_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "set", &retval, &key_zv, &value_zv);
+        zval_ptr_dtor(&key_zv);
+        zval_ptr_dtor(&value_zv);
+        if (Z_ISUNDEF(retval)) {
+            RETURN_TRUE;
+        }
+        RETVAL_ZVAL(&retval, 1, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&obj->lock);
+    obj->values[std::string(key, key_len)] = std::string(value, value_len);
+    pthread_mutex_unlock(&obj->lock);
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPConfigClient, get) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    zval *default_val = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ZVAL(default_val)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    zval out;
+    ZVAL_UNDEF(&out);
+    kislayphp_config_client_get_value(obj, key, key_len, default_val, &out);
+    RETVAL_ZVAL(&out, 1, 1);
+}
+
+PHP_METHOD(KislayPHPConfigClient, getString) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    zend_string *default_val = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_STR_OR_NULL(default_val)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    zval fallback;
+    zval out;
+    ZVAL_UNDEF(&fallback);
+    ZVAL_UNDEF(&out);
+    zval *fallback_ptr = nullptr;
+    if (default_val != nullptr) {
+        ZVAL_STR_COPY(&fallback, default_val);
+        fallback_ptr = &fallback;
+    }
+    kislayphp_config_client_get_value(obj, key, key_len, fallback_ptr, &out);
+    if (Z_TYPE(out) == IS_NULL) {
+        RETVAL_NULL();
+    } else {
+        zend_string *string_value = zval_get_string(&out);
+        RETVAL_STR(string_value);
+    }
+    if (!Z_ISUNDEF(out)) {
+        zval_ptr_dtor(&out);
+    }
+    if (!Z_ISUNDEF(fallback)) {
+        zval_ptr_dtor(&fallback);
+    }
+}
+
+PHP_METHOD(KislayPHPConfigClient, getInt) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    zend_long default_val = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(default_val)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    zval fallback;
+    zval out;
+    ZVAL_LONG(&fallback, default_val);
+    ZVAL_UNDEF(&out);
+    kislayphp_config_client_get_value(obj, key, key_len, &fallback, &out);
+    convert_to_long(&out);
+    RETVAL_LONG(Z_LVAL(out));
+    zval_ptr_dtor(&out);
+}
+
+PHP_METHOD(KislayPHPConfigClient, getBool) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    zend_bool default_val = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_BOOL(default_val)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    zval fallback;
+    zval out;
+    ZVAL_BOOL(&fallback, default_val);
+    ZVAL_UNDEF(&out);
+    kislayphp_config_client_get_value(obj, key, key_len, &fallback, &out);
+    if (Z_TYPE(out) == IS_STRING) {
+        std::string lower = kislay_to_lower(std::string(Z_STRVAL(out), Z_STRLEN(out)));
+        RETVAL_BOOL(lower == "1" || lower == "true" || lower == "yes" || lower == "on");
+    } else {
+        convert_to_boolean(&out);
+        RETVAL_BOOL(Z_TYPE(out) == IS_TRUE);
+    }
+    zval_ptr_dtor(&out);
+}
+
+PHP_METHOD(KislayPHPConfigClient, getArray) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    zval *default_val = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_EX(default_val, 1, 0)
+    ZEND_PARSE_PARAMETERS_END();
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_service_scope, 0, 0, 3)
-    ZEND_ARG_TYPE_INFO(0, project, IS_STRING, 0)
-    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 0)
-    ZEND_ARG_ARRAY_INFO(0, config, 0)
-ZEND_END_ARG_INFO()
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    zval out;
+    ZVAL_UNDEF(&out);
+    kislayphp_config_client_get_value(obj, key, key_len, default_val, &out);
+    if (Z_TYPE(out) == IS_ARRAY) {
+        RETVAL_ZVAL(&out, 1, 1);
+        zval_ptr_dtor(&out);
+        return;
+    }
+    if (Z_TYPE(out) == IS_STRING) {
+        zval decoded;
+        ZVAL_UNDEF(&decoded);
+        if (kislay_json_decode_assoc(std::string(Z_STRVAL(out), Z_STRLEN(out)), &decoded) && Z_TYPE(decoded) == IS_ARRAY) {
+            RETVAL_ZVAL(&decoded, 1, 1);
+            zval_ptr_dtor(&out);
+            return;
+        }
+        if (!Z_ISUNDEF(decoded)) {
+            zval_ptr_dtor(&decoded);
+        }
+    }
+    if (default_val != nullptr) {
+        RETVAL_ZVAL(default_val, 1, 0);
+    } else {
+        array_init(return_value);
+    }
+    zval_ptr_dtor(&out);
+}
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_node_scope, 0, 0, 4)
-    ZEND_ARG_TYPE_INFO(0, project, IS_STRING, 0)
-    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 0)
-    ZEND_ARG_TYPE_INFO(0, node, IS_STRING, 0)
-    ZEND_ARG_ARRAY_INFO(0, config, 0)
-ZEND_END_ARG_INFO()
+PHP_METHOD(KislayPHPConfigClient, all) {
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    if (obj->has_client) {
+        zval retval;
+        ZVAL_UNDEF(&retval);
+        zend_call_method_with_0_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "all", &retval);
+        if (Z_ISUNDEF(retval)) {
+            array_init(return_value);
+            return;
+        }
+        RETVAL_ZVAL(&retval, 1, 1);
+        return;
+    }
+    array_init(return_value);
+    pthread_mutex_lock(&obj->lock);
+    for (flat_map_t::const_iterator it = obj->values.begin(); it != obj->values.end(); ++it) {
+        add_assoc_string(return_value, it->first.c_str(), const_cast<char *>(it->second.c_str()));
+    }
+    pthread_mutex_unlock(&obj->lock);
+}
 
-ZEND_BEGIN_ARG_INFO_EX(arginfo_kislayphp_server_resolve, 0, 0, 0)
-    ZEND_ARG_TYPE_INFO(0, environment, IS_STRING, 1)
-    ZEND_ARG_TYPE_INFO(0, project, IS_STRING, 1)
-    ZEND_ARG_TYPE_INFO(0, service, IS_STRING, 1)
-    ZEND_ARG_TYPE_INFO(0, node, IS_STRING, 1)
-ZEND_END_ARG_INFO()
+PHP_METHOD(KislayPHPConfigClient, has) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_STRING(key, key_len)
+    ZEND_PARSE_PARAMETERS_END();
 
-static zval *kislayphp_config_client_get_value(php_kislayphp_config_client_t *obj, const char *key, size_t key_len, zval *default_val, zval *return_value) {
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
     if (obj->has_client) {
         zval key_zv;
-        ZVAL_STRINGL(&key_zv, key, key_len);
         zval retval;
+        ZVAL_STRINGL(&key_zv, key, key_len);
         ZVAL_UNDEF(&retval);
-        if (default_val != nullptr) {
-            zend_call_method_with_2_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "get", &retval, &key_zv, default_val);
-        } else {
-            zend_call_method_with_1_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "get", &retval, &key_zv);
-        }
+        zend_call_method_with_1_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "get", &retval, &key_zv);
         zval_ptr_dtor(&key_zv);
-        if (Z_ISUNDEF(retval)) {
-            if (default_val != nullptr) {
-                ZVAL_COPY(return_value, default_val);
-            } else {
-                ZVAL_NULL(return_value);
+        if (Z_ISUNDEF(retval) || Z_TYPE(retval) == IS_NULL) {
+            if (!Z_ISUNDEF(retval)) {
+                zval_ptr_dtor(&retval);
             }
-        } else {
-            ZVAL_COPY_VALUE(return_value, &retval);
+            RETURN_FALSE;
         }
-        return return_value;
+        zval_ptr_dtor(&retval);
+        RETURN_TRUE;
     }
 
-    std::string value;
-    bool found = false;
+    pthread_mutex_lock(&obj->lock);
+    bool found = obj->values.find(std::string(key, key_len)) != obj->values.end();
+    pthread_mutex_unlock(&obj->lock);
+    RETURN_BOOL(found);
+}
+
+PHP_METHOD(KislayPHPConfigClient, remove) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_STRING(key, key_len)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
+    if (obj->has_client) {
+        RETURN_FALSE;
+    }
     pthread_mutex_lock(&obj->lock);
     flat_map_t::iterator it = obj->values.find(std::string(key, key_len));
-    if (it != obj->values.end()) {
-        value = it->second;
-        found = true;
+    bool removed = it != obj->values.end();
+    if (removed) {
+        obj->values.erase(it);
     }
     pthread_mutex_unlock(&obj->lock);
+    RETURN_BOOL(removed);
+}
 
-    if (!found) {
-        if (default_val != nullptr) {
-            ZVAL_COPY(return_value, default_val);
-        } else {
-            ZVAL_NULL(return_value);
+PHP_METHOD(KislayPHPConfigClient, delete) {
+    ZEND_MN(KislayPHPConfigClient_remove)(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+PHP_METHOD(KislayPHPConfigClient, refresh) {
+    RETURN_TRUE;
+}
+
+/* This thread's getter counters, registered on its first getter call. */
+static kislay_runtime_reads_t &kislay_runtime_reads() {
+    if (kislay_runtime_reads_shard == nullptr) {
+        kislay_runtime_reads_t *shard = new kislay_runtime_reads_t();
+        kislay_runtime_guard_t guard;
+        kislay_runtime_stats.reads.emplace_back(shard);
+        kislay_runtime_reads_shard = shard;
+    }
+    return *kislay_runtime_reads_shard;
+}
+
+static inline void kislay_runtime_count_lookup(const char *key, bool hit) {
+    if (hit) {
+        kislay_metric_add(kislay_runtime_reads().get_hits, 1);
+        KISLAY_PROBE1(runtime__get__hit, key);
+    } else {
+        kislay_metric_add(kislay_runtime_reads().get_misses, 1);
+        KISLAY_PROBE1(runtime__get__miss, key);
+    }
+}
+
+/* This request's pinned view, taken under the runtime lock on its first read. */
+static const kislay_runtime_view_t &kislay_request_view() {
+    if (!kislay_request_pin) {
+        kislay_runtime_guard_t guard;
+        kislay_runtime_view_locked();
+        kislay_request_pin = kislay_runtime_view;
+    }
+    return *kislay_request_pin;
+}
+
+/* Value of `key` for this request: its request override, else its pinned view. No lock once pinned. */
+static const std::string *kislay_runtime_find(const char *key, std::size_t key_len) {
+    std::string name(key, key_len);
+    if (!kislay_request_overrides.empty()) {
+        flat_map_t::const_iterator it = kislay_request_overrides.find(name);
+        if (it != kislay_request_overrides.end()) {
+            return &it->second;
         }
-        return return_value;
     }
-    ZVAL_STRING(return_value, value.c_str());
-    return return_value;
+    const flat_map_t &values = kislay_request_view().values;
+    flat_map_t::const_iterator it = values.find(name);
+    return it == values.end() ? nullptr : &it->second;
 }
 
-PHP_METHOD(KislayPHPConfigClient, __construct) {
-    ZEND_PARSE_PARAMETERS_NONE();
+PHP_METHOD(KislayPHPConfigRuntime, boot) {
+    zval *options = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_ARRAY(options)
+    ZEND_PARSE_PARAMETERS_END();
+
+    kislay_runtime_guard_t guard;
+    kislay_runtime_phase_scope_t phases(&kislay_runtime_stats.last_boot);
+    HashTable *ht = Z_ARRVAL_P(options);
+    kislay_hash_find_string(ht, "server", &kislay_runtime_server_url);
+    kislay_hash_find_string(ht, "environment", &kislay_runtime_environment);
+    kislay_hash_find_string(ht, "project", &kislay_runtime_project);
+    kislay_hash_find_string(ht, "service", &kislay_runtime_service);
+    kislay_hash_find_string(ht, "node", &kislay_runtime_node);
+    kislay_hash_find_string(ht, "cache_file", &kislay_runtime_cache_file);
+    kislay_hash_find_string(ht, "local_file", &kislay_runtime_local_file);
+    kislay_hash_find_string(ht, "env_prefix", &kislay_runtime_env_prefix);
+    std::string setting;
+    if (kislay_hash_find_string(ht, "retries", &setting)) {
+        kislay_runtime_retries = std::max(0L, std::strtol(setting.c_str(), nullptr, 10));
+    }
+    if (kislay_hash_find_string(ht, "retry_base_ms", &setting)) {
+        kislay_runtime_retry_base_ms = std::max(1L, std::strtol(setting.c_str(), nullptr, 10));
+    }
+    if (kislay_hash_find_string(ht, "retry_max_ms", &setting)) {
+        kislay_runtime_retry_max_ms = std::max(1L, std::strtol(setting.c_str(), nullptr, 10));
+    }
+
+    std::string error;
+    std::string remote_error;
+    bool fetched = kislay_runtime_fetch_remote_locked(&remote_error);
+    phases.current.source = kislay_runtime_server_url.empty() ? "local" : "remote";
+    if (!fetched && !kislay_runtime_cache_file.empty()) {
+        std::string cache_error;
+        fetched = kislay_runtime_load_cache_locked(&cache_error);
+        phases.current.source = "cache";
+        if (!fetched) {
+            if (!remote_error.empty()) {
+                error = remote_error + "; cache fallback failed: " + cache_error;
+            } else {
+                error = cache_error;
+            }
+        }
+    } else if (!fetched) {
+        error = remote_error;
+    }
+    if (!fetched && !kislay_runtime_server_url.empty()) {
+        if (error.empty()) {
+            error = "Unable to bootstrap config runtime";
+        }
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    if (!kislay_runtime_local_file.empty() && !kislay_runtime_load_local_file_locked(kislay_runtime_local_file, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    kislay_runtime_rebuild_locked();
+    kislay_runtime_compact_locked();
+    kislay_runtime_save_cache_locked();
+    kislay_runtime_booted = true;
+    phases.current.ok = true;
+    RETURN_TRUE;
 }
 
-PHP_METHOD(KislayPHPConfigClient, setClient) {
-    zval *client = nullptr;
+PHP_METHOD(KislayPHPConfigRuntime, loadLocal) {
+    char *path = nullptr;
+    size_t path_len = 0;
     ZEND_PARSE_PARAMETERS_START(1, 1)
-        Z_PARAM_ZVAL(client)
+        Z_PARAM_STRING(path, path_len)
+    ZEND_PARSE_PARAMETERS_END();
+
+    kislay_runtime_guard_t guard;
+    std::string error;
+    if (!kislay_runtime_load_local_file_locked(std::string(path, path_len), &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    kislay_runtime_rebuild_locked();
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPConfigRuntime, refresh) {
+    kislay_runtime_guard_t guard;
+    kislay_runtime_phase_scope_t phases(&kislay_runtime_stats.last_refresh);
+    phases.current.source = kislay_runtime_server_url.empty() ? "local" : "remote";
+    kislay_runtime_stats.refreshes++;
+    std::string error;
+    if (!kislay_runtime_fetch_remote_locked(&error)) {
+        kislay_runtime_stats.refresh_failures++;
+        RETURN_FALSE;
+    }
+    if (!kislay_runtime_local_file.empty()) {
+        kislay_runtime_load_local_file_locked(kislay_runtime_local_file, &error);
+    }
+    /* Compacted here rather than on the next read so last_refresh times it. */
+    kislay_runtime_rebuild_locked();
+    kislay_runtime_compact_locked();
+    kislay_runtime_save_cache_locked();
+    phases.current.ok = true;
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPConfigRuntime, setOverride) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    zval *value = nullptr;
+    ZEND_PARSE_PARAMETERS_START(2, 2)
+        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_ZVAL(value)
     ZEND_PARSE_PARAMETERS_END();
 
-    if (client == nullptr || Z_TYPE_P(client) != IS_OBJECT || !instanceof_function(Z_OBJCE_P(client), kislayphp_config_client_interface_ce)) {
-        zend_throw_exception(zend_ce_exception, "Client must implement Kislay\\Config\\ClientInterface", 0);
-        RETURN_FALSE;
-    }
-
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    if (obj->has_client) {
-        zval_ptr_dtor(&obj->client);
-    }
-    ZVAL_COPY(&obj->client, client);
-    obj->has_client = true;
+    kislay_runtime_guard_t guard;
+    std::string name(key, key_len);
+    std::string text = kislay_string_from_zval(value);
+    kislay_runtime_runtime_overrides[name] = text;
+    kislay_runtime_restack_key_locked(name);
     RETURN_TRUE;
 }
 
-PHP_METHOD(KislayPHPConfigClient, set) {
+PHP_METHOD(KislayPHPConfigRuntime, setRequestOverride) {
     char *key = nullptr;
     size_t key_len = 0;
-    char *value = nullptr;
-    size_t value_len = 0;
+    zval *value = nullptr;
     ZEND_PARSE_PARAMETERS_START(2, 2)
         Z_PARAM_STRING(key, key_len)
-        Z_PARAM_STRING(value, value_len)
+        Z_PARAM_ZVAL(value)
     ZEND_PARSE_PARAMETERS_END();
 
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    if (obj->has_client) {
-        zval key_zv;
-        zval value_zv;
-        zval retval;
-        ZVAL_STRINGL(&key_zv, key, key_len);
-        ZVAL_STRINGL(&value_zv, value, value_len);
-        ZVAL_UNDEF(&retval);
-        zend_call_method_with_2_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "set", &retval, &key_zv, &value_zv);
-        zval_ptr_dtor(&key_zv);
-        zval_ptr_dtor(&value_zv);
-        if (Z_ISUNDEF(retval)) {
-            RETURN_TRUE;
+    kislay_request_overrides[std::string(key, key_len)] = kislay_string_from_zval(value);
+    RETURN_TRUE;
+}
+
+/* Re-resolves the touched override keys and returns the ones whose effective value changed. */
+static void kislay_runtime_restack_keys_locked(const std::vector<std::string> &keys, zval *return_value) {
+    array_init(return_value);
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        if (kislay_runtime_restack_key_locked(keys[i])) {
+            add_next_index_stringl(return_value, keys[i].data(), keys[i].size());
         }
-        RETVAL_ZVAL(&retval, 1, 1);
-        return;
     }
-
-    pthread_mutex_lock(&obj->lock);
-    obj->values[std::string(key, key_len)] = std::string(value, value_len);
-    pthread_mutex_unlock(&obj->lock);
-    RETURN_TRUE;
 }
 
-PHP_METHOD(KislayPHPConfigClient, get) {
-    char *key = nullptr;
-    size_t key_len = 0;
-    zval *default_val = nullptr;
+PHP_METHOD(KislayPHPConfigRuntime, setOverrides) {
+    zval *values = nullptr;
+    zend_bool replace = 0;
     ZEND_PARSE_PARAMETERS_START(1, 2)
-        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_ARRAY(values)
         Z_PARAM_OPTIONAL
-        Z_PARAM_ZVAL(default_val)
+        Z_PARAM_BOOL(replace)
     ZEND_PARSE_PARAMETERS_END();
 
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    zval out;
-    ZVAL_UNDEF(&out);
-    kislayphp_config_client_get_value(obj, key, key_len, default_val, &out);
-    RETVAL_ZVAL(&out, 1, 1);
+    flat_map_t flattened;
+    std::string error;
+    if (!kislay_zval_to_flat_map(values, &flattened, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    kislay_runtime_guard_t guard;
+    kislay_runtime_view_locked();
+    std::vector<std::string> touched;
+    touched.reserve(flattened.size());
+    if (replace) {
+        for (flat_map_t::const_iterator it = kislay_runtime_runtime_overrides.begin(); it != kislay_runtime_runtime_overrides.end(); ++it) {
+            if (flattened.find(it->first) == flattened.end()) {
+                touched.push_back(it->first);
+            }
+        }
+        for (std::size_t i = 0; i < touched.size(); ++i) {
+            kislay_runtime_runtime_overrides.erase(touched[i]);
+        }
+    }
+    for (flat_map_t::iterator it = flattened.begin(); it != flattened.end(); ++it) {
+        touched.push_back(it->first);
+        kislay_runtime_runtime_overrides[it->first].swap(it->second);
+    }
+    kislay_runtime_restack_keys_locked(touched, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigClient, getString) {
-    char *key = nullptr;
-    size_t key_len = 0;
-    zend_string *default_val = nullptr;
-    ZEND_PARSE_PARAMETERS_START(1, 2)
-        Z_PARAM_STRING(key, key_len)
+PHP_METHOD(KislayPHPConfigRuntime, clearOverrides) {
+    zval *keys = nullptr;
+    ZEND_PARSE_PARAMETERS_START(0, 1)
         Z_PARAM_OPTIONAL
-        Z_PARAM_STR_OR_NULL(default_val)
+        Z_PARAM_ARRAY_OR_NULL(keys)
     ZEND_PARSE_PARAMETERS_END();
 
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    zval fallback;
-    zval out;
-    ZVAL_UNDEF(&fallback);
-    ZVAL_UNDEF(&out);
-    zval *fallback_ptr = nullptr;
-    if (default_val != nullptr) {
-        ZVAL_STR_COPY(&fallback, default_val);
-        fallback_ptr = &fallback;
+    std::vector<std::string> prefixes;
+    if (keys != nullptr) {
+        zval *entry = nullptr;
+        ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(keys), entry) {
+            prefixes.push_back(kislay_string_from_zval(entry));
+        } ZEND_HASH_FOREACH_END();
     }
-    kislayphp_config_client_get_value(obj, key, key_len, fallback_ptr, &out);
-    if (Z_TYPE(out) == IS_NULL) {
-        RETVAL_NULL();
-    } else {
-        zend_string *string_value = zval_get_string(&out);
-        RETVAL_STR(string_value);
+    kislay_runtime_guard_t guard;
+    kislay_runtime_view_locked();
+    /* A key clears itself and the dotted keys under it, as setOverrides() would have flattened them. */
+    std::vector<std::string> touched;
+    for (flat_map_t::const_iterator it = kislay_runtime_runtime_overrides.begin(); it != kislay_runtime_runtime_overrides.end(); ++it) {
+        bool match = keys == nullptr;
+        for (std::size_t i = 0; i < prefixes.size() && !match; ++i) {
+            const std::string &prefix = prefixes[i];
+            match = it->first.compare(0, prefix.size(), prefix) == 0
+                && (it->first.size() == prefix.size() || it->first[prefix.size()] == '.');
+        }
+        if (match) {
+            touched.push_back(it->first);
+        }
     }
-    if (!Z_ISUNDEF(out)) {
-        zval_ptr_dtor(&out);
+    for (std::size_t i = 0; i < touched.size(); ++i) {
+        kislay_runtime_runtime_overrides.erase(touched[i]);
     }
-    if (!Z_ISUNDEF(fallback)) {
-        zval_ptr_dtor(&fallback);
+    kislay_runtime_restack_keys_locked(touched, return_value);
+}
+
+/* Return paths shared by the Config and Snapshot getters; `value` is null for a missing key. */
+static void kislay_return_value(const std::string *value, zval *default_val, zval *return_value) {
+    if (value == nullptr) {
+        if (default_val != nullptr) {
+            RETURN_ZVAL(default_val, 1, 0);
+        }
+        RETURN_NULL();
     }
+    RETURN_STRING(value->c_str());
 }
 
-PHP_METHOD(KislayPHPConfigClient, getInt) {
+static void kislay_return_string(const std::string *value, zend_string *default_val, zval *return_value) {
+    if (value == nullptr) {
+        if (default_val != nullptr) {
+            RETURN_STR_COPY(default_val);
+        }
+        RETURN_NULL();
+    }
+    RETURN_STRING(value->c_str());
+}
+
+static void kislay_return_int(const std::string *value, zend_long default_val, zval *return_value) {
+    if (value == nullptr) {
+        RETURN_LONG(default_val);
+    }
+    RETURN_LONG(static_cast<zend_long>(std::strtoll(value->c_str(), nullptr, 10)));
+}
+
+static void kislay_return_bool(const std::string *value, zend_bool default_val, zval *return_value) {
+    if (value == nullptr) {
+        RETURN_BOOL(default_val);
+    }
+    std::string lower = kislay_to_lower(*value);
+    RETURN_BOOL(lower == "1" || lower == "true" || lower == "yes" || lower == "on");
+}
+
+static void kislay_return_array(const std::string *value, zval *default_val, zval *return_value) {
+    if (value == nullptr) {
+        if (default_val != nullptr) {
+            RETURN_ZVAL(default_val, 1, 0);
+        }
+        array_init(return_value);
+        return;
+    }
+    zval decoded;
+    ZVAL_UNDEF(&decoded);
+    if (kislay_json_decode_assoc(*value, &decoded) && Z_TYPE(decoded) == IS_ARRAY) {
+        RETVAL_ZVAL(&decoded, 1, 1);
+        return;
+    }
+    if (!Z_ISUNDEF(decoded)) {
+        zval_ptr_dtor(&decoded);
+    }
+    if (default_val != nullptr) {
+        RETURN_ZVAL(default_val, 1, 0);
+    }
+    array_init(return_value);
+}
+
+PHP_METHOD(KislayPHPConfigRuntime, has) {
     char *key = nullptr;
     size_t key_len = 0;
-    zend_long default_val = 0;
-    ZEND_PARSE_PARAMETERS_START(1, 2)
+    ZEND_PARSE_PARAMETERS_START(1, 1)
         Z_PARAM_STRING(key, key_len)
-        Z_PARAM_OPTIONAL
-        Z_PARAM_LONG(default_val)
     ZEND_PARSE_PARAMETERS_END();
 
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    zval fallback;
-    zval out;
-    ZVAL_LONG(&fallback, default_val);
-    ZVAL_UNDEF(&out);
-    kislayphp_config_client_get_value(obj, key, key_len, &fallback, &out);
-    convert_to_long(&out);
-    RETVAL_LONG(Z_LVAL(out));
-    zval_ptr_dtor(&out);
+    kislay_metric_add(kislay_runtime_reads().calls_has, 1);
+    bool found = kislay_runtime_find(key, key_len) != nullptr;
+    if (found) {
+        kislay_metric_add(kislay_runtime_reads().has_hits, 1);
+    } else {
+        kislay_metric_add(kislay_runtime_reads().has_misses, 1);
+    }
+    RETURN_BOOL(found);
 }
 
-PHP_METHOD(KislayPHPConfigClient, getBool) {
+PHP_METHOD(KislayPHPConfigRuntime, get) {
     char *key = nullptr;
     size_t key_len = 0;
-    zend_bool default_val = 0;
+    zval *default_val = nullptr;
     ZEND_PARSE_PARAMETERS_START(1, 2)
         Z_PARAM_STRING(key, key_len)
         Z_PARAM_OPTIONAL
-        Z_PARAM_BOOL(default_val)
+        Z_PARAM_ZVAL(default_val)
     ZEND_PARSE_PARAMETERS_END();
 
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    zval fallback;
-    zval out;
-    ZVAL_BOOL(&fallback, default_val);
-    ZVAL_UNDEF(&out);
-    kislayphp_config_client_get_value(obj, key, key_len, &fallback, &out);
-    if (Z_TYPE(out) == IS_STRING) {
-        std::string lower = kislay_to_lower(std::string(Z_STRVAL(out), Z_STRLEN(out)));
-        RETVAL_BOOL(lower == "1" || lower == "true" || lower == "yes" || lower == "on");
-    } else {
-        convert_to_boolean(&out);
-        RETVAL_BOOL(Z_TYPE(out) == IS_TRUE);
-    }
-    zval_ptr_dtor(&out);
+    kislay_metric_add(kislay_runtime_reads().calls_get, 1);
+    const std::string *value = kislay_runtime_find(key, key_len);
+    kislay_runtime_count_lookup(key, value != nullptr);
+    kislay_return_value(value, default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigClient, getArray) {
+PHP_METHOD(KislayPHPConfigRuntime, getString) {
     char *key = nullptr;
     size_t key_len = 0;
-    zval *default_val = nullptr;
+    zend_string *default_val = nullptr;
     ZEND_PARSE_PARAMETERS_START(1, 2)
         Z_PARAM_STRING(key, key_len)
         Z_PARAM_OPTIONAL
-        Z_PARAM_ARRAY_EX(default_val, 1, 0)
+        Z_PARAM_STR_OR_NULL(default_val)
     ZEND_PARSE_PARAMETERS_END();
 
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    zval out;
-    ZVAL_UNDEF(&out);
-    kislayphp_config_client_get_value(obj, key, key_len, default_val, &out);
-    if (Z_TYPE(out) == IS_ARRAY) {
-        RETVAL_ZVAL(&out, 1, 1);
-        zval_ptr_dtor(&out);
-        return;
-    }
-    if (Z_TYPE(out) == IS_STRING) {
-        zval decoded;
-        ZVAL_UNDEF(&decoded);
-        if (kislay_json_decode_assoc(std::string(Z_STRVAL(out), Z_STRLEN(out)), &decoded) && Z_TYPE(decoded) == IS_ARRAY) {
-            RETVAL_ZVAL(&decoded, 1, 1);
-            zval_ptr_dtor(&out);
-            return;
-        }
-        if (!Z_ISUNDEF(decoded)) {
-            zval_ptr_dtor(&decoded);
-        }
-    }
-    if (default_val != nullptr) {
-        RETVAL_ZVAL(default_val, 1, 0);
-    } else {
-        array_init(return_value);
-    }
-    zval_ptr_dtor(&out);
-}
-
-PHP_METHOD(KislayPHPConfigClient, all) {
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    if (obj->has_client) {
-        zval retval;
-        ZVAL_UNDEF(&retval);
-        zend_call_method_with_0_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "all", &retval);
-        if (Z_ISUNDEF(retval)) {
-            array_init(return_value);
-            return;
-        }
-        RETVAL_ZVAL(&retval, 1, 1);
-        return;
-    }
-    array_init(return_value);
-    pthread_mutex_lock(&obj->lock);
-    for (flat_map_t::const_iterator it = obj->values.begin(); it != obj->values.end(); ++it) {
-        add_assoc_string(return_value, it->first.c_str(), const_cast<char *>(it->second.c_str()));
-    }
-    pthread_mutex_unlock(&obj->lock);
+    kislay_metric_add(kislay_runtime_reads().calls_get_string, 1);
+    const std::string *value = kislay_runtime_find(key, key_len);
+    kislay_runtime_count_lookup(key, value != nullptr);
+    kislay_return_string(value, default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigClient, has) {
+PHP_METHOD(KislayPHPConfigRuntime, getInt) {
     char *key = nullptr;
     size_t key_len = 0;
-    ZEND_PARSE_PARAMETERS_START(1, 1)
+    zend_long default_val = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
         Z_PARAM_STRING(key, key_len)
-    ZEND_PARSE_PARAMETERS_END();
-
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    if (obj->has_client) {
-        zval key_zv;
-        zval retval;
-        ZVAL_STRINGL(&key_zv, key, key_len);
-        ZVAL_UNDEF(&retval);
-        zend_call_method_with_1_params(Z_OBJ(obj->client), Z_OBJCE(obj->client), nullptr, "get", &retval, &key_zv);
-        zval_ptr_dtor(&key_zv);
-        if (Z_ISUNDEF(retval) || Z_TYPE(retval) == IS_NULL) {
-            if (!Z_ISUNDEF(retval)) {
-                zval_ptr_dtor(&retval);
-            }
-            RETURN_FALSE;
-        }
-        zval_ptr_dtor(&retval);
-        RETURN_TRUE;
-    }
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(default_val)
+    ZEND_PARSE_PARAMETERS_END();
 
-    pthread_mutex_lock(&obj->lock);
-    bool found = obj->values.find(std::string(key, key_len)) != obj->values.end();
-    pthread_mutex_unlock(&obj->lock);
-    RETURN_BOOL(found);
+    kislay_metric_add(kislay_runtime_reads().calls_get_int, 1);
+    const std::string *value = kislay_runtime_find(key, key_len);
+    kislay_runtime_count_lookup(key, value != nullptr);
+    kislay_return_int(value, default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigClient, remove) {
+PHP_METHOD(KislayPHPConfigRuntime, getBool) {
     char *key = nullptr;
     size_t key_len = 0;
-    ZEND_PARSE_PARAMETERS_START(1, 1)
+    zend_bool default_val = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
         Z_PARAM_STRING(key, key_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_BOOL(default_val)
     ZEND_PARSE_PARAMETERS_END();
 
-    php_kislayphp_config_client_t *obj = php_kislayphp_config_client_from_obj(Z_OBJ_P(getThis()));
-    if (obj->has_client) {
-        RETURN_FALSE;
-    }
-    pthread_mutex_lock(&obj->lock);
-    flat_map_t::iterator it = obj->values.find(std::string(key, key_len));
-    bool removed = it != obj->values.end();
-    if (removed) {
-        obj->values.erase(it);
-    }
-    pthread_mutex_unlock(&obj->lock);
-    RETURN_BOOL(removed);
+    kislay_metric_add(kislay_runtime_reads().calls_get_bool, 1);
+    const std::string *value = kislay_runtime_find(key, key_len);
+    kislay_runtime_count_lookup(key, value != nullptr);
+    kislay_return_bool(value, default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigClient, delete) {
-    ZEND_MN(KislayPHPConfigClient_remove)(INTERNAL_FUNCTION_PARAM_PASSTHRU);
-}
+PHP_METHOD(KislayPHPConfigRuntime, getArray) {
+    char *key = nullptr;
+    size_t key_len = 0;
+    zval *default_val = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 2)
+        Z_PARAM_STRING(key, key_len)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_EX(default_val, 1, 0)
+    ZEND_PARSE_PARAMETERS_END();
 
-PHP_METHOD(KislayPHPConfigClient, refresh) {
-    RETURN_TRUE;
+    kislay_metric_add(kislay_runtime_reads().calls_get_array, 1);
+    const std::string *value = kislay_runtime_find(key, key_len);
+    kislay_runtime_count_lookup(key, value != nullptr);
+    kislay_return_array(value, default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, boot) {
-    zval *options = nullptr;
-    ZEND_PARSE_PARAMETERS_START(1, 1)
-        Z_PARAM_ARRAY(options)
-    ZEND_PARSE_PARAMETERS_END();
+PHP_METHOD(KislayPHPConfigRuntime, all) {
+    kislay_metric_add(kislay_runtime_reads().calls_all, 1);
+    const kislay_runtime_view_t &view = kislay_request_view();
+    if (kislay_request_overrides.empty()) {
+        kislay_flat_map_to_array(view.values, return_value);
+        return;
+    }
+    flat_map_t merged(view.values);
+    kislay_merge_flat_map(&merged, kislay_request_overrides);
+    kislay_flat_map_to_array(merged, return_value);
+}
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    HashTable *ht = Z_ARRVAL_P(options);
-    kislay_hash_find_string(ht, "server", &kislay_runtime_server_url);
-    kislay_hash_find_string(ht, "environment", &kislay_runtime_environment);
-    kislay_hash_find_string(ht, "project", &kislay_runtime_project);
-    kislay_hash_find_string(ht, "service", &kislay_runtime_service);
-    kislay_hash_find_string(ht, "node", &kislay_runtime_node);
-    kislay_hash_find_string(ht, "cache_file", &kislay_runtime_cache_file);
-    kislay_hash_find_string(ht, "local_file", &kislay_runtime_local_file);
-    kislay_hash_find_string(ht, "env_prefix", &kislay_runtime_env_prefix);
+PHP_METHOD(KislayPHPConfigRuntime, version) {
+    RETURN_STRING(kislay_request_view().version.c_str());
+}
 
-    std::string error;
-    std::string remote_error;
-    bool fetched = kislay_runtime_fetch_remote_locked(&remote_error);
-    if (!fetched && !kislay_runtime_cache_file.empty()) {
-        std::string cache_error;
-        fetched = kislay_runtime_load_cache_locked(&cache_error);
-        if (!fetched) {
-            if (!remote_error.empty()) {
-                error = remote_error + "; cache fallback failed: " + cache_error;
-            } else {
-                error = cache_error;
-            }
-        }
-    } else if (!fetched) {
-        error = remote_error;
-    }
-    if (!fetched && !kislay_runtime_server_url.empty()) {
-        if (error.empty()) {
-            error = "Unable to bootstrap config runtime";
+/* Request overrides swap their keys' entries in the view's sum. */
+static std::uint64_t kislay_request_checksum_sum(const kislay_runtime_view_t &view) {
+    std::uint64_t sum = view.checksum_sum;
+    for (flat_map_t::const_iterator it = kislay_request_overrides.begin(); it != kislay_request_overrides.end(); ++it) {
+        flat_map_t::const_iterator shared = view.values.find(it->first);
+        if (shared != view.values.end()) {
+            sum -= kislay_entry_hash(shared->first, shared->second);
         }
-        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
-        RETURN_FALSE;
+        sum += kislay_entry_hash(it->first, it->second);
     }
-    if (!kislay_runtime_local_file.empty() && !kislay_runtime_load_local_file_locked(kislay_runtime_local_file, &error)) {
-        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
-        RETURN_FALSE;
+    return sum;
+}
+
+PHP_METHOD(KislayPHPConfigRuntime, checksum) {
+    const kislay_runtime_view_t &view = kislay_request_view();
+    if (kislay_request_overrides.empty()) {
+        RETURN_STRING(view.checksum.c_str());
     }
-    kislay_runtime_rebuild_locked();
-    kislay_runtime_save_cache_locked();
-    kislay_runtime_booted = true;
-    RETURN_TRUE;
+    RETURN_STRING(kislay_checksum_hex(kislay_request_checksum_sum(view)).c_str());
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, loadLocal) {
-    char *path = nullptr;
-    size_t path_len = 0;
-    ZEND_PARSE_PARAMETERS_START(1, 1)
-        Z_PARAM_STRING(path, path_len)
-    ZEND_PARSE_PARAMETERS_END();
+/*
+ * Captures the current view, not this request's pin, so long-running workers
+ * can take a fresh one per job. Request overrides are folded into a private
+ * copy.
+ */
+PHP_METHOD(KislayPHPConfigRuntime, snapshot) {
+    ZEND_PARSE_PARAMETERS_NONE();
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    std::string error;
-    if (!kislay_runtime_load_local_file_locked(std::string(path, path_len), &error)) {
-        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
-        RETURN_FALSE;
-    }
-    kislay_runtime_rebuild_locked();
-    RETURN_TRUE;
+    kislay_view_ptr_t view;
+    {
+        kislay_runtime_guard_t guard;
+        kislay_runtime_view_locked();
+        view = kislay_runtime_view;
+    }
+    if (!kislay_request_overrides.empty()) {
+        std::shared_ptr<kislay_runtime_view_t> merged = std::make_shared<kislay_runtime_view_t>(*view);
+        merged->checksum_sum = kislay_request_checksum_sum(*view);
+        merged->checksum = kislay_checksum_hex(merged->checksum_sum);
+        kislay_merge_flat_map(&merged->values, kislay_request_overrides);
+        view = merged;
+    }
+    object_init_ex(return_value, kislayphp_config_snapshot_ce);
+    php_kislayphp_config_snapshot_from_obj(Z_OBJ_P(return_value))->view = view;
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, refresh) {
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    std::string error;
-    if (!kislay_runtime_fetch_remote_locked(&error)) {
-        RETURN_FALSE;
-    }
-    if (!kislay_runtime_local_file.empty()) {
-        kislay_runtime_load_local_file_locked(kislay_runtime_local_file, &error);
-    }
-    kislay_runtime_rebuild_locked();
-    kislay_runtime_save_cache_locked();
-    RETURN_TRUE;
+/* The snapshot's view; only Config::snapshot() creates these objects, so the fallback is never expected. */
+static const kislay_runtime_view_t &kislay_snapshot_view(zval *self) {
+    static const kislay_runtime_view_t empty;
+    const kislay_view_ptr_t &view = php_kislayphp_config_snapshot_from_obj(Z_OBJ_P(self))->view;
+    return view ? *view : empty;
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, setOverride) {
-    char *key = nullptr;
-    size_t key_len = 0;
-    zval *value = nullptr;
-    ZEND_PARSE_PARAMETERS_START(2, 2)
-        Z_PARAM_STRING(key, key_len)
-        Z_PARAM_ZVAL(value)
-    ZEND_PARSE_PARAMETERS_END();
+static const std::string *kislay_snapshot_find(zval *self, const char *key, std::size_t key_len) {
+    const flat_map_t &values = kislay_snapshot_view(self).values;
+    flat_map_t::const_iterator it = values.find(std::string(key, key_len));
+    return it == values.end() ? nullptr : &it->second;
+}
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    kislay_runtime_runtime_overrides[std::string(key, key_len)] = kislay_string_from_zval(value);
-    kislay_runtime_rebuild_locked();
-    RETURN_TRUE;
+PHP_METHOD(KislayPHPConfigSnapshot, __construct) {
+    ZEND_PARSE_PARAMETERS_NONE();
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, has) {
+PHP_METHOD(KislayPHPConfigSnapshot, has) {
     char *key = nullptr;
     size_t key_len = 0;
     ZEND_PARSE_PARAMETERS_START(1, 1)
         Z_PARAM_STRING(key, key_len)
     ZEND_PARSE_PARAMETERS_END();
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    RETURN_BOOL(kislay_runtime_active_snapshot.find(std::string(key, key_len)) != kislay_runtime_active_snapshot.end());
+    RETURN_BOOL(kislay_snapshot_find(getThis(), key, key_len) != nullptr);
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, get) {
+PHP_METHOD(KislayPHPConfigSnapshot, get) {
     char *key = nullptr;
     size_t key_len = 0;
     zval *default_val = nullptr;
@@ -1490,18 +6065,10 @@ PHP_METHOD(KislayPHPConfigRuntime, get) {
         Z_PARAM_ZVAL(default_val)
     ZEND_PARSE_PARAMETERS_END();
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    flat_map_t::iterator it = kislay_runtime_active_snapshot.find(std::string(key, key_len));
-    if (it == kislay_runtime_active_snapshot.end()) {
-        if (default_val != nullptr) {
-            RETURN_ZVAL(default_val, 1, 0);
-        }
-        RETURN_NULL();
-    }
-    RETURN_STRING(it->second.c_str());
+    kislay_return_value(kislay_snapshot_find(getThis(), key, key_len), default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, getString) {
+PHP_METHOD(KislayPHPConfigSnapshot, getString) {
     char *key = nullptr;
     size_t key_len = 0;
     zend_string *default_val = nullptr;
@@ -1511,18 +6078,10 @@ PHP_METHOD(KislayPHPConfigRuntime, getString) {
         Z_PARAM_STR_OR_NULL(default_val)
     ZEND_PARSE_PARAMETERS_END();
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    flat_map_t::iterator it = kislay_runtime_active_snapshot.find(std::string(key, key_len));
-    if (it == kislay_runtime_active_snapshot.end()) {
-        if (default_val != nullptr) {
-            RETURN_STR_COPY(default_val);
-        }
-        RETURN_NULL();
-    }
-    RETURN_STRING(it->second.c_str());
+    kislay_return_string(kislay_snapshot_find(getThis(), key, key_len), default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, getInt) {
+PHP_METHOD(KislayPHPConfigSnapshot, getInt) {
     char *key = nullptr;
     size_t key_len = 0;
     zend_long default_val = 0;
@@ -1532,15 +6091,10 @@ PHP_METHOD(KislayPHPConfigRuntime, getInt) {
         Z_PARAM_LONG(default_val)
     ZEND_PARSE_PARAMETERS_END();
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    flat_map_t::iterator it = kislay_runtime_active_snapshot.find(std::string(key, key_len));
-    if (it == kislay_runtime_active_snapshot.end()) {
-        RETURN_LONG(default_val);
-    }
-    RETURN_LONG(static_cast<zend_long>(std::strtoll(it->second.c_str(), nullptr, 10)));
+    kislay_return_int(kislay_snapshot_find(getThis(), key, key_len), default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, getBool) {
+PHP_METHOD(KislayPHPConfigSnapshot, getBool) {
     char *key = nullptr;
     size_t key_len = 0;
     zend_bool default_val = 0;
@@ -1550,16 +6104,10 @@ PHP_METHOD(KislayPHPConfigRuntime, getBool) {
         Z_PARAM_BOOL(default_val)
     ZEND_PARSE_PARAMETERS_END();
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    flat_map_t::iterator it = kislay_runtime_active_snapshot.find(std::string(key, key_len));
-    if (it == kislay_runtime_active_snapshot.end()) {
-        RETURN_BOOL(default_val);
-    }
-    std::string lower = kislay_to_lower(it->second);
-    RETURN_BOOL(lower == "1" || lower == "true" || lower == "yes" || lower == "on");
+    kislay_return_bool(kislay_snapshot_find(getThis(), key, key_len), default_val, return_value);
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, getArray) {
+PHP_METHOD(KislayPHPConfigSnapshot, getArray) {
     char *key = nullptr;
     size_t key_len = 0;
     zval *default_val = nullptr;
@@ -1569,43 +6117,230 @@ PHP_METHOD(KislayPHPConfigRuntime, getArray) {
         Z_PARAM_ARRAY_EX(default_val, 1, 0)
     ZEND_PARSE_PARAMETERS_END();
 
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    flat_map_t::iterator it = kislay_runtime_active_snapshot.find(std::string(key, key_len));
-    if (it == kislay_runtime_active_snapshot.end()) {
-        if (default_val != nullptr) {
-            RETURN_ZVAL(default_val, 1, 0);
-        }
-        array_init(return_value);
+    kislay_return_array(kislay_snapshot_find(getThis(), key, key_len), default_val, return_value);
+}
+
+PHP_METHOD(KislayPHPConfigSnapshot, all) {
+    ZEND_PARSE_PARAMETERS_NONE();
+    kislay_flat_map_to_array(kislay_snapshot_view(getThis()).values, return_value);
+}
+
+PHP_METHOD(KislayPHPConfigSnapshot, version) {
+    ZEND_PARSE_PARAMETERS_NONE();
+    RETURN_STRING(kislay_snapshot_view(getThis()).version.c_str());
+}
+
+PHP_METHOD(KislayPHPConfigSnapshot, checksum) {
+    ZEND_PARSE_PARAMETERS_NONE();
+    RETURN_STRING(kislay_snapshot_view(getThis()).checksum.c_str());
+}
+
+static void kislay_runtime_phases_to_array(const kislay_runtime_phases_t &phases, zval *out) {
+    array_init(out);
+    if (!phases.recorded) {
         return;
     }
-    zval decoded;
-    ZVAL_UNDEF(&decoded);
-    if (kislay_json_decode_assoc(it->second, &decoded) && Z_TYPE(decoded) == IS_ARRAY) {
-        RETVAL_ZVAL(&decoded, 1, 1);
-        return;
+    add_assoc_bool(out, "ok", phases.ok);
+    add_assoc_string(out, "source", const_cast<char *>(phases.source.c_str()));
+    add_assoc_long(out, "attempts", static_cast<zend_long>(phases.attempts));
+    add_assoc_double(out, "dns_ms", phases.dns_ms);
+    add_assoc_double(out, "connect_ms", phases.connect_ms);
+    add_assoc_double(out, "send_ms", phases.send_ms);
+    add_assoc_double(out, "first_byte_ms", phases.first_byte_ms);
+    add_assoc_double(out, "body_ms", phases.body_ms);
+    add_assoc_double(out, "backoff_ms", phases.backoff_ms);
+    add_assoc_double(out, "parse_ms", phases.parse_ms);
+    add_assoc_double(out, "flatten_ms", phases.flatten_ms);
+    add_assoc_double(out, "rebuild_ms", phases.rebuild_ms);
+    add_assoc_double(out, "checksum_ms", phases.checksum_ms);
+    add_assoc_double(out, "cache_write_ms", phases.cache_write_ms);
+    add_assoc_double(out, "total_ms", phases.total_ms);
+}
+
+/* Shared by Config::stats() and phpinfo(). */
+static void kislay_runtime_stats_to_array(zval *out) {
+    kislay_runtime_guard_t guard;
+    const kislay_runtime_stats_t &stats = kislay_runtime_stats;
+    const flat_map_t &view = kislay_runtime_view_locked().values;
+    std::size_t bytes = 0;
+    for (flat_map_t::const_iterator it = view.begin(); it != view.end(); ++it) {
+        bytes += it->first.size() + it->second.size();
+    }
+
+    array_init(out);
+    add_assoc_bool(out, "booted", kislay_runtime_booted);
+    add_assoc_string(out, "version", const_cast<char *>(kislay_runtime_version.c_str()));
+    add_assoc_long(out, "snapshot_keys", static_cast<zend_long>(view.size()));
+    add_assoc_long(out, "request_overrides", static_cast<zend_long>(kislay_request_overrides.size()));
+    add_assoc_long(out, "view_copies", static_cast<zend_long>(stats.view_copies));
+    add_assoc_long(out, "snapshot_bytes", static_cast<zend_long>(bytes));
+    std::uint64_t reads[11] = {0};
+    for (std::size_t i = 0; i < stats.reads.size(); ++i) {
+        const kislay_runtime_reads_t &shard = *stats.reads[i];
+        const std::atomic<std::uint64_t> *counters[11] = {&shard.get_hits, &shard.get_misses, &shard.has_hits, &shard.has_misses,
+            &shard.calls_get, &shard.calls_get_string, &shard.calls_get_int, &shard.calls_get_bool, &shard.calls_get_array,
+            &shard.calls_has, &shard.calls_all};
+        for (std::size_t c = 0; c < 11; ++c) {
+            reads[c] += counters[c]->load(std::memory_order_relaxed);
+        }
     }
-    if (!Z_ISUNDEF(decoded)) {
-        zval_ptr_dtor(&decoded);
+    add_assoc_long(out, "get_hits", static_cast<zend_long>(reads[0]));
+    add_assoc_long(out, "get_misses", static_cast<zend_long>(reads[1]));
+    add_assoc_long(out, "has_hits", static_cast<zend_long>(reads[2]));
+    add_assoc_long(out, "has_misses", static_cast<zend_long>(reads[3]));
+
+    zval calls;
+    array_init(&calls);
+    add_assoc_long(&calls, "get", static_cast<zend_long>(reads[4]));
+    add_assoc_long(&calls, "getString", static_cast<zend_long>(reads[5]));
+    add_assoc_long(&calls, "getInt", static_cast<zend_long>(reads[6]));
+    add_assoc_long(&calls, "getBool", static_cast<zend_long>(reads[7]));
+    add_assoc_long(&calls, "getArray", static_cast<zend_long>(reads[8]));
+    add_assoc_long(&calls, "has", static_cast<zend_long>(reads[9]));
+    add_assoc_long(&calls, "all", static_cast<zend_long>(reads[10]));
+    add_assoc_zval(out, "calls", &calls);
+
+    add_assoc_long(out, "lock_acquisitions", static_cast<zend_long>(stats.lock_acquisitions));
+    add_assoc_long(out, "lock_contended", static_cast<zend_long>(stats.lock_contended));
+    add_assoc_double(out, "lock_wait_ms", static_cast<double>(stats.lock_wait_ns) / 1e6);
+    add_assoc_long(out, "rebuilds", static_cast<zend_long>(stats.rebuilds));
+    add_assoc_long(out, "refreshes", static_cast<zend_long>(stats.refreshes));
+    add_assoc_long(out, "refresh_failures", static_cast<zend_long>(stats.refresh_failures));
+    add_assoc_long(out, "diff_syncs", static_cast<zend_long>(stats.diff_syncs));
+    add_assoc_long(out, "diff_fallbacks", static_cast<zend_long>(stats.diff_fallbacks));
+    add_assoc_long(out, "diff_keys", static_cast<zend_long>(stats.diff_keys));
+
+    zval phases;
+    kislay_runtime_phases_to_array(stats.last_boot, &phases);
+    add_assoc_zval(out, "last_boot", &phases);
+    kislay_runtime_phases_to_array(stats.last_refresh, &phases);
+    add_assoc_zval(out, "last_refresh", &phases);
+}
+
+PHP_METHOD(KislayPHPConfigRuntime, stats) {
+    ZEND_PARSE_PARAMETERS_NONE();
+    kislay_runtime_stats_to_array(return_value);
+}
+
+static bool kislay_server_load_file(php_kislayphp_config_server_t *obj, const std::string &path) {
+    std::string body;
+    if (!kislay_read_text_file(path, &body)) {
+        return false;
     }
-    if (default_val != nullptr) {
-        RETURN_ZVAL(default_val, 1, 0);
+    kislay_json_value_t root;
+    if (!kislay_json_parse(body, &root) || root.kind != kislay_json_value_t::JSON_OBJECT) {
+        return false;
     }
-    array_init(return_value);
+    kislay_scoped_pthread_lock_t guard(&obj->lock);
+    kislay_server_load_state_locked(obj, root);
+    kislay_server_reset_change_log_locked(obj);
+    return true;
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, all) {
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    kislay_flat_map_to_array(kislay_runtime_active_snapshot, return_value);
+/*
+ * Replays the records of one journal file newer than the loaded state. A torn
+ * tail (crash mid-append) is cut off so the next append starts on a clean
+ * line. Returns whether any record was applied.
+ */
+static bool kislay_server_replay_journal(php_kislayphp_config_server_t *obj, const std::string &path) {
+    kislay_server_persistence_t &persistence = obj->persistence;
+    std::string body;
+    if (!kislay_read_text_file(path, &body)) {
+        return false;
+    }
+    std::size_t offset = 0;
+    std::uint64_t records = 0;
+    bool applied = false;
+    pthread_mutex_lock(&obj->lock);
+    while (offset < body.size()) {
+        std::size_t newline = body.find('\n', offset);
+        if (newline == std::string::npos) {
+            break;
+        }
+        kislay_json_value_t record;
+        std::uint64_t revision = 0;
+        std::vector<kislay_scope_op_t> ops;
+        if (!kislay_json_parse(body.data() + offset, newline - offset, &record) || !kislay_json_to_record(record, &revision, &ops)) {
+            break;
+        }
+        std::string error;
+        if (revision > obj->revision && kislay_server_commit_locked(obj, revision, ops, nullptr, &error)) {
+            applied = true;
+        }
+        offset = newline + 1;
+        records++;
+    }
+    pthread_mutex_unlock(&obj->lock);
+    if (offset < body.size()) {
+        if (truncate(path.c_str(), static_cast<off_t>(offset)) != 0) {
+            persistence.last_checkpoint_error = std::string("journal truncate failed: ") + std::strerror(errno);
+        }
+    }
+    persistence.journal_bytes = offset;
+    persistence.journal_records = records;
+    return applied;
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, version) {
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    RETURN_STRING(kislay_runtime_version.c_str());
+/* Restores checkpoint + journal and starts the checkpoint thread; false after throwing. */
+static bool kislay_server_open_journal(php_kislayphp_config_server_t *obj, HashTable *options) {
+    kislay_server_persistence_t &persistence = obj->persistence;
+    if (!kislay_hash_find_string(options, "journal", &persistence.journal_file) || persistence.journal_file.empty()) {
+        return true;
+    }
+    if (!kislay_hash_find_string(options, "checkpoint", &persistence.checkpoint_file) || persistence.checkpoint_file.empty()) {
+        persistence.checkpoint_file = persistence.journal_file + ".checkpoint";
+    }
+    std::string threshold;
+    if (kislay_hash_find_string(options, "checkpoint_bytes", &threshold)) {
+        persistence.checkpoint_bytes = std::strtoull(threshold.c_str(), nullptr, 10);
+    }
+    if (kislay_hash_find_string(options, "checkpoint_records", &threshold)) {
+        persistence.checkpoint_records = std::strtoull(threshold.c_str(), nullptr, 10);
+    }
+
+    if (access(persistence.checkpoint_file.c_str(), F_OK) == 0 && !kislay_server_load_file(obj, persistence.checkpoint_file)) {
+        zend_throw_exception(zend_ce_exception, "Unable to load config checkpoint", 0);
+        return false;
+    }
+    kislay_server_replay_journal(obj, persistence.journal_file);
+    /* A compaction that stopped before its rename left the newest records in journal.next. */
+    const std::string next_file = persistence.journal_file + ".next";
+    if (access(next_file.c_str(), F_OK) == 0) {
+        std::uint64_t bytes = persistence.journal_bytes;
+        std::uint64_t records = persistence.journal_records;
+        if (kislay_server_replay_journal(obj, next_file)) {
+            rename(next_file.c_str(), persistence.journal_file.c_str());
+        } else {
+            unlink(next_file.c_str());
+            persistence.journal_bytes = bytes;
+            persistence.journal_records = records;
+        }
+    }
+
+    persistence.journal_fd = open(persistence.journal_file.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (persistence.journal_fd < 0) {
+        zend_throw_exception(zend_ce_exception, "Unable to open config journal", 0);
+        return false;
+    }
+    if (pthread_create(&persistence.thread, nullptr, kislay_server_checkpoint_main, obj) == 0) {
+        persistence.thread_started = true;
+    }
+    return true;
 }
 
-PHP_METHOD(KislayPHPConfigRuntime, checksum) {
-    kislay_scoped_pthread_lock_t guard(&kislay_runtime_lock);
-    RETURN_STRING(kislay_runtime_checksum.c_str());
+/* Followers only take writes from their leader, and agents take none; false after throwing. */
+static bool kislay_server_check_writable(php_kislayphp_config_server_t *obj) {
+    if (kislay_server_is_agent(obj)) {
+        std::string message = "Server is a caching agent of " + obj->agent.upstream_url;
+        zend_throw_exception(zend_ce_exception, message.c_str(), 0);
+        return false;
+    }
+    if (!kislay_server_is_follower(obj)) {
+        return true;
+    }
+    std::string message = "Server is a read-only follower of " + obj->replication.leader_url;
+    zend_throw_exception(zend_ce_exception, message.c_str(), 0);
+    return false;
 }
 
 PHP_METHOD(KislayPHPConfigServer, __construct) {
@@ -1616,15 +6351,98 @@ PHP_METHOD(KislayPHPConfigServer, __construct) {
     ZEND_PARSE_PARAMETERS_END();
 
     php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
-    if (options != nullptr) {
-        std::string host;
-        std::string port;
-        if (kislay_hash_find_string(Z_ARRVAL_P(options), "host", &host)) {
-            obj->host = host;
+    if (options == nullptr) {
+        return;
+    }
+    std::string host;
+    std::string port;
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "host", &host)) {
+        obj->host = host;
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "port", &port)) {
+        obj->port = std::strtol(port.c_str(), nullptr, 10);
+    }
+    std::string socket_mode;
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "socket_mode", &socket_mode)) {
+        obj->socket_mode = static_cast<int>(std::strtol(socket_mode.c_str(), nullptr, 8));
+    }
+
+    kislay_server_replication_t &replication = obj->replication;
+    std::string setting;
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "http_threads", &setting)) {
+        obj->connections.size = static_cast<std::size_t>(std::max(1L, std::strtol(setting.c_str(), nullptr, 10)));
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "max_pending", &setting)) {
+        obj->connections.max_pending = static_cast<std::size_t>(std::max(1L, std::strtol(setting.c_str(), nullptr, 10)));
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "retry_after", &setting)) {
+        obj->connections.retry_after_sec = std::max(1L, std::strtol(setting.c_str(), nullptr, 10));
+    }
+    static const struct {
+        const char *option;
+        kislay_endpoint_t endpoint;
+    } limit_options[] = {
+        {"max_concurrent_resolves", KISLAY_ENDPOINT_RESOLVE},
+        {"max_concurrent_resolve_batches", KISLAY_ENDPOINT_RESOLVE_BATCH},
+        {"max_concurrent_writes", KISLAY_ENDPOINT_WRITE},
+        {"max_concurrent_replication", KISLAY_ENDPOINT_REPLICATION},
+    };
+    for (std::size_t i = 0; i < sizeof(limit_options) / sizeof(limit_options[0]); ++i) {
+        if (kislay_hash_find_string(Z_ARRVAL_P(options), limit_options[i].option, &setting)) {
+            obj->connections.endpoints[limit_options[i].endpoint].limit = static_cast<std::size_t>(std::max(0L, std::strtol(setting.c_str(), nullptr, 10)));
+        }
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "resolve_cache_bytes", &setting)) {
+        obj->coalescer.cache_limit = static_cast<std::size_t>(std::strtoull(setting.c_str(), nullptr, 10));
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "max_resident_bytes", &setting)) {
+        obj->tier.max_resident_bytes = static_cast<std::size_t>(std::strtoull(setting.c_str(), nullptr, 10));
+    }
+    kislay_hash_find_string(Z_ARRVAL_P(options), "node_segment_dir", &obj->tier.segment_dir);
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "resolve_threads", &setting)) {
+        obj->workers.size = static_cast<std::size_t>(std::max(1L, std::strtol(setting.c_str(), nullptr, 10)));
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "replication_log", &setting)) {
+        replication.log_limit = static_cast<std::size_t>(std::strtoull(setting.c_str(), nullptr, 10));
+    }
+    if (!kislay_server_open_journal(obj, Z_ARRVAL_P(options))) {
+        return;
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "replication_interval_ms", &setting)) {
+        replication.interval_ms = std::max(10L, std::strtol(setting.c_str(), nullptr, 10));
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "leader", &replication.leader_url) && !replication.leader_url.empty()) {
+        while (!replication.leader_url.empty() && replication.leader_url[replication.leader_url.size() - 1] == '/') {
+            replication.leader_url.erase(replication.leader_url.size() - 1);
+        }
+        if (pthread_create(&replication.thread, nullptr, kislay_server_follower_main, obj) != 0) {
+            zend_throw_exception(zend_ce_exception, "Unable to start replication thread", 0);
+            return;
+        }
+        replication.thread_started = true;
+    }
+
+    kislay_server_agent_t &agent = obj->agent;
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "upstream_interval_ms", &setting)) {
+        agent.interval_ms = std::max(10L, std::strtol(setting.c_str(), nullptr, 10));
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "upstream_idle_sec", &setting)) {
+        agent.idle_sec = std::max(1L, std::strtol(setting.c_str(), nullptr, 10));
+    }
+    if (kislay_hash_find_string(Z_ARRVAL_P(options), "upstream", &agent.upstream_url) && !agent.upstream_url.empty()) {
+        while (!agent.upstream_url.empty() && agent.upstream_url[agent.upstream_url.size() - 1] == '/') {
+            agent.upstream_url.erase(agent.upstream_url.size() - 1);
+        }
+        if (kislay_server_is_follower(obj)) {
+            agent.upstream_url.clear();
+            zend_throw_exception(zend_ce_exception, "leader and upstream options are mutually exclusive", 0);
+            return;
         }
-        if (kislay_hash_find_string(Z_ARRVAL_P(options), "port", &port)) {
-            obj->port = std::strtol(port.c_str(), nullptr, 10);
+        if (pthread_create(&agent.thread, nullptr, kislay_server_agent_main, obj) != 0) {
+            zend_throw_exception(zend_ce_exception, "Unable to start upstream refresh thread", 0);
+            return;
         }
+        agent.thread_started = true;
     }
 }
 
@@ -1632,14 +6450,22 @@ PHP_METHOD(KislayPHPConfigServer, listen) {
     char *host = nullptr;
     size_t host_len = 0;
     zend_long port = 0;
-    ZEND_PARSE_PARAMETERS_START(2, 2)
+    ZEND_PARSE_PARAMETERS_START(1, 2)
         Z_PARAM_STRING(host, host_len)
+        Z_PARAM_OPTIONAL
         Z_PARAM_LONG(port)
     ZEND_PARSE_PARAMETERS_END();
 
+    /* Only a unix:// path may omit the port. */
+    bool unix_socket = host_len >= sizeof(KISLAY_UNIX_PREFIX) - 1 && std::memcmp(host, KISLAY_UNIX_PREFIX, sizeof(KISLAY_UNIX_PREFIX) - 1) == 0;
+    if (!unix_socket && (port <= 0 || port > 65535)) {
+        zend_throw_exception(zend_ce_exception, "listen() requires a port between 1 and 65535 for TCP hosts", 0);
+        RETURN_FALSE;
+    }
+
     php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
     obj->host.assign(host, host_len);
-    obj->port = port;
+    obj->port = unix_socket ? 0 : port;
     RETURN_TRUE;
 }
 
@@ -1650,16 +6476,19 @@ PHP_METHOD(KislayPHPConfigServer, setGlobal) {
     ZEND_PARSE_PARAMETERS_END();
 
     php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    if (!kislay_server_check_writable(obj)) {
+        RETURN_FALSE;
+    }
     flat_map_t flattened;
     std::string error;
     if (!kislay_zval_to_flat_map(config, &flattened, &error)) {
         zend_throw_exception(zend_ce_exception, error.c_str(), 0);
         RETURN_FALSE;
     }
-    pthread_mutex_lock(&obj->lock);
-    obj->global_scope = flattened;
-    kislay_server_bump_version(obj);
-    pthread_mutex_unlock(&obj->lock);
+    if (!kislay_server_write_scope(obj, std::vector<std::string>{"global"}, &flattened, nullptr, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
     RETURN_TRUE;
 }
 
@@ -1673,16 +6502,19 @@ PHP_METHOD(KislayPHPConfigServer, setEnvironment) {
     ZEND_PARSE_PARAMETERS_END();
 
     php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    if (!kislay_server_check_writable(obj)) {
+        RETURN_FALSE;
+    }
     flat_map_t flattened;
     std::string error;
     if (!kislay_zval_to_flat_map(config, &flattened, &error)) {
         zend_throw_exception(zend_ce_exception, error.c_str(), 0);
         RETURN_FALSE;
     }
-    pthread_mutex_lock(&obj->lock);
-    obj->environment_scopes[std::string(environment, environment_len)] = flattened;
-    kislay_server_bump_version(obj);
-    pthread_mutex_unlock(&obj->lock);
+    if (!kislay_server_write_scope(obj, std::vector<std::string>{"environments", std::string(environment, environment_len)}, &flattened, nullptr, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
     RETURN_TRUE;
 }
 
@@ -1696,16 +6528,19 @@ PHP_METHOD(KislayPHPConfigServer, setProject) {
     ZEND_PARSE_PARAMETERS_END();
 
     php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    if (!kislay_server_check_writable(obj)) {
+        RETURN_FALSE;
+    }
     flat_map_t flattened;
     std::string error;
     if (!kislay_zval_to_flat_map(config, &flattened, &error)) {
         zend_throw_exception(zend_ce_exception, error.c_str(), 0);
         RETURN_FALSE;
     }
-    pthread_mutex_lock(&obj->lock);
-    obj->project_scopes[std::string(project, project_len)] = flattened;
-    kislay_server_bump_version(obj);
-    pthread_mutex_unlock(&obj->lock);
+    if (!kislay_server_write_scope(obj, std::vector<std::string>{"projects", std::string(project, project_len)}, &flattened, nullptr, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
     RETURN_TRUE;
 }
 
@@ -1722,16 +6557,19 @@ PHP_METHOD(KislayPHPConfigServer, setService) {
     ZEND_PARSE_PARAMETERS_END();
 
     php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    if (!kislay_server_check_writable(obj)) {
+        RETURN_FALSE;
+    }
     flat_map_t flattened;
     std::string error;
     if (!kislay_zval_to_flat_map(config, &flattened, &error)) {
         zend_throw_exception(zend_ce_exception, error.c_str(), 0);
         RETURN_FALSE;
     }
-    pthread_mutex_lock(&obj->lock);
-    obj->service_scopes[std::string(project, project_len)][std::string(service, service_len)] = flattened;
-    kislay_server_bump_version(obj);
-    pthread_mutex_unlock(&obj->lock);
+    if (!kislay_server_write_scope(obj, std::vector<std::string>{"projects", std::string(project, project_len), "services", std::string(service, service_len)}, &flattened, nullptr, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
     RETURN_TRUE;
 }
 
@@ -1751,19 +6589,89 @@ PHP_METHOD(KislayPHPConfigServer, setNode) {
     ZEND_PARSE_PARAMETERS_END();
 
     php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    if (!kislay_server_check_writable(obj)) {
+        RETURN_FALSE;
+    }
     flat_map_t flattened;
     std::string error;
     if (!kislay_zval_to_flat_map(config, &flattened, &error)) {
         zend_throw_exception(zend_ce_exception, error.c_str(), 0);
         RETURN_FALSE;
     }
-    pthread_mutex_lock(&obj->lock);
-    obj->node_scopes[std::string(project, project_len)][std::string(service, service_len)][std::string(node, node_len)] = flattened;
-    kislay_server_bump_version(obj);
-    pthread_mutex_unlock(&obj->lock);
+    if (!kislay_server_write_scope(obj, std::vector<std::string>{"projects", std::string(project, project_len), "services", std::string(service, service_len), "nodes", std::string(node, node_len)}, &flattened, nullptr, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
     RETURN_TRUE;
 }
 
+PHP_METHOD(KislayPHPConfigServer, apply) {
+    zval *ops = nullptr;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_ARRAY(ops)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    if (!kislay_server_check_writable(obj)) {
+        RETURN_FALSE;
+    }
+
+    std::vector<kislay_scope_op_t> batch;
+    batch.reserve(zend_hash_num_elements(Z_ARRVAL_P(ops)));
+    zval *entry = nullptr;
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(ops), entry) {
+        zval *scope = Z_TYPE_P(entry) == IS_ARRAY ? zend_hash_str_find(Z_ARRVAL_P(entry), "scope", sizeof("scope") - 1) : nullptr;
+        zval *config = Z_TYPE_P(entry) == IS_ARRAY ? zend_hash_str_find(Z_ARRVAL_P(entry), "config", sizeof("config") - 1) : nullptr;
+        kislay_scope_op_t op;
+        if (scope != nullptr && Z_TYPE_P(scope) == IS_ARRAY) {
+            zval *part = nullptr;
+            ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(scope), part) {
+                op.scope.push_back(kislay_string_from_zval(part));
+            } ZEND_HASH_FOREACH_END();
+        } else if (scope != nullptr && Z_TYPE_P(scope) == IS_STRING) {
+            op.scope = kislay_scope_from_path(std::string(Z_STRVAL_P(scope), Z_STRLEN_P(scope)));
+        }
+        zval *kind = Z_TYPE_P(entry) == IS_ARRAY ? zend_hash_str_find(Z_ARRVAL_P(entry), "op", sizeof("op") - 1) : nullptr;
+        std::string kind_name = kind != nullptr ? kislay_string_from_zval(kind) : std::string("set");
+        op.patch = kind_name == "patch";
+        zval *deletes = nullptr;
+        if (op.patch) {
+            config = zend_hash_str_find(Z_ARRVAL_P(entry), "set", sizeof("set") - 1);
+            deletes = zend_hash_str_find(Z_ARRVAL_P(entry), "delete", sizeof("delete") - 1);
+            if (deletes != nullptr && Z_TYPE_P(deletes) == IS_ARRAY) {
+                zval *key = nullptr;
+                ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(deletes), key) {
+                    op.deletes.push_back(kislay_string_from_zval(key));
+                } ZEND_HASH_FOREACH_END();
+            }
+        }
+        flat_map_t values;
+        std::string error;
+        bool valid = kislay_server_scope_is_valid(op.scope) && (op.patch || kind_name == "set");
+        if (valid && op.patch) {
+            valid = (config != nullptr || deletes != nullptr) && (config == nullptr || kislay_zval_to_flat_map(config, &values, &error)) &&
+                (deletes == nullptr || Z_TYPE_P(deletes) == IS_ARRAY);
+        } else if (valid) {
+            valid = config != nullptr && kislay_zval_to_flat_map(config, &values, &error);
+        }
+        if (!valid) {
+            std::string message = "Invalid batch op at index " + std::to_string(static_cast<unsigned long long>(batch.size()));
+            zend_throw_exception(zend_ce_exception, message.c_str(), 0);
+            RETURN_FALSE;
+        }
+        op.values = std::make_shared<kislay_scope_t>(values);
+        batch.push_back(op);
+    } ZEND_HASH_FOREACH_END();
+
+    std::string version;
+    std::string error;
+    if (!kislay_server_apply_ops(obj, batch, &version, nullptr, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    RETURN_STRINGL(version.c_str(), version.size());
+}
+
 PHP_METHOD(KislayPHPConfigServer, resolve) {
     zend_string *environment = nullptr;
     zend_string *project = nullptr;
@@ -1778,15 +6686,17 @@ PHP_METHOD(KislayPHPConfigServer, resolve) {
     ZEND_PARSE_PARAMETERS_END();
 
     php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    scope_ptr_t layers[5];
     pthread_mutex_lock(&obj->lock);
-    flat_map_t resolved = kislay_server_resolve_locked(
+    kislay_server_chain_locked(
         obj,
         environment != nullptr ? std::string(ZSTR_VAL(environment), ZSTR_LEN(environment)) : std::string(),
         project != nullptr ? std::string(ZSTR_VAL(project), ZSTR_LEN(project)) : std::string(),
         service != nullptr ? std::string(ZSTR_VAL(service), ZSTR_LEN(service)) : std::string(),
-        node != nullptr ? std::string(ZSTR_VAL(node), ZSTR_LEN(node)) : std::string());
+        node != nullptr ? std::string(ZSTR_VAL(node), ZSTR_LEN(node)) : std::string(),
+        layers);
     pthread_mutex_unlock(&obj->lock);
-    kislay_flat_map_to_array(resolved, return_value);
+    kislay_entries_to_array(kislay_merge_chain(layers), return_value);
 }
 
 PHP_METHOD(KislayPHPConfigServer, version) {
@@ -1797,378 +6707,1352 @@ PHP_METHOD(KislayPHPConfigServer, version) {
     RETURN_STRING(version.c_str());
 }
 
-PHP_METHOD(KislayPHPConfigServer, save) {
-    char *path = nullptr;
-    size_t path_len = 0;
-    ZEND_PARSE_PARAMETERS_START(1, 1)
-        Z_PARAM_STRING(path, path_len)
-    ZEND_PARSE_PARAMETERS_END();
+PHP_METHOD(KislayPHPConfigServer, save) {
+    char *path = nullptr;
+    size_t path_len = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_STRING(path, path_len)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    kislay_server_snapshot_t snapshot;
+    pthread_mutex_lock(&obj->lock);
+    kislay_server_snapshot_locked(obj, &snapshot);
+    pthread_mutex_unlock(&obj->lock);
+
+    RETURN_BOOL(kislay_write_file_atomic(std::string(path, path_len), kislay_server_snapshot_json(snapshot), nullptr));
+}
+
+PHP_METHOD(KislayPHPConfigServer, load) {
+    char *path = nullptr;
+    size_t path_len = 0;
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_STRING(path, path_len)
+    ZEND_PARSE_PARAMETERS_END();
+
+    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    if (!kislay_server_check_writable(obj)) {
+        RETURN_FALSE;
+    }
+    if (!kislay_server_load_file(obj, std::string(path, path_len))) {
+        RETURN_FALSE;
+    }
+    /* The journal only holds deltas, so a wholesale load has to be checkpointed. */
+    if (obj->persistence.journal_fd >= 0) {
+        std::string error;
+        if (!kislay_server_checkpoint(obj, &error)) {
+            zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+            RETURN_FALSE;
+        }
+    }
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPConfigServer, checkpoint) {
+    ZEND_PARSE_PARAMETERS_NONE();
+
+    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    std::string error;
+    if (!kislay_server_checkpoint(obj, &error)) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
+        RETURN_FALSE;
+    }
+    RETURN_TRUE;
+}
+
+PHP_METHOD(KislayPHPConfigServer, stats) {
+    ZEND_PARSE_PARAMETERS_NONE();
+
+    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+    kislay_server_persistence_t &persistence = obj->persistence;
+    array_init(return_value);
+    kislay_scoped_pthread_lock_t guard(&obj->lock);
+    add_assoc_long(return_value, "revision", static_cast<zend_long>(obj->revision));
+    add_assoc_bool(return_value, "journal_enabled", persistence.journal_fd >= 0);
+    add_assoc_long(return_value, "journal_bytes", static_cast<zend_long>(persistence.journal_bytes));
+    add_assoc_long(return_value, "journal_records", static_cast<zend_long>(persistence.journal_records));
+    add_assoc_long(return_value, "checkpoints", static_cast<zend_long>(persistence.checkpoints));
+    add_assoc_long(return_value, "last_checkpoint_revision", static_cast<zend_long>(persistence.last_checkpoint_revision));
+    add_assoc_long(return_value, "last_checkpoint_bytes", static_cast<zend_long>(persistence.last_checkpoint_size));
+    add_assoc_double(return_value, "last_checkpoint_ms", persistence.last_checkpoint_ms);
+    add_assoc_string(return_value, "last_checkpoint_error", const_cast<char *>(persistence.last_checkpoint_error.c_str()));
+
+    pthread_mutex_lock(&obj->coalescer.lock);
+    add_assoc_long(return_value, "resolves_computed", static_cast<zend_long>(obj->coalescer.computed));
+    add_assoc_long(return_value, "resolves_coalesced", static_cast<zend_long>(obj->coalescer.coalesced));
+    add_assoc_long(return_value, "resolves_cached", static_cast<zend_long>(obj->coalescer.cached));
+    add_assoc_long(return_value, "resolves_compressed", static_cast<zend_long>(obj->coalescer.compressed));
+    add_assoc_long(return_value, "resolve_cache_bytes", static_cast<zend_long>(obj->coalescer.cache_bytes));
+    pthread_mutex_unlock(&obj->coalescer.lock);
+
+    kislay_node_tier_t &tier = obj->tier;
+    add_assoc_long(return_value, "node_resident_scopes", static_cast<zend_long>(tier.resident.size()));
+    add_assoc_long(return_value, "node_resident_bytes", static_cast<zend_long>(tier.resident_bytes));
+    add_assoc_long(return_value, "node_segment_bytes", static_cast<zend_long>(tier.segment ? tier.segment->size : 0));
+    add_assoc_long(return_value, "node_segment_live_bytes", static_cast<zend_long>(tier.live_bytes));
+    add_assoc_long(return_value, "node_loads", static_cast<zend_long>(tier.loads));
+    add_assoc_long(return_value, "node_spills", static_cast<zend_long>(tier.spills));
+    add_assoc_long(return_value, "node_compactions", static_cast<zend_long>(tier.compactions));
+    add_assoc_string(return_value, "last_node_segment_error", const_cast<char *>(tier.last_error.c_str()));
+
+    pthread_mutex_lock(&kislay_string_pool_lock);
+    add_assoc_long(return_value, "interned_strings", static_cast<zend_long>(kislay_string_pool.count));
+    add_assoc_long(return_value, "interned_bytes", static_cast<zend_long>(kislay_string_pool.bytes));
+    add_assoc_long(return_value, "interned_blocks", static_cast<zend_long>(kislay_string_pool.blocks));
+    add_assoc_long(return_value, "interned_block_bytes", static_cast<zend_long>(kislay_string_pool.block_bytes));
+    pthread_mutex_unlock(&kislay_string_pool_lock);
+
+    pthread_mutex_lock(&obj->connections.lock);
+    std::uint64_t shed_endpoint_limit = 0;
+    for (int i = 0; i < KISLAY_ENDPOINT_COUNT; ++i) {
+        shed_endpoint_limit += obj->connections.endpoints[i].shed;
+    }
+    add_assoc_long(return_value, "pending_connections", static_cast<zend_long>(obj->connections.pending.size()));
+    add_assoc_long(return_value, "shed_queue_full", static_cast<zend_long>(obj->connections.shed_pending));
+    add_assoc_long(return_value, "shed_endpoint_limit", static_cast<zend_long>(shed_endpoint_limit));
+    pthread_mutex_unlock(&obj->connections.lock);
+
+    kislay_server_replication_t &replication = obj->replication;
+    add_assoc_string(return_value, "role", const_cast<char *>(kislay_server_is_agent(obj) ? "agent" : (kislay_server_is_follower(obj) ? "follower" : "leader")));
+    add_assoc_long(return_value, "change_log_records", static_cast<zend_long>(replication.log.size()));
+    add_assoc_long(return_value, "change_log_floor", static_cast<zend_long>(replication.log_floor));
+    if (kislay_server_is_follower(obj)) {
+        std::uint64_t lag = replication.leader_revision > obj->revision ? replication.leader_revision - obj->revision : 0;
+        add_assoc_string(return_value, "leader", const_cast<char *>(replication.leader_url.c_str()));
+        add_assoc_long(return_value, "leader_revision", static_cast<zend_long>(replication.leader_revision));
+        add_assoc_long(return_value, "replication_lag", static_cast<zend_long>(lag));
+        add_assoc_long(return_value, "last_sync_age_ms", replication.synced
+            ? static_cast<zend_long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - replication.last_sync).count())
+            : -1);
+        add_assoc_long(return_value, "replicated_records", static_cast<zend_long>(replication.records_applied));
+        add_assoc_long(return_value, "replicated_snapshots", static_cast<zend_long>(replication.snapshots_applied));
+        add_assoc_long(return_value, "replication_errors", static_cast<zend_long>(replication.errors));
+        add_assoc_string(return_value, "last_replication_error", const_cast<char *>(replication.last_error.c_str()));
+    }
+    if (kislay_server_is_agent(obj)) {
+        kislay_server_agent_t &agent = obj->agent;
+        pthread_mutex_lock(&agent.lock);
+        add_assoc_string(return_value, "upstream", const_cast<char *>(agent.upstream_url.c_str()));
+        add_assoc_long(return_value, "agent_entries", static_cast<zend_long>(agent.entries.size()));
+        add_assoc_long(return_value, "agent_hits", static_cast<zend_long>(agent.hits));
+        add_assoc_long(return_value, "agent_misses", static_cast<zend_long>(agent.misses));
+        add_assoc_long(return_value, "agent_updates", static_cast<zend_long>(agent.updates));
+        add_assoc_long(return_value, "agent_errors", static_cast<zend_long>(agent.errors));
+        add_assoc_long(return_value, "last_sync_age_ms", agent.synced
+            ? static_cast<zend_long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - agent.last_sync).count())
+            : -1);
+        add_assoc_string(return_value, "last_agent_error", const_cast<char *>(agent.last_error.c_str()));
+        pthread_mutex_unlock(&agent.lock);
+    }
+}
+
+/* "checksum":"...","config":{...} of one resolved map. */
+static void kislay_json_append_resolved(std::string *out, const kislay_entries_t &config) {
+    out->append("\"checksum\":");
+    kislay_json_append_string(out, kislay_checksum_for_entries(config));
+    out->append(",\"config\":");
+    kislay_json_append_entries(out, config);
+}
+
+static std::string kislay_server_response_json(const std::string &version, const kislay_entries_t &config) {
+    std::string out("{\"version\":");
+    kislay_json_append_string(&out, version);
+    out.push_back(',');
+    kislay_json_append_resolved(&out, config);
+    out.push_back('}');
+    return out;
+}
+
+static std::string kislay_server_simple_json(const std::string &key, const std::string &value) {
+    std::string out("{");
+    kislay_json_append_string(&out, key);
+    out.push_back(':');
+    kislay_json_append_string(&out, value);
+    out.push_back('}');
+    return out;
+}
+
+/* PUT replaces the scope at path; PATCH takes {"set":{...},"delete":["dotted.key"]} and touches only those keys. */
+static void kislay_server_apply_remote_write(php_kislayphp_config_server_t *server, const std::string &path, const char *body, std::size_t body_length, bool patch, int client_fd) {
+    if (kislay_server_is_follower(server)) {
+        kislay_http_send_response(client_fd, 403, "application/json", kislay_server_follower_error_json(server));
+        return;
+    }
+
+    kislay_json_value_t decoded;
+    std::vector<kislay_scope_op_t> ops(1);
+    bool parsed = kislay_json_parse(body, body_length, &decoded);
+    if (parsed && patch) {
+        parsed = decoded.kind == kislay_json_value_t::JSON_OBJECT && kislay_json_to_patch(decoded.find("set"), decoded.find("delete"), &ops[0]);
+    } else if (parsed) {
+        flat_map_t values;
+        parsed = kislay_json_to_flat_map(decoded, &values);
+        ops[0].values = std::make_shared<kislay_scope_t>(values);
+    }
+    if (!parsed) {
+        kislay_http_send_response(client_fd, 400, "application/json", "{\"error\":\"invalid json\"}");
+        return;
+    }
+
+    std::vector<std::string> parts;
+    std::stringstream stream(path);
+    std::string item;
+    while (std::getline(stream, item, '/')) {
+        if (!item.empty()) {
+            parts.push_back(kislay_url_decode(item));
+        }
+    }
+
+    std::string version;
+    std::string error;
+    bool ok = parts.size() >= 3 && parts[0] == "v1" && parts[1] == "config";
+    if (ok) {
+        ops[0].scope.assign(parts.begin() + 2, parts.end());
+        ok = kislay_server_apply_ops(server, ops, &version, nullptr, &error);
+    }
+
+    if (!error.empty()) {
+        kislay_http_send_response(client_fd, 500, "application/json", kislay_server_simple_json("error", error));
+        return;
+    }
+    if (!ok) {
+        kislay_http_send_response(client_fd, 404, "application/json", "{\"error\":\"unknown config scope\"}");
+        return;
+    }
+    kislay_http_send_response(client_fd, 200, "application/json", kislay_server_simple_json("version", version));
+}
+
+/* Chain of one resolve-batch tuple, captured under the lock. */
+struct kislay_resolve_layers_t {
+    scope_ptr_t layers[5];
+    std::size_t base;
+};
+
+/*
+ * POST /v1/config/resolve-batch: {"tuples":[{"environment":..,"project":..,"service":..,"node":..}, ...]}.
+ * The chains are captured under the lock. Each distinct
+ * global+environment+project+service base is then merged once, and bases,
+ * node merges and serialization run on the worker pool. Results come back
+ * in request order from one consistent state, each with its chain version.
+ */
+static int kislay_server_resolve_batch_json(php_kislayphp_config_server_t *server, const char *body, std::size_t body_length, std::string *out) {
+    kislay_json_value_t root;
+    if (!kislay_json_parse(body, body_length, &root)) {
+        *out = "{\"error\":\"invalid json\"}";
+        return 400;
+    }
+    const kislay_json_value_t *list = root.kind == kislay_json_value_t::JSON_OBJECT ? root.find("tuples") : &root;
+    if (list == nullptr || list->kind != kislay_json_value_t::JSON_ARRAY) {
+        *out = "{\"error\":\"expected tuples\"}";
+        return 400;
+    }
+    if (list->items.size() > KISLAY_RESOLVE_BATCH_MAX) {
+        *out = "{\"error\":\"too many tuples\",\"max\":" + std::to_string(KISLAY_RESOLVE_BATCH_MAX) + "}";
+        return 413;
+    }
+
+    static const char *const fields[] = {"environment", "project", "service", "node"};
+    std::vector<kislay_resolve_layers_t> tuples(list->items.size());
+    std::vector<kislay_resolve_layers_t *> bases;
+    std::vector<char> base_used_plain;
+    std::map<std::vector<const void *>, std::size_t> base_index;
+    std::string version;
+    {
+        kislay_server_lock_guard_t guard(server);
+        version = server->version;
+        for (std::size_t i = 0; i < list->items.size(); ++i) {
+            std::string names[4];
+            for (int f = 0; f < 4; ++f) {
+                const kislay_json_value_t *value = list->items[i].find(fields[f]);
+                if (value != nullptr && value->kind != kislay_json_value_t::JSON_NULL) {
+                    names[f] = kislay_json_scalar_string(*value);
+                }
+            }
+            kislay_resolve_layers_t &tuple = tuples[i];
+            kislay_server_chain_locked(server, names[0], names[1], names[2], names[3], tuple.layers);
+            std::vector<const void *> key{tuple.layers[1].get(), tuple.layers[2].get(), tuple.layers[3].get()};
+            std::map<std::vector<const void *>, std::size_t>::iterator found = base_index.find(key);
+            if (found == base_index.end()) {
+                found = base_index.insert(std::make_pair(key, bases.size())).first;
+                bases.push_back(&tuple);
+                base_used_plain.push_back(0);
+            }
+            tuple.base = found->second;
+            if (!tuple.layers[4]) {
+                base_used_plain[tuple.base] = 1;
+            }
+        }
+    }
+
+    std::vector<kislay_entries_t> base_maps(bases.size());
+    std::vector<std::string> base_json(bases.size());
+    kislay_worker_pool_run(&server->workers, bases.size(), [&](std::size_t b) {
+        const scope_ptr_t *layers = bases[b]->layers;
+        kislay_entries_t &merged = base_maps[b];
+        for (int l = 0; l < 4; ++l) {
+            if (layers[l]) {
+                kislay_merge_entries(&merged, layers[l]->entries);
+            }
+        }
+        if (base_used_plain[b]) {
+            kislay_json_append_resolved(&base_json[b], merged);
+        }
+    });
+
+    std::vector<std::string> parts(tuples.size());
+    kislay_worker_pool_run(&server->workers, tuples.size(), [&](std::size_t i) {
+        const scope_ptr_t *layers = tuples[i].layers;
+        parts[i].append("{\"version\":\"");
+        parts[i].append(std::to_string(static_cast<unsigned long long>(kislay_chain_revision(layers))));
+        parts[i].append("\",");
+        if (!layers[4]) {
+            return;
+        }
+        kislay_entries_t merged(base_maps[tuples[i].base]);
+        kislay_merge_entries(&merged, layers[4]->entries);
+        kislay_json_append_resolved(&parts[i], merged);
+        parts[i].push_back('}');
+    });
+
+    std::size_t total = 64;
+    for (std::size_t i = 0; i < tuples.size(); ++i) {
+        total += parts[i].size() + (tuples[i].layers[4] ? 1 : base_json[tuples[i].base].size() + 2);
+    }
+    out->reserve(total);
+    out->append("{\"version\":");
+    kislay_json_append_string(out, version);
+    out->append(",\"results\":[");
+    for (std::size_t i = 0; i < tuples.size(); ++i) {
+        if (i > 0) {
+            out->push_back(',');
+        }
+        out->append(parts[i]);
+        if (!tuples[i].layers[4]) {
+            out->append(base_json[tuples[i].base]);
+            out->push_back('}');
+        }
+    }
+    out->append("]}");
+    return 200;
+}
+
+/*
+ * POST /v1/config/resolve-diff?environment=..&project=..&service=..&node=..:
+ * {"bits":N,"buckets":["<hex>", ...]} carries the caller's 2^N bucket hashes
+ * of its copy of the resolved map. The reply lists the buckets that differ
+ * and the full contents of just those buckets, plus the root hash so the
+ * caller can check the patched copy before trusting it.
+ */
+static int kislay_server_resolve_diff_json(php_kislayphp_config_server_t *server, const kislay_http_request_t &request, const char *body, std::size_t body_length, std::string *out) {
+    kislay_json_value_t root;
+    if (!kislay_json_parse(body, body_length, &root) || root.kind != kislay_json_value_t::JSON_OBJECT) {
+        *out = "{\"error\":\"invalid json\"}";
+        return 400;
+    }
+    const kislay_json_value_t *bits_value = root.find("bits");
+    const kislay_json_value_t *list = root.find("buckets");
+    long bits = bits_value != nullptr && bits_value->kind == kislay_json_value_t::JSON_NUMBER ? std::strtol(bits_value->text.c_str(), nullptr, 10) : 0;
+    if (bits < 1 || bits > KISLAY_MERKLE_MAX_BITS || list == nullptr || list->kind != kislay_json_value_t::JSON_ARRAY
+        || list->items.size() != (static_cast<std::size_t>(1) << bits)) {
+        *out = "{\"error\":\"expected bits and buckets\",\"max_bits\":" + std::to_string(KISLAY_MERKLE_MAX_BITS) + "}";
+        return 400;
+    }
+
+    std::string environment, project, service, node, if_version;
+    kislay_http_query_param(request, "environment", &environment);
+    kislay_http_query_param(request, "project", &project);
+    kislay_http_query_param(request, "service", &service);
+    kislay_http_query_param(request, "node", &node);
+    bool conditional = kislay_http_query_param(request, "if_version", &if_version);
+    scope_ptr_t layers[5];
+    kislay_server_lock(server);
+    kislay_server_chain_locked(server, environment, project, service, node, layers);
+    pthread_mutex_unlock(&server->lock);
+    std::string version = std::to_string(static_cast<unsigned long long>(kislay_chain_revision(layers)));
+    if (conditional && if_version == version) {
+        return 304;
+    }
+
+    kislay_entries_t merged = kislay_merge_chain(layers);
+    std::vector<std::uint64_t> leaves(list->items.size(), 0);
+    std::vector<std::size_t> buckets(merged.size());
+    std::uint64_t sum = 0;
+    for (std::size_t i = 0; i < merged.size(); ++i) {
+        std::uint64_t hash = kislay_entry_hash(merged[i].first->hash, merged[i].second->hash);
+        buckets[i] = kislay_merkle_bucket(merged[i].first->hash, static_cast<int>(bits));
+        leaves[buckets[i]] += hash;
+        sum += hash;
+    }
+    std::vector<char> differs(leaves.size(), 0);
+    for (std::size_t b = 0; b < leaves.size(); ++b) {
+        const kislay_json_value_t &theirs = list->items[b];
+        differs[b] = theirs.kind != kislay_json_value_t::JSON_STRING || std::strtoull(theirs.text.c_str(), nullptr, 16) != leaves[b];
+    }
+
+    out->append("{\"version\":");
+    kislay_json_append_string(out, version);
+    out->append(",\"bits\":");
+    out->append(std::to_string(bits));
+    out->append(",\"root\":");
+    kislay_json_append_string(out, kislay_merkle_hex(sum));
+    out->append(",\"buckets\":[");
+    bool first = true;
+    for (std::size_t b = 0; b < differs.size(); ++b) {
+        if (differs[b]) {
+            if (!first) {
+                out->push_back(',');
+            }
+            out->append(std::to_string(static_cast<unsigned long long>(b)));
+            first = false;
+        }
+    }
+    out->append("],\"config\":{");
+    first = true;
+    for (std::size_t i = 0; i < merged.size(); ++i) {
+        if (!differs[buckets[i]]) {
+            continue;
+        }
+        if (!first) {
+            out->push_back(',');
+        }
+        kislay_json_append_string(out, merged[i].first->data, merged[i].first->length);
+        out->push_back(':');
+        kislay_json_append_string(out, merged[i].second->data, merged[i].second->length);
+        first = false;
+    }
+    out->append("}}");
+    return 200;
+}
+
+static void kislay_server_apply_remote_batch(php_kislayphp_config_server_t *server, const char *body, std::size_t body_length, int client_fd) {
+    if (kislay_server_is_follower(server)) {
+        kislay_http_send_response(client_fd, 403, "application/json", kislay_server_follower_error_json(server));
+        return;
+    }
+
+    kislay_json_value_t decoded;
+    if (!kislay_json_parse(body, body_length, &decoded)) {
+        kislay_http_send_response(client_fd, 400, "application/json", "{\"error\":\"invalid json\"}");
+        return;
+    }
+    std::vector<kislay_scope_op_t> ops;
+    std::size_t failed = 0;
+    std::string version;
+    std::string error;
+    bool parsed = kislay_json_to_batch(decoded, &ops, &failed);
+    if (parsed) {
+        failed = ops.size();
+    }
+    if (!parsed || !kislay_server_apply_ops(server, ops, &version, &failed, &error)) {
+        if (!error.empty()) {
+            std::string payload("{\"error\":");
+            kislay_json_append_string(&payload, error);
+            if (failed < ops.size()) {
+                payload.append(",\"index\":");
+                payload.append(std::to_string(static_cast<unsigned long long>(failed)));
+            }
+            payload.push_back('}');
+            kislay_http_send_response(client_fd, 500, "application/json", payload);
+            return;
+        }
+        kislay_http_send_response(client_fd, 400, "application/json",
+            "{\"error\":\"invalid batch op\",\"index\":" + std::to_string(static_cast<unsigned long long>(failed)) + "}");
+        return;
+    }
+    std::string payload("{\"version\":");
+    kislay_json_append_string(&payload, version);
+    payload.append(",\"applied\":");
+    payload.append(std::to_string(static_cast<unsigned long long>(ops.size())));
+    payload.push_back('}');
+    kislay_http_send_response(client_fd, 200, "application/json", payload);
+}
+
+typedef std::unordered_map<kislay_chain_key_t, std::shared_ptr<kislay_resolve_entry_t>, kislay_chain_key_hash_t>::iterator kislay_resolve_cache_iterator_t;
+
+static void kislay_server_lru_unlink_locked(kislay_server_coalescer_t &coalescer, kislay_resolve_entry_t *entry) {
+    (entry->newer != nullptr ? entry->newer->older : coalescer.newest) = entry->older;
+    (entry->older != nullptr ? entry->older->newer : coalescer.oldest) = entry->newer;
+    entry->newer = entry->older = nullptr;
+}
+
+static void kislay_server_lru_push_locked(kislay_server_coalescer_t &coalescer, kislay_resolve_entry_t *entry) {
+    entry->older = coalescer.newest;
+    (coalescer.newest != nullptr ? coalescer.newest->newer : coalescer.oldest) = entry;
+    coalescer.newest = entry;
+}
+
+static void kislay_server_cache_erase_locked(kislay_server_coalescer_t &coalescer, kislay_resolve_cache_iterator_t it) {
+    kislay_resolve_entry_t *entry = it->second.get();
+    coalescer.cache_bytes -= entry->payload->size() + (entry->gzip ? entry->gzip->size() : 0);
+    kislay_server_lru_unlink_locked(coalescer, entry);
+    coalescer.cache.erase(it);
+}
+
+/* Drops least recently used entries until the cache fits; coalescer lock held. */
+static void kislay_server_trim_cache_locked(kislay_server_coalescer_t &coalescer) {
+    while (coalescer.cache_bytes > coalescer.cache_limit && coalescer.oldest != nullptr) {
+        kislay_server_cache_erase_locked(coalescer, coalescer.cache.find(coalescer.oldest->key));
+    }
+}
+
+/* Whether entry was built from exactly these layer objects at their current revisions, not others since allocated at the same addresses. */
+static bool kislay_resolve_entry_matches(const kislay_resolve_entry_t &entry, const scope_ptr_t layers[5]) {
+    for (int i = 0; i < 5; ++i) {
+        if (entry.layers[i].owner_before(layers[i]) || layers[i].owner_before(entry.layers[i]) ||
+            (layers[i] && layers[i]->revision != entry.revisions[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::shared_ptr<kislay_resolve_entry_t> kislay_server_resolve_coalesced(php_kislayphp_config_server_t *server, const scope_ptr_t layers[5]) {
+    kislay_server_coalescer_t &coalescer = server->coalescer;
+    kislay_chain_key_t key{{layers[0].get(), layers[1].get(), layers[2].get(), layers[3].get(), layers[4].get()}};
+
+    pthread_mutex_lock(&coalescer.lock);
+    kislay_resolve_cache_iterator_t cached = coalescer.cache.find(key);
+    if (cached != coalescer.cache.end()) {
+        if (kislay_resolve_entry_matches(*cached->second, layers)) {
+            std::shared_ptr<kislay_resolve_entry_t> entry = cached->second;
+            kislay_server_lru_unlink_locked(coalescer, entry.get());
+            kislay_server_lru_push_locked(coalescer, entry.get());
+            coalescer.cached++;
+            pthread_mutex_unlock(&coalescer.lock);
+            return entry;
+        }
+        kislay_server_cache_erase_locked(coalescer, cached);
+    }
+    std::unordered_map<kislay_chain_key_t, std::shared_ptr<kislay_resolve_flight_t>, kislay_chain_key_hash_t>::iterator it = coalescer.inflight.find(key);
+    if (it != coalescer.inflight.end()) {
+        std::shared_ptr<kislay_resolve_flight_t> flight = it->second;
+        coalescer.coalesced++;
+        while (!flight->done) {
+            pthread_cond_wait(&coalescer.cond, &coalescer.lock);
+        }
+        pthread_mutex_unlock(&coalescer.lock);
+        return flight->entry;
+    }
+    std::shared_ptr<kislay_resolve_flight_t> flight = std::make_shared<kislay_resolve_flight_t>();
+    coalescer.inflight[key] = flight;
+    coalescer.computed++;
+    pthread_mutex_unlock(&coalescer.lock);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    kislay_entries_t config = kislay_merge_chain(layers);
+    if (kislay_metrics_shard != nullptr) {
+        kislay_histogram_record(kislay_metrics_shard->resolve, kislay_elapsed_us(start));
+        start = std::chrono::steady_clock::now();
+    }
+    std::shared_ptr<kislay_resolve_entry_t> entry = std::make_shared<kislay_resolve_entry_t>();
+    for (int i = 0; i < 5; ++i) {
+        entry->layers[i] = layers[i];
+        entry->revisions[i] = layers[i] ? layers[i]->revision : 0;
+    }
+    entry->key = key;
+    entry->payload = std::make_shared<const std::string>(kislay_server_response_json(
+        std::to_string(static_cast<unsigned long long>(kislay_chain_revision(layers))), config));
+    if (kislay_metrics_shard != nullptr) {
+        kislay_histogram_record(kislay_metrics_shard->serialize, kislay_elapsed_us(start));
+    }
+
+    pthread_mutex_lock(&coalescer.lock);
+    flight->entry = entry;
+    flight->done = true;
+    coalescer.inflight.erase(key);
+    if (entry->payload->size() <= coalescer.cache_limit) {
+        cached = coalescer.cache.find(key);
+        if (cached != coalescer.cache.end()) {
+            kislay_server_cache_erase_locked(coalescer, cached);
+        }
+        kislay_server_lru_push_locked(coalescer, entry.get());
+        coalescer.cache[key] = entry;
+        coalescer.cache_bytes += entry->payload->size();
+        kislay_server_trim_cache_locked(coalescer);
+    }
+    pthread_cond_broadcast(&coalescer.cond);
+    pthread_mutex_unlock(&coalescer.lock);
+    return entry;
+}
+
+/* One-shot gzip (RFC 1952) of body. */
+static bool kislay_gzip_compress(const std::string &body, std::string *out) {
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out->resize(deflateBound(&stream, static_cast<uLong>(body.size())));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+    stream.avail_in = static_cast<uInt>(body.size());
+    stream.next_out = reinterpret_cast<Bytef *>(&(*out)[0]);
+    stream.avail_out = static_cast<uInt>(out->size());
+    int result = deflate(&stream, Z_FINISH);
+    out->resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+/*
+ * The entry's gzip body, compressing it if this is the first request to ask.
+ * Concurrent askers wait for that one compression. Null when compressing does
+ * not pay off, in which case the identity body is sent.
+ */
+static std::shared_ptr<const std::string> kislay_server_resolve_gzip(php_kislayphp_config_server_t *server, const std::shared_ptr<kislay_resolve_entry_t> &entry) {
+    kislay_server_coalescer_t &coalescer = server->coalescer;
+    if (entry->payload->size() < KISLAY_GZIP_MIN_BYTES) {
+        return std::shared_ptr<const std::string>();
+    }
+    pthread_mutex_lock(&coalescer.lock);
+    while (entry->compressing) {
+        pthread_cond_wait(&coalescer.cond, &coalescer.lock);
+    }
+    if (entry->compressed) {
+        std::shared_ptr<const std::string> gzip = entry->gzip;
+        pthread_mutex_unlock(&coalescer.lock);
+        return gzip;
+    }
+    entry->compressing = true;
+    pthread_mutex_unlock(&coalescer.lock);
+
+    std::string compressed;
+    std::shared_ptr<const std::string> gzip;
+    if (kislay_gzip_compress(*entry->payload, &compressed) && compressed.size() < entry->payload->size()) {
+        gzip = std::make_shared<const std::string>(std::move(compressed));
+    }
+
+    pthread_mutex_lock(&coalescer.lock);
+    entry->gzip = gzip;
+    entry->compressing = false;
+    entry->compressed = true;
+    coalescer.compressed++;
+    kislay_resolve_cache_iterator_t cached = coalescer.cache.find(entry->key);
+    if (gzip && cached != coalescer.cache.end() && cached->second == entry) {
+        coalescer.cache_bytes += gzip->size();
+        kislay_server_trim_cache_locked(coalescer);
+    }
+    pthread_cond_broadcast(&coalescer.cond);
+    pthread_mutex_unlock(&coalescer.lock);
+    return gzip;
+}
+
+/* True when an Accept-Encoding header lists gzip without q=0. */
+static bool kislay_http_accepts_gzip(const kislay_http_request_t &request) {
+    const kislay_http_header_t *header = kislay_http_find_header(request, "accept-encoding");
+    if (header == nullptr) {
+        return false;
+    }
+    const char *cursor = kislay_http_data(request, header->value);
+    const char *end = cursor + header->value.length;
+    while (cursor < end) {
+        const char *comma = static_cast<const char *>(std::memchr(cursor, ',', static_cast<std::size_t>(end - cursor)));
+        const char *item_end = comma == nullptr ? end : comma;
+        while (cursor < item_end && (*cursor == ' ' || *cursor == '\t')) {
+            ++cursor;
+        }
+        const char *name_end = cursor;
+        while (name_end < item_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t') {
+            ++name_end;
+        }
+        if (name_end - cursor == 4 && strncasecmp(cursor, "gzip", 4) == 0) {
+            const char *q = name_end;
+            while (q < item_end && (*q == ';' || *q == ' ' || *q == '\t')) {
+                ++q;
+            }
+            if (item_end - q < 2 || (q[0] != 'q' && q[0] != 'Q') || q[1] != '=') {
+                return true;
+            }
+            return std::strtod(std::string(q + 2, item_end).c_str(), nullptr) > 0.0;
+        }
+        cursor = comma == nullptr ? end : comma + 1;
+    }
+    return false;
+}
+
+/* 503 with a Retry-After spread over [base, 2 * base] so shed clients do not return in lockstep. */
+static void kislay_server_send_overloaded(php_kislayphp_config_server_t *server, int client_fd) {
+    long base = server->connections.retry_after_sec;
+    std::string seconds = std::to_string(base + static_cast<long>(kislay_jitter(static_cast<std::uint64_t>(base))));
+    kislay_http_send_response(client_fd, 503, "application/json",
+        "{\"error\":\"overloaded\",\"retry_after\":" + seconds + "}", "Retry-After: " + seconds + "\r\n");
+}
+
+/* Answers a connection the admission queue has no room for, without waiting for its request. */
+static void kislay_server_shed_connection(php_kislayphp_config_server_t *server, int client_fd) {
+    char buffer[4096];
+    while (recv(client_fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+    }
+    kislay_server_send_overloaded(server, client_fd);
+    shutdown(client_fd, SHUT_WR);
+    close(client_fd);
+}
+
+static kislay_route_t kislay_server_route(const kislay_http_request_t &request) {
+    if (kislay_http_is(request, request.method, "GET")) {
+        if (kislay_http_is(request, request.path, "/health")) return KISLAY_ROUTE_HEALTH;
+        if (kislay_http_is(request, request.path, "/v1/config/version")) return KISLAY_ROUTE_VERSION;
+        if (kislay_http_is(request, request.path, "/v1/config/resolve")) return KISLAY_ROUTE_RESOLVE;
+        if (kislay_http_is(request, request.path, "/v1/replication/log")) return KISLAY_ROUTE_REPLICATION_LOG;
+        if (kislay_http_is(request, request.path, "/v1/replication/snapshot")) return KISLAY_ROUTE_REPLICATION_SNAPSHOT;
+        if (kislay_http_is(request, request.path, "/v1/replication/status")) return KISLAY_ROUTE_REPLICATION_STATUS;
+        if (kislay_http_is(request, request.path, "/v1/stats")) return KISLAY_ROUTE_STATS;
+        if (kislay_http_is(request, request.path, "/metrics")) return KISLAY_ROUTE_METRICS;
+    }
+    if (kislay_http_is(request, request.method, "POST")) {
+        if (kislay_http_is(request, request.path, "/v1/config/resolve-batch")) return KISLAY_ROUTE_RESOLVE_BATCH;
+        if (kislay_http_is(request, request.path, "/v1/config/resolve-diff")) return KISLAY_ROUTE_RESOLVE_DIFF;
+        if (kislay_http_is(request, request.path, "/v1/config/batch")) return KISLAY_ROUTE_BATCH;
+    }
+    if (kislay_http_is(request, request.method, "PUT")) return KISLAY_ROUTE_PUT;
+    if (kislay_http_is(request, request.method, "PATCH")) return KISLAY_ROUTE_PATCH;
+    return KISLAY_ROUTE_NOT_FOUND;
+}
+
+static kislay_endpoint_t kislay_server_endpoint(kislay_route_t route) {
+    switch (route) {
+        case KISLAY_ROUTE_RESOLVE:
+        case KISLAY_ROUTE_RESOLVE_DIFF:
+            return KISLAY_ENDPOINT_RESOLVE;
+        case KISLAY_ROUTE_RESOLVE_BATCH:
+            return KISLAY_ENDPOINT_RESOLVE_BATCH;
+        case KISLAY_ROUTE_BATCH:
+        case KISLAY_ROUTE_PUT:
+        case KISLAY_ROUTE_PATCH:
+            return KISLAY_ENDPOINT_WRITE;
+        case KISLAY_ROUTE_REPLICATION_LOG:
+        case KISLAY_ROUTE_REPLICATION_SNAPSHOT:
+            return KISLAY_ENDPOINT_REPLICATION;
+        default:
+            return KISLAY_ENDPOINT_OTHER;
+    }
+}
+
+static bool kislay_server_admit(php_kislayphp_config_server_t *server, kislay_endpoint_t endpoint) {
+    kislay_scoped_pthread_lock_t guard(&server->connections.lock);
+    kislay_endpoint_limit_t &slot = server->connections.endpoints[endpoint];
+    if (slot.limit > 0 && slot.active >= slot.limit) {
+        ++slot.shed;
+        return false;
+    }
+    ++slot.active;
+    return true;
+}
+
+static void kislay_server_release(php_kislayphp_config_server_t *server, kislay_endpoint_t endpoint) {
+    kislay_scoped_pthread_lock_t guard(&server->connections.lock);
+    --server->connections.endpoints[endpoint].active;
+}
+
+static void kislay_server_shed_counts(php_kislayphp_config_server_t *server, std::size_t *pending, std::uint64_t *queue_full, std::uint64_t *endpoint_limit) {
+    kislay_scoped_pthread_lock_t guard(&server->connections.lock);
+    *pending = server->connections.pending.size();
+    *queue_full = server->connections.shed_pending;
+    *endpoint_limit = 0;
+    for (int i = 0; i < KISLAY_ENDPOINT_COUNT; ++i) {
+        *endpoint_limit += server->connections.endpoints[i].shed;
+    }
+}
+
+static const char *const kislay_route_names[KISLAY_ROUTE_COUNT] = {
+    "health", "version", "resolve", "resolve_batch", "resolve_diff", "batch", "put", "patch",
+    "replication_log", "replication_snapshot", "replication_status", "stats", "metrics", "not_found",
+};
+
+/* Sums the shards into one histogram; atomics are read relaxed, so a scrape may lag a request or two. */
+static void kislay_histogram_merge(const kislay_histogram_t &from, std::uint64_t *buckets, std::uint64_t *count, std::uint64_t *sum_us) {
+    for (std::size_t i = 0; i <= KISLAY_HISTOGRAM_BOUNDS; ++i) {
+        buckets[i] += from.buckets[i].load(std::memory_order_relaxed);
+    }
+    *count += from.count.load(std::memory_order_relaxed);
+    *sum_us += from.sum_us.load(std::memory_order_relaxed);
+}
+
+static void kislay_metrics_header(std::string *out, const char *name, const char *type, const char *help) {
+    out->append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out->append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+static void kislay_metrics_sample(std::string *out, const std::string &name, const std::string &labels, double value) {
+    char number[32];
+    std::snprintf(number, sizeof(number), "%.15g", value);
+    out->append(name);
+    if (!labels.empty()) {
+        out->append("{").append(labels).append("}");
+    }
+    out->append(" ").append(number).append("\n");
+}
 
-    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
-    zval root;
-    array_init(&root);
+static void kislay_metrics_histogram(std::string *out, const char *name, const std::string &labels, const std::uint64_t *buckets, std::uint64_t count, std::uint64_t sum_us) {
+    std::string prefix = labels.empty() ? std::string() : labels + ",";
+    std::uint64_t cumulative = 0;
+    char bound[32];
+    for (std::size_t i = 0; i < KISLAY_HISTOGRAM_BOUNDS; ++i) {
+        cumulative += buckets[i];
+        std::snprintf(bound, sizeof(bound), "%g", static_cast<double>(kislay_histogram_bound_us(i)) / 1e6);
+        kislay_metrics_sample(out, std::string(name) + "_bucket", prefix + "le=\"" + bound + "\"", static_cast<double>(cumulative));
+    }
+    kislay_metrics_sample(out, std::string(name) + "_bucket", prefix + "le=\"+Inf\"", static_cast<double>(count));
+    kislay_metrics_sample(out, std::string(name) + "_sum", labels, static_cast<double>(sum_us) / 1e6);
+    kislay_metrics_sample(out, std::string(name) + "_count", labels, static_cast<double>(count));
+}
 
-    pthread_mutex_lock(&obj->lock);
-    add_assoc_string(&root, "version", const_cast<char *>(obj->version.c_str()));
-    add_assoc_long(&root, "revision", static_cast<zend_long>(obj->revision));
-
-    zval global;
-    kislay_flat_map_to_array(obj->global_scope, &global);
-    add_assoc_zval(&root, "global", &global);
-
-    zval environments;
-    array_init(&environments);
-    for (scope_map_t::const_iterator it = obj->environment_scopes.begin(); it != obj->environment_scopes.end(); ++it) {
-        zval scope;
-        kislay_flat_map_to_array(it->second, &scope);
-        add_assoc_zval(&environments, it->first.c_str(), &scope);
-    }
-    add_assoc_zval(&root, "environments", &environments);
-
-    zval projects;
-    array_init(&projects);
-    for (scope_map_t::const_iterator it = obj->project_scopes.begin(); it != obj->project_scopes.end(); ++it) {
-        zval scope;
-        kislay_flat_map_to_array(it->second, &scope);
-        add_assoc_zval(&projects, it->first.c_str(), &scope);
-    }
-    add_assoc_zval(&root, "projects", &projects);
-
-    zval services;
-    array_init(&services);
-    for (project_scope_map_t::const_iterator pit = obj->service_scopes.begin(); pit != obj->service_scopes.end(); ++pit) {
-        zval service_map;
-        array_init(&service_map);
-        for (scope_map_t::const_iterator sit = pit->second.begin(); sit != pit->second.end(); ++sit) {
-            zval scope;
-            kislay_flat_map_to_array(sit->second, &scope);
-            add_assoc_zval(&service_map, sit->first.c_str(), &scope);
-        }
-        add_assoc_zval(&services, pit->first.c_str(), &service_map);
-    }
-    add_assoc_zval(&root, "services", &services);
-
-    zval nodes;
-    array_init(&nodes);
-    for (node_scope_map_t::const_iterator pit = obj->node_scopes.begin(); pit != obj->node_scopes.end(); ++pit) {
-        zval project_map;
-        array_init(&project_map);
-        for (project_scope_map_t::const_iterator sit = pit->second.begin(); sit != pit->second.end(); ++sit) {
-            zval service_map;
-            array_init(&service_map);
-            for (scope_map_t::const_iterator nit = sit->second.begin(); nit != sit->second.end(); ++nit) {
-                zval scope;
-                kislay_flat_map_to_array(nit->second, &scope);
-                add_assoc_zval(&service_map, nit->first.c_str(), &scope);
-            }
-            add_assoc_zval(&project_map, sit->first.c_str(), &service_map);
+static void kislay_server_count_scopes_locked(php_kislayphp_config_server_t *server, std::size_t *scopes, std::size_t *keys) {
+    *scopes = 1;
+    *keys = server->global_scope->size();
+    for (scope_map_t::const_iterator it = server->environment_scopes.begin(); it != server->environment_scopes.end(); ++it) {
+        ++*scopes;
+        *keys += it->second->size();
+    }
+    for (scope_map_t::const_iterator it = server->project_scopes.begin(); it != server->project_scopes.end(); ++it) {
+        ++*scopes;
+        *keys += it->second->size();
+    }
+    for (project_scope_map_t::const_iterator project = server->service_scopes.begin(); project != server->service_scopes.end(); ++project) {
+        for (scope_map_t::const_iterator it = project->second.begin(); it != project->second.end(); ++it) {
+            ++*scopes;
+            *keys += it->second->size();
         }
-        add_assoc_zval(&nodes, pit->first.c_str(), &project_map);
     }
-    add_assoc_zval(&root, "nodes", &nodes);
-    pthread_mutex_unlock(&obj->lock);
-
-    std::string json;
-    bool ok = kislay_json_encode_zval(&root, &json);
-    zval_ptr_dtor(&root);
-    if (!ok) {
-        RETURN_FALSE;
+    for (node_scope_map_t::const_iterator project = server->node_scopes.begin(); project != server->node_scopes.end(); ++project) {
+        for (project_scope_map_t::const_iterator service = project->second.begin(); service != project->second.end(); ++service) {
+            for (scope_map_t::const_iterator it = service->second.begin(); it != service->second.end(); ++it) {
+                ++*scopes;
+                *keys += it->second->size();
+            }
+        }
     }
-    RETURN_BOOL(kislay_write_text_file(std::string(path, path_len), json));
 }
 
-PHP_METHOD(KislayPHPConfigServer, load) {
-    char *path = nullptr;
-    size_t path_len = 0;
-    ZEND_PARSE_PARAMETERS_START(1, 1)
-        Z_PARAM_STRING(path, path_len)
-    ZEND_PARSE_PARAMETERS_END();
+/* Prometheus text exposition for GET /metrics. */
+static std::string kislay_server_metrics_text(php_kislayphp_config_server_t *server) {
+    std::uint64_t requests[KISLAY_ROUTE_COUNT][KISLAY_HISTOGRAM_BOUNDS + 1] = {};
+    std::uint64_t request_count[KISLAY_ROUTE_COUNT] = {};
+    std::uint64_t request_sum[KISLAY_ROUTE_COUNT] = {};
+    std::uint64_t responses[KISLAY_ROUTE_COUNT][KISLAY_METRIC_STATUS_COUNT] = {};
+    std::uint64_t phases[3][KISLAY_HISTOGRAM_BOUNDS + 1] = {};
+    std::uint64_t phase_count[3] = {};
+    std::uint64_t phase_sum[3] = {};
+    std::uint64_t bytes_in = 0;
+    std::uint64_t bytes_out = 0;
+
+    pthread_mutex_lock(&server->metrics.lock);
+    for (std::size_t s = 0; s < server->metrics.shards.size(); ++s) {
+        const kislay_metrics_shard_t &shard = *server->metrics.shards[s];
+        for (int route = 0; route < KISLAY_ROUTE_COUNT; ++route) {
+            kislay_histogram_merge(shard.requests[route], requests[route], &request_count[route], &request_sum[route]);
+            for (std::size_t status = 0; status < KISLAY_METRIC_STATUS_COUNT; ++status) {
+                responses[route][status] += shard.responses[route][status].load(std::memory_order_relaxed);
+            }
+        }
+        kislay_histogram_merge(shard.resolve, phases[0], &phase_count[0], &phase_sum[0]);
+        kislay_histogram_merge(shard.serialize, phases[1], &phase_count[1], &phase_sum[1]);
+        kislay_histogram_merge(shard.lock_wait, phases[2], &phase_count[2], &phase_sum[2]);
+        bytes_in += shard.bytes_in.load(std::memory_order_relaxed);
+        bytes_out += shard.bytes_out.load(std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&server->metrics.lock);
+
+    std::uint64_t revision = 0;
+    std::size_t scopes = 0;
+    std::size_t keys = 0;
+    kislay_server_lock(server);
+    revision = server->revision;
+    kislay_server_count_scopes_locked(server, &scopes, &keys);
+    std::size_t node_resident_bytes = server->tier.resident_bytes;
+    std::size_t node_segment_bytes = server->tier.segment ? server->tier.segment->size : 0;
+    std::uint64_t node_events[3] = {server->tier.loads, server->tier.spills, server->tier.compactions};
+    pthread_mutex_unlock(&server->lock);
 
-    std::string body;
-    if (!kislay_read_text_file(std::string(path, path_len), &body)) {
-        RETURN_FALSE;
+    std::size_t pending = 0;
+    std::uint64_t queue_full = 0;
+    std::uint64_t endpoint_limit = 0;
+    kislay_server_shed_counts(server, &pending, &queue_full, &endpoint_limit);
+    pthread_mutex_lock(&server->connections.lock);
+    std::size_t busy = server->connections.busy;
+    pthread_mutex_unlock(&server->connections.lock);
+
+    pthread_mutex_lock(&server->coalescer.lock);
+    std::uint64_t computed = server->coalescer.computed;
+    std::uint64_t coalesced = server->coalescer.coalesced;
+    std::uint64_t cached = server->coalescer.cached;
+    std::uint64_t compressed = server->coalescer.compressed;
+    std::size_t cache_bytes = server->coalescer.cache_bytes;
+    pthread_mutex_unlock(&server->coalescer.lock);
+
+    std::string out;
+    kislay_metrics_header(&out, "kislay_config_http_requests_total", "counter", "HTTP requests by route and status code.");
+    for (int route = 0; route < KISLAY_ROUTE_COUNT; ++route) {
+        for (std::size_t status = 0; status < KISLAY_METRIC_STATUS_COUNT; ++status) {
+            if (responses[route][status] == 0) {
+                continue;
+            }
+            std::string code = status < KISLAY_METRIC_STATUS_COUNT - 1 ? std::to_string(kislay_metric_statuses[status]) : std::string("other");
+            kislay_metrics_sample(&out, "kislay_config_http_requests_total",
+                std::string("route=\"") + kislay_route_names[route] + "\",code=\"" + code + "\"", static_cast<double>(responses[route][status]));
+        }
     }
-
-    zval decoded;
-    ZVAL_UNDEF(&decoded);
-    if (!kislay_json_decode_assoc(body, &decoded) || Z_TYPE(decoded) != IS_ARRAY) {
-        if (!Z_ISUNDEF(decoded)) {
-            zval_ptr_dtor(&decoded);
+    kislay_metrics_header(&out, "kislay_config_http_request_duration_seconds", "histogram", "Time from parsed request to response sent.");
+    for (int route = 0; route < KISLAY_ROUTE_COUNT; ++route) {
+        if (request_count[route] > 0) {
+            kislay_metrics_histogram(&out, "kislay_config_http_request_duration_seconds", std::string("route=\"") + kislay_route_names[route] + "\"",
+                requests[route], request_count[route], request_sum[route]);
+        }
+    }
+    static const char *const phase_names[3][2] = {
+        {"kislay_config_resolve_merge_seconds", "Time merging a chain for GET /v1/config/resolve."},
+        {"kislay_config_resolve_serialize_seconds", "Time serializing a merged chain to JSON."},
+        {"kislay_config_lock_wait_seconds", "Time connection threads waited for the server lock."},
+    };
+    for (int phase = 0; phase < 3; ++phase) {
+        kislay_metrics_header(&out, phase_names[phase][0], "histogram", phase_names[phase][1]);
+        kislay_metrics_histogram(&out, phase_names[phase][0], std::string(), phases[phase], phase_count[phase], phase_sum[phase]);
+    }
+    kislay_metrics_header(&out, "kislay_config_http_received_bytes_total", "counter", "Request bytes read.");
+    kislay_metrics_sample(&out, "kislay_config_http_received_bytes_total", std::string(), static_cast<double>(bytes_in));
+    kislay_metrics_header(&out, "kislay_config_http_sent_bytes_total", "counter", "Response bytes written.");
+    kislay_metrics_sample(&out, "kislay_config_http_sent_bytes_total", std::string(), static_cast<double>(bytes_out));
+    kislay_metrics_header(&out, "kislay_config_resolves_total", "counter", "Resolves merged, served from a concurrent identical resolve, or served from the resolve cache.");
+    kislay_metrics_sample(&out, "kislay_config_resolves_total", "result=\"computed\"", static_cast<double>(computed));
+    kislay_metrics_sample(&out, "kislay_config_resolves_total", "result=\"coalesced\"", static_cast<double>(coalesced));
+    kislay_metrics_sample(&out, "kislay_config_resolves_total", "result=\"cached\"", static_cast<double>(cached));
+    kislay_metrics_header(&out, "kislay_config_resolve_compressions_total", "counter", "Resolve payloads gzip-compressed.");
+    kislay_metrics_sample(&out, "kislay_config_resolve_compressions_total", std::string(), static_cast<double>(compressed));
+    kislay_metrics_header(&out, "kislay_config_resolve_cache_bytes", "gauge", "Serialized and compressed resolve bytes cached.");
+    kislay_metrics_sample(&out, "kislay_config_resolve_cache_bytes", std::string(), static_cast<double>(cache_bytes));
+    kislay_metrics_header(&out, "kislay_config_shed_total", "counter", "Requests answered 503 by load shedding.");
+    kislay_metrics_sample(&out, "kislay_config_shed_total", "reason=\"queue_full\"", static_cast<double>(queue_full));
+    kislay_metrics_sample(&out, "kislay_config_shed_total", "reason=\"endpoint_limit\"", static_cast<double>(endpoint_limit));
+    kislay_metrics_header(&out, "kislay_config_open_connections", "gauge", "Connections queued or being served.");
+    kislay_metrics_sample(&out, "kislay_config_open_connections", std::string(), static_cast<double>(pending + busy));
+    kislay_metrics_header(&out, "kislay_config_revision", "gauge", "Current server revision.");
+    kislay_metrics_sample(&out, "kislay_config_revision", std::string(), static_cast<double>(revision));
+    kislay_metrics_header(&out, "kislay_config_scopes", "gauge", "Stored scopes, including global.");
+    kislay_metrics_sample(&out, "kislay_config_scopes", std::string(), static_cast<double>(scopes));
+    kislay_metrics_header(&out, "kislay_config_keys", "gauge", "Keys summed over all stored scopes.");
+    kislay_metrics_sample(&out, "kislay_config_keys", std::string(), static_cast<double>(keys));
+    kislay_metrics_header(&out, "kislay_config_node_resident_bytes", "gauge", "Approximate bytes of node scopes held in memory under max_resident_bytes.");
+    kislay_metrics_sample(&out, "kislay_config_node_resident_bytes", std::string(), static_cast<double>(node_resident_bytes));
+    kislay_metrics_header(&out, "kislay_config_node_segment_bytes", "gauge", "Bytes appended to the node spill segment.");
+    kislay_metrics_sample(&out, "kislay_config_node_segment_bytes", std::string(), static_cast<double>(node_segment_bytes));
+    kislay_metrics_header(&out, "kislay_config_node_tier_events_total", "counter", "Node scopes read back from or written to the spill segment, and segment compactions.");
+    static const char *const node_event_names[3] = {"load", "spill", "compact"};
+    for (int i = 0; i < 3; ++i) {
+        kislay_metrics_sample(&out, "kislay_config_node_tier_events_total", std::string("event=\"") + node_event_names[i] + "\"", static_cast<double>(node_events[i]));
+    }
+    pthread_mutex_lock(&kislay_string_pool_lock);
+    std::size_t interned = kislay_string_pool.count;
+    std::size_t interned_bytes = kislay_string_pool.bytes;
+    std::size_t interned_block_bytes = kislay_string_pool.block_bytes;
+    pthread_mutex_unlock(&kislay_string_pool_lock);
+    kislay_metrics_header(&out, "kislay_config_interned_strings", "gauge", "Distinct keys and values in the process-wide string pool.");
+    kislay_metrics_sample(&out, "kislay_config_interned_strings", std::string(), static_cast<double>(interned));
+    kislay_metrics_header(&out, "kislay_config_interned_bytes", "gauge", "String bytes held by the pool.");
+    kislay_metrics_sample(&out, "kislay_config_interned_bytes", std::string(), static_cast<double>(interned_bytes));
+    kislay_metrics_header(&out, "kislay_config_interned_block_bytes", "gauge", "Bytes allocated for pool string blocks, including strings still held by a partly released block.");
+    kislay_metrics_sample(&out, "kislay_config_interned_block_bytes", std::string(), static_cast<double>(interned_block_bytes));
+    if (kislay_server_is_agent(server)) {
+        pthread_mutex_lock(&server->agent.lock);
+        std::size_t entries = server->agent.entries.size();
+        std::uint64_t agent_counts[4] = {server->agent.hits, server->agent.misses, server->agent.updates, server->agent.errors};
+        pthread_mutex_unlock(&server->agent.lock);
+        kislay_metrics_header(&out, "kislay_config_agent_entries", "gauge", "Resolve tuples mirrored from the upstream.");
+        kislay_metrics_sample(&out, "kislay_config_agent_entries", std::string(), static_cast<double>(entries));
+        kislay_metrics_header(&out, "kislay_config_agent_events_total", "counter", "Mirror hits and misses, upstream updates and upstream errors.");
+        static const char *const agent_events[4] = {"event=\"hit\"", "event=\"miss\"", "event=\"update\"", "event=\"error\""};
+        for (int i = 0; i < 4; ++i) {
+            kislay_metrics_sample(&out, "kislay_config_agent_events_total", agent_events[i], static_cast<double>(agent_counts[i]));
         }
-        RETURN_FALSE;
     }
+    return out;
+}
 
-    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
-    pthread_mutex_lock(&obj->lock);
-    obj->global_scope.clear();
-    obj->environment_scopes.clear();
-    obj->project_scopes.clear();
-    obj->service_scopes.clear();
-    obj->node_scopes.clear();
+static void kislay_server_send_resolve(php_kislayphp_config_server_t *server, const kislay_http_request_t &request, const std::shared_ptr<kislay_resolve_entry_t> &entry, int client_fd) {
+    std::shared_ptr<const std::string> gzip;
+    if (kislay_http_accepts_gzip(request)) {
+        gzip = kislay_server_resolve_gzip(server, entry);
+    }
+    if (gzip) {
+        kislay_http_send_response(client_fd, 200, "application/json", *gzip, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+    } else {
+        kislay_http_send_response(client_fd, 200, "application/json", *entry->payload, "Vary: Accept-Encoding\r\n");
+    }
+}
 
-    zval *version = zend_hash_str_find(Z_ARRVAL(decoded), "version", sizeof("version") - 1);
-    zval *revision = zend_hash_str_find(Z_ARRVAL(decoded), "revision", sizeof("revision") - 1);
-    if (version != nullptr) {
-        obj->version = kislay_string_from_zval(version);
+/*
+ * Agent mode: resolve and chain version come from the mirror, the server-wide
+ * version from the upstream, and writes and replication are refused. Returns
+ * false for routes answered the same as on any server (health, stats, metrics).
+ */
+static bool kislay_server_agent_handle_request(php_kislayphp_config_server_t *server, const kislay_http_request_t &request, kislay_route_t route, int client_fd) {
+    if (route == KISLAY_ROUTE_HEALTH || route == KISLAY_ROUTE_STATS || route == KISLAY_ROUTE_METRICS || route == KISLAY_ROUTE_NOT_FOUND) {
+        return false;
     }
-    if (revision != nullptr) {
-        obj->revision = static_cast<std::uint64_t>(zval_get_long(revision));
+    if (route == KISLAY_ROUTE_VERSION && request.query.length == 0) {
+        std::string body;
+        if (!kislay_server_agent_version(server, &body)) {
+            kislay_http_send_response(client_fd, 502, "application/json", "{\"error\":\"upstream unavailable\"}");
+        } else {
+            kislay_http_send_response(client_fd, 200, "application/json", body);
+        }
+        return true;
+    }
+    if (route != KISLAY_ROUTE_RESOLVE && route != KISLAY_ROUTE_VERSION) {
+        kislay_http_send_response(client_fd, 403, "application/json", kislay_server_agent_error_json(server));
+        return true;
     }
 
-    zval *global = zend_hash_str_find(Z_ARRVAL(decoded), "global", sizeof("global") - 1);
-    if (global != nullptr && Z_TYPE_P(global) == IS_ARRAY) {
-        HashTable *ht = Z_ARRVAL_P(global);
-        zend_string *key = nullptr;
-        zend_ulong index = 0;
-        zval *entry = nullptr;
-        ZEND_HASH_FOREACH_KEY_VAL(ht, index, key, entry) {
-            if (key != nullptr) {
-                obj->global_scope[std::string(ZSTR_VAL(key), ZSTR_LEN(key))] = kislay_string_from_zval(entry);
-            }
-        } ZEND_HASH_FOREACH_END();
+    std::string environment, project, service, node, if_version;
+    kislay_http_query_param(request, "environment", &environment);
+    kislay_http_query_param(request, "project", &project);
+    kislay_http_query_param(request, "service", &service);
+    kislay_http_query_param(request, "node", &node);
+    bool conditional = kislay_http_query_param(request, "if_version", &if_version);
+    std::shared_ptr<kislay_resolve_entry_t> entry;
+    std::string version;
+    if (!kislay_server_agent_resolve(server, kislay_agent_key(environment, project, service, node), &entry, &version)) {
+        kislay_http_send_response(client_fd, 502, "application/json", "{\"error\":\"upstream unavailable\"}");
+    } else if (route == KISLAY_ROUTE_VERSION) {
+        kislay_http_send_response(client_fd, 200, "application/json", kislay_server_simple_json("version", version));
+    } else if (conditional && if_version == version) {
+        kislay_http_send_response(client_fd, 304, "application/json", std::string());
+    } else {
+        kislay_server_send_resolve(server, request, entry, client_fd);
     }
+    return true;
+}
 
-    zval *environments = zend_hash_str_find(Z_ARRVAL(decoded), "environments", sizeof("environments") - 1);
-    if (environments != nullptr && Z_TYPE_P(environments) == IS_ARRAY) {
-        zend_string *scope_name = nullptr;
-        zend_ulong idx = 0;
-        zval *scope_value = nullptr;
-        ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(environments), idx, scope_name, scope_value) {
-            if (scope_name == nullptr || Z_TYPE_P(scope_value) != IS_ARRAY) {
-                continue;
-            }
-            HashTable *scope_ht = Z_ARRVAL_P(scope_value);
-            zend_string *key = nullptr;
-            zend_ulong inner_idx = 0;
-            zval *entry = nullptr;
-            flat_map_t map;
-            ZEND_HASH_FOREACH_KEY_VAL(scope_ht, inner_idx, key, entry) {
-                if (key != nullptr) {
-                    map[std::string(ZSTR_VAL(key), ZSTR_LEN(key))] = kislay_string_from_zval(entry);
-                }
-            } ZEND_HASH_FOREACH_END();
-            obj->environment_scopes[std::string(ZSTR_VAL(scope_name), ZSTR_LEN(scope_name))] = map;
-        } ZEND_HASH_FOREACH_END();
+/* Routes one request; runs on connection threads, so nothing here may touch the Zend engine. */
+static void kislay_server_handle_request(php_kislayphp_config_server_t *server, const kislay_http_request_t &request, kislay_route_t route, int client_fd) {
+    if (kislay_server_is_agent(server) && kislay_server_agent_handle_request(server, request, route, client_fd)) {
+        return;
     }
 
-    zval *projects = zend_hash_str_find(Z_ARRVAL(decoded), "projects", sizeof("projects") - 1);
-    if (projects != nullptr && Z_TYPE_P(projects) == IS_ARRAY) {
-        zend_string *scope_name = nullptr;
-        zend_ulong idx = 0;
-        zval *scope_value = nullptr;
-        ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(projects), idx, scope_name, scope_value) {
-            if (scope_name == nullptr || Z_TYPE_P(scope_value) != IS_ARRAY) {
-                continue;
-            }
-            HashTable *scope_ht = Z_ARRVAL_P(scope_value);
-            zend_string *key = nullptr;
-            zend_ulong inner_idx = 0;
-            zval *entry = nullptr;
-            flat_map_t map;
-            ZEND_HASH_FOREACH_KEY_VAL(scope_ht, inner_idx, key, entry) {
-                if (key != nullptr) {
-                    map[std::string(ZSTR_VAL(key), ZSTR_LEN(key))] = kislay_string_from_zval(entry);
-                }
-            } ZEND_HASH_FOREACH_END();
-            obj->project_scopes[std::string(ZSTR_VAL(scope_name), ZSTR_LEN(scope_name))] = map;
-        } ZEND_HASH_FOREACH_END();
+    if (route == KISLAY_ROUTE_HEALTH) {
+        kislay_server_lock(server);
+        std::string payload = kislay_server_simple_json("version", server->version);
+        pthread_mutex_unlock(&server->lock);
+        kislay_http_send_response(client_fd, 200, "application/json", payload);
+        return;
     }
 
-    zval *services = zend_hash_str_find(Z_ARRVAL(decoded), "services", sizeof("services") - 1);
-    if (services != nullptr && Z_TYPE_P(services) == IS_ARRAY) {
-        zend_string *project_name = nullptr;
-        zend_ulong idx = 0;
-        zval *service_map = nullptr;
-        ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(services), idx, project_name, service_map) {
-            if (project_name == nullptr || Z_TYPE_P(service_map) != IS_ARRAY) {
-                continue;
-            }
-            zend_string *service_name = nullptr;
-            zend_ulong inner_idx = 0;
-            zval *scope_value = nullptr;
-            ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(service_map), inner_idx, service_name, scope_value) {
-                if (service_name == nullptr || Z_TYPE_P(scope_value) != IS_ARRAY) {
-                    continue;
-                }
-                flat_map_t map;
-                zend_string *key = nullptr;
-                zend_ulong key_idx = 0;
-                zval *entry = nullptr;
-                ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(scope_value), key_idx, key, entry) {
-                    if (key != nullptr) {
-                        map[std::string(ZSTR_VAL(key), ZSTR_LEN(key))] = kislay_string_from_zval(entry);
-                    }
-                } ZEND_HASH_FOREACH_END();
-                obj->service_scopes[std::string(ZSTR_VAL(project_name), ZSTR_LEN(project_name))][std::string(ZSTR_VAL(service_name), ZSTR_LEN(service_name))] = map;
-            } ZEND_HASH_FOREACH_END();
-        } ZEND_HASH_FOREACH_END();
+    if (route == KISLAY_ROUTE_VERSION) {
+        std::string version;
+        if (request.query.length == 0) {
+            kislay_server_lock(server);
+            version = server->version;
+        } else {
+            std::string environment, project, service, node;
+            kislay_http_query_param(request, "environment", &environment);
+            kislay_http_query_param(request, "project", &project);
+            kislay_http_query_param(request, "service", &service);
+            kislay_http_query_param(request, "node", &node);
+            scope_ptr_t layers[5];
+            kislay_server_lock(server);
+            kislay_server_chain_locked(server, environment, project, service, node, layers);
+            version = std::to_string(static_cast<unsigned long long>(kislay_chain_revision(layers)));
+        }
+        pthread_mutex_unlock(&server->lock);
+        kislay_http_send_response(client_fd, 200, "application/json", kislay_server_simple_json("version", version));
+        return;
     }
 
-    zval *nodes = zend_hash_str_find(Z_ARRVAL(decoded), "nodes", sizeof("nodes") - 1);
-    if (nodes != nullptr && Z_TYPE_P(nodes) == IS_ARRAY) {
-        zend_string *project_name = nullptr;
-        zend_ulong idx = 0;
-        zval *service_map = nullptr;
-        ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(nodes), idx, project_name, service_map) {
-            if (project_name == nullptr || Z_TYPE_P(service_map) != IS_ARRAY) {
-                continue;
-            }
-            zend_string *service_name = nullptr;
-            zend_ulong inner_idx = 0;
-            zval *node_map = nullptr;
-            ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(service_map), inner_idx, service_name, node_map) {
-                if (service_name == nullptr || Z_TYPE_P(node_map) != IS_ARRAY) {
-                    continue;
-                }
-                zend_string *node_name = nullptr;
-                zend_ulong node_idx = 0;
-                zval *scope_value = nullptr;
-                ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(node_map), node_idx, node_name, scope_value) {
-                    if (node_name == nullptr || Z_TYPE_P(scope_value) != IS_ARRAY) {
-                        continue;
-                    }
-                    flat_map_t map;
-                    zend_string *key = nullptr;
-                    zend_ulong key_idx = 0;
-                    zval *entry = nullptr;
-                    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(scope_value), key_idx, key, entry) {
-                        if (key != nullptr) {
-                            map[std::string(ZSTR_VAL(key), ZSTR_LEN(key))] = kislay_string_from_zval(entry);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                    obj->node_scopes[std::string(ZSTR_VAL(project_name), ZSTR_LEN(project_name))][std::string(ZSTR_VAL(service_name), ZSTR_LEN(service_name))][std::string(ZSTR_VAL(node_name), ZSTR_LEN(node_name))] = map;
-                } ZEND_HASH_FOREACH_END();
-            } ZEND_HASH_FOREACH_END();
-        } ZEND_HASH_FOREACH_END();
+    if (route == KISLAY_ROUTE_RESOLVE) {
+        std::string environment, project, service, node, if_version;
+        kislay_http_query_param(request, "environment", &environment);
+        kislay_http_query_param(request, "project", &project);
+        kislay_http_query_param(request, "service", &service);
+        kislay_http_query_param(request, "node", &node);
+        bool conditional = kislay_http_query_param(request, "if_version", &if_version);
+        scope_ptr_t layers[5];
+        kislay_server_lock(server);
+        kislay_server_chain_locked(server, environment, project, service, node, layers);
+        pthread_mutex_unlock(&server->lock);
+        std::string version = std::to_string(static_cast<unsigned long long>(kislay_chain_revision(layers)));
+        if (conditional && if_version == version) {
+            kislay_http_send_response(client_fd, 304, "application/json", std::string());
+            return;
+        }
+        KISLAY_PROBE2(resolve__begin, client_fd, version.c_str());
+        std::shared_ptr<kislay_resolve_entry_t> entry = kislay_server_resolve_coalesced(server, layers);
+        KISLAY_PROBE2(resolve__end, client_fd, entry->payload->size());
+        kislay_server_send_resolve(server, request, entry, client_fd);
+        return;
     }
-    pthread_mutex_unlock(&obj->lock);
 
-    zval_ptr_dtor(&decoded);
-    RETURN_TRUE;
-}
+    if (route == KISLAY_ROUTE_REPLICATION_LOG) {
+        std::string after;
+        kislay_http_query_param(request, "after", &after);
+        std::string payload;
+        int status = kislay_server_change_log_json(server, std::strtoull(after.c_str(), nullptr, 10), &payload);
+        kislay_http_send_response(client_fd, status, "application/json", payload);
+        return;
+    }
 
-static std::string kislay_server_response_json(const std::string &version, const flat_map_t &config, const std::string &checksum) {
-    zval root;
-    zval cfg;
-    array_init(&root);
-    add_assoc_string(&root, "version", const_cast<char *>(version.c_str()));
-    add_assoc_string(&root, "checksum", const_cast<char *>(checksum.c_str()));
-    kislay_flat_map_to_array(config, &cfg);
-    add_assoc_zval(&root, "config", &cfg);
-    std::string json;
-    kislay_json_encode_zval(&root, &json);
-    zval_ptr_dtor(&root);
-    return json;
-}
+    if (route == KISLAY_ROUTE_REPLICATION_SNAPSHOT) {
+        kislay_server_snapshot_t snapshot;
+        kislay_server_lock(server);
+        kislay_server_snapshot_locked(server, &snapshot);
+        pthread_mutex_unlock(&server->lock);
+        kislay_http_send_response(client_fd, 200, "application/json", kislay_server_snapshot_json(snapshot));
+        return;
+    }
 
-static std::string kislay_server_simple_json(const std::string &key, const std::string &value) {
-    zval root;
-    array_init(&root);
-    add_assoc_string(&root, key.c_str(), const_cast<char *>(value.c_str()));
-    std::string json;
-    kislay_json_encode_zval(&root, &json);
-    zval_ptr_dtor(&root);
-    return json;
-}
+    if (route == KISLAY_ROUTE_STATS) {
+        std::string payload("{\"revision\":");
+        kislay_server_lock(server);
+        payload.append(std::to_string(static_cast<unsigned long long>(server->revision)));
+        pthread_mutex_unlock(&server->lock);
+        pthread_mutex_lock(&server->coalescer.lock);
+        payload.append(",\"resolves_computed\":");
+        payload.append(std::to_string(static_cast<unsigned long long>(server->coalescer.computed)));
+        payload.append(",\"resolves_coalesced\":");
+        payload.append(std::to_string(static_cast<unsigned long long>(server->coalescer.coalesced)));
+        payload.append(",\"resolves_cached\":");
+        payload.append(std::to_string(static_cast<unsigned long long>(server->coalescer.cached)));
+        payload.append(",\"resolves_compressed\":");
+        payload.append(std::to_string(static_cast<unsigned long long>(server->coalescer.compressed)));
+        pthread_mutex_unlock(&server->coalescer.lock);
+        std::size_t pending = 0;
+        std::uint64_t queue_full = 0;
+        std::uint64_t endpoint_limit = 0;
+        kislay_server_shed_counts(server, &pending, &queue_full, &endpoint_limit);
+        payload.append(",\"pending_connections\":");
+        payload.append(std::to_string(static_cast<unsigned long long>(pending)));
+        payload.append(",\"shed_queue_full\":");
+        payload.append(std::to_string(static_cast<unsigned long long>(queue_full)));
+        payload.append(",\"shed_endpoint_limit\":");
+        payload.append(std::to_string(static_cast<unsigned long long>(endpoint_limit)));
+        payload.push_back('}');
+        kislay_http_send_response(client_fd, 200, "application/json", payload);
+        return;
+    }
 
-static void kislay_server_apply_remote_write(php_kislayphp_config_server_t *server, const std::string &path, const std::string &body, int client_fd) {
-    zval decoded;
-    ZVAL_UNDEF(&decoded);
-    if (!kislay_json_decode_assoc(body, &decoded) || Z_TYPE(decoded) != IS_ARRAY) {
-        if (!Z_ISUNDEF(decoded)) {
-            zval_ptr_dtor(&decoded);
-        }
-        kislay_http_send_response(client_fd, 400, "application/json", "{\"error\":\"invalid json\"}");
+    if (route == KISLAY_ROUTE_METRICS) {
+        kislay_http_send_response(client_fd, 200, "text/plain; version=0.0.4", kislay_server_metrics_text(server));
         return;
     }
 
-    flat_map_t flattened;
-    std::string error;
-    if (!kislay_zval_to_flat_map(&decoded, &flattened, &error)) {
-        zval_ptr_dtor(&decoded);
-        kislay_http_send_response(client_fd, 400, "application/json", "{\"error\":\"invalid config payload\"}");
+    if (route == KISLAY_ROUTE_REPLICATION_STATUS) {
+        kislay_http_send_response(client_fd, 200, "application/json", kislay_server_replication_status_json(server));
         return;
     }
-    zval_ptr_dtor(&decoded);
 
-    std::vector<std::string> parts;
-    std::stringstream stream(path);
-    std::string item;
-    while (std::getline(stream, item, '/')) {
-        if (!item.empty()) {
-            parts.push_back(kislay_url_decode(item));
-        }
+    const char *body = kislay_http_data(request, request.body);
+    if (route == KISLAY_ROUTE_RESOLVE_BATCH) {
+        std::string payload;
+        int status = kislay_server_resolve_batch_json(server, body, request.body.length, &payload);
+        kislay_http_send_response(client_fd, status, "application/json", payload);
+        return;
     }
 
-    pthread_mutex_lock(&server->lock);
-    bool ok = false;
-    if (parts.size() == 3 && parts[0] == "v1" && parts[1] == "config" && parts[2] == "global") {
-        server->global_scope = flattened;
-        ok = true;
-    } else if (parts.size() == 4 && parts[0] == "v1" && parts[1] == "config" && parts[2] == "environments") {
-        server->environment_scopes[parts[3]] = flattened;
-        ok = true;
-    } else if (parts.size() == 4 && parts[0] == "v1" && parts[1] == "config" && parts[2] == "projects") {
-        server->project_scopes[parts[3]] = flattened;
-        ok = true;
-    } else if (parts.size() == 6 && parts[0] == "v1" && parts[1] == "config" && parts[2] == "projects" && parts[4] == "services") {
-        server->service_scopes[parts[3]][parts[5]] = flattened;
-        ok = true;
-    } else if (parts.size() == 8 && parts[0] == "v1" && parts[1] == "config" && parts[2] == "projects" && parts[4] == "services" && parts[6] == "nodes") {
-        server->node_scopes[parts[3]][parts[5]][parts[7]] = flattened;
-        ok = true;
+    if (route == KISLAY_ROUTE_RESOLVE_DIFF) {
+        std::string payload;
+        int status = kislay_server_resolve_diff_json(server, request, body, request.body.length, &payload);
+        kislay_http_send_response(client_fd, status, "application/json", payload);
+        return;
     }
-    if (ok) {
-        kislay_server_bump_version(server);
+
+    if (route == KISLAY_ROUTE_BATCH) {
+        kislay_server_apply_remote_batch(server, body, request.body.length, client_fd);
+        return;
     }
-    std::string version = server->version;
-    pthread_mutex_unlock(&server->lock);
 
-    if (!ok) {
-        kislay_http_send_response(client_fd, 404, "application/json", "{\"error\":\"unknown config scope\"}");
+    if (route == KISLAY_ROUTE_PUT || route == KISLAY_ROUTE_PATCH) {
+        std::string path(kislay_http_data(request, request.path), request.path.length);
+        kislay_server_apply_remote_write(server, path, body, request.body.length, route == KISLAY_ROUTE_PATCH, client_fd);
         return;
     }
-    kislay_http_send_response(client_fd, 200, "application/json", kislay_server_simple_json("version", version));
+
+    kislay_http_send_response(client_fd, 404, "application/json", "{\"error\":\"not found\"}");
 }
 
-PHP_METHOD(KislayPHPConfigServer, run) {
-    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+static void *kislay_server_connection_main(void *arg) {
+    php_kislayphp_config_server_t *server = static_cast<php_kislayphp_config_server_t *>(arg);
+    kislay_server_connections_t &connections = server->connections;
+    kislay_metrics_shard_t *shard = new kislay_metrics_shard_t();
+    pthread_mutex_lock(&server->metrics.lock);
+    server->metrics.shards.emplace_back(shard);
+    pthread_mutex_unlock(&server->metrics.lock);
+    kislay_metrics_shard = shard;
+    kislay_http_request_t request;
+
+    pthread_mutex_lock(&connections.lock);
+    for (;;) {
+        while (!connections.stopping && connections.pending.empty()) {
+            pthread_cond_wait(&connections.cond, &connections.lock);
+        }
+        if (connections.pending.empty()) {
+            break;
+        }
+        int client_fd = connections.pending.front();
+        connections.pending.pop_front();
+        ++connections.busy;
+        pthread_mutex_unlock(&connections.lock);
+
+        if (kislay_http_read_request(client_fd, &request)) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            kislay_route_t route = kislay_server_route(request);
+            KISLAY_PROBE4(request__parsed, client_fd, route, kislay_http_data(request, request.path), request.path.length);
+            kislay_endpoint_t endpoint = kislay_server_endpoint(route);
+            shard->last_status = 0;
+            if (kislay_server_admit(server, endpoint)) {
+                kislay_server_handle_request(server, request, route, client_fd);
+                kislay_server_release(server, endpoint);
+            } else {
+                kislay_server_send_overloaded(server, client_fd);
+            }
+            kislay_histogram_record(shard->requests[route], kislay_elapsed_us(start));
+            std::size_t status = 0;
+            while (status < KISLAY_METRIC_STATUS_COUNT - 1 && kislay_metric_statuses[status] != shard->last_status) {
+                ++status;
+            }
+            kislay_metric_add(shard->responses[route][status], 1);
+        }
+        close(client_fd);
+        if (request.buffer.size() > KISLAY_HTTP_KEEP_BUFFER_BYTES) {
+            std::string().swap(request.buffer);
+        }
+        pthread_mutex_lock(&connections.lock);
+        --connections.busy;
+    }
+    pthread_mutex_unlock(&connections.lock);
+    kislay_metrics_shard = nullptr;
+    return nullptr;
+}
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        zend_throw_exception(zend_ce_exception, "Unable to create server socket", 0);
-        RETURN_FALSE;
+static bool kislay_server_start_connections(php_kislayphp_config_server_t *server) {
+    kislay_server_connections_t &connections = server->connections;
+    connections.stopping = false;
+    while (connections.threads.size() < connections.size) {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, kislay_server_connection_main, server) != 0) {
+            return !connections.threads.empty();
+        }
+        connections.threads.push_back(thread);
     }
+    return true;
+}
 
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+static bool kislay_server_is_unix(const php_kislayphp_config_server_t *obj) {
+    return obj->host.compare(0, sizeof(KISLAY_UNIX_PREFIX) - 1, KISLAY_UNIX_PREFIX) == 0;
+}
 
-    struct sockaddr_in address;
+/*
+ * Binds a unix socket, refusing to replace one another server still answers
+ * on but clearing a stale file left by a crash.
+ */
+static int kislay_server_open_unix_listener(php_kislayphp_config_server_t *obj, std::string *error) {
+    std::string path = obj->host.substr(sizeof(KISLAY_UNIX_PREFIX) - 1);
+    struct sockaddr_un address;
     std::memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_port = htons(static_cast<uint16_t>(obj->port));
-    if (obj->host == "0.0.0.0") {
-        address.sin_addr.s_addr = INADDR_ANY;
-    } else if (inet_pton(AF_INET, obj->host.c_str(), &address.sin_addr) != 1) {
-        close(server_fd);
-        zend_throw_exception(zend_ce_exception, "Invalid listen host", 0);
-        RETURN_FALSE;
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        *error = "Invalid unix socket path";
+        return -1;
     }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
 
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        *error = "Unable to create server socket";
+        return -1;
+    }
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+        if (connect(server_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0) {
+            close(server_fd);
+            *error = "Unix socket " + path + " is in use";
+            return -1;
+        }
+        unlink(path.c_str());
+    }
     if (bind(server_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0) {
         close(server_fd);
-        zend_throw_exception(zend_ce_exception, "Unable to bind config server", 0);
-        RETURN_FALSE;
+        *error = "Unable to bind config server";
+        return -1;
     }
-    if (listen(server_fd, 64) != 0) {
+    if (obj->socket_mode >= 0 && chmod(path.c_str(), static_cast<mode_t>(obj->socket_mode)) != 0) {
         close(server_fd);
-        zend_throw_exception(zend_ce_exception, "Unable to listen on config server", 0);
+        unlink(path.c_str());
+        *error = "Unable to chmod " + path;
+        return -1;
+    }
+    return server_fd;
+}
+
+static void kislay_server_remove_unix_socket(const php_kislayphp_config_server_t *obj) {
+    if (kislay_server_is_unix(obj)) {
+        unlink(obj->host.c_str() + sizeof(KISLAY_UNIX_PREFIX) - 1);
+    }
+}
+
+/* Bound and listening socket for obj->host (an IPv4 address or unix://path), or -1 with error set. */
+static int kislay_server_open_listener(php_kislayphp_config_server_t *obj, std::string *error) {
+    int server_fd = -1;
+    if (kislay_server_is_unix(obj)) {
+        server_fd = kislay_server_open_unix_listener(obj, error);
+        if (server_fd < 0) {
+            return -1;
+        }
+    } else {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0) {
+            *error = "Unable to create server socket";
+            return -1;
+        }
+
+        int opt = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        struct sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(obj->port));
+        if (obj->host == "0.0.0.0") {
+            address.sin_addr.s_addr = INADDR_ANY;
+        } else if (inet_pton(AF_INET, obj->host.c_str(), &address.sin_addr) != 1) {
+            close(server_fd);
+            *error = "Invalid listen host";
+            return -1;
+        }
+
+        if (bind(server_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0) {
+            close(server_fd);
+            *error = "Unable to bind config server";
+            return -1;
+        }
+    }
+    if (listen(server_fd, SOMAXCONN) != 0) {
+        close(server_fd);
+        kislay_server_remove_unix_socket(obj);
+        *error = "Unable to listen on config server";
+        return -1;
+    }
+    return server_fd;
+}
+
+PHP_METHOD(KislayPHPConfigServer, run) {
+    php_kislayphp_config_server_t *obj = php_kislayphp_config_server_from_obj(Z_OBJ_P(getThis()));
+
+    std::string error;
+    int server_fd = kislay_server_open_listener(obj, &error);
+    if (server_fd < 0) {
+        zend_throw_exception(zend_ce_exception, error.c_str(), 0);
         RETURN_FALSE;
     }
 
     obj->listen_fd = server_fd;
     obj->running = true;
 
+    if (!kislay_server_start_connections(obj)) {
+        close(server_fd);
+        kislay_server_remove_unix_socket(obj);
+        obj->listen_fd = -1;
+        obj->running = false;
+        zend_throw_exception(zend_ce_exception, "Unable to start connection threads", 0);
+        RETURN_FALSE;
+    }
+
     while (obj->running) {
         int client_fd = accept(server_fd, nullptr, nullptr);
         if (client_fd < 0) {
@@ -2177,58 +8061,29 @@ PHP_METHOD(KislayPHPConfigServer, run) {
             }
             break;
         }
-
-        kislay_http_request_t request;
-        if (!kislay_http_read_request(client_fd, &request)) {
-            close(client_fd);
-            continue;
-        }
-
-        if (request.method == "GET" && request.path == "/health") {
-            pthread_mutex_lock(&obj->lock);
-            std::string payload = kislay_server_simple_json("version", obj->version);
-            pthread_mutex_unlock(&obj->lock);
-            kislay_http_send_response(client_fd, 200, "application/json", payload);
-            close(client_fd);
-            continue;
-        }
-
-        if (request.method == "GET" && request.path == "/v1/config/version") {
-            pthread_mutex_lock(&obj->lock);
-            std::string payload = kislay_server_simple_json("version", obj->version);
-            pthread_mutex_unlock(&obj->lock);
-            kislay_http_send_response(client_fd, 200, "application/json", payload);
-            close(client_fd);
-            continue;
-        }
-
-        if (request.method == "GET" && request.path == "/v1/config/resolve") {
-            std::map<std::string, std::string> query = kislay_parse_query(request.query);
-            pthread_mutex_lock(&obj->lock);
-            flat_map_t resolved = kislay_server_resolve_locked(obj,
-                query["environment"], query["project"], query["service"], query["node"]);
-            std::string version = obj->version;
-            pthread_mutex_unlock(&obj->lock);
-            std::string payload = kislay_server_response_json(version, resolved, kislay_checksum_for_map(resolved));
-            kislay_http_send_response(client_fd, 200, "application/json", payload);
-            close(client_fd);
-            continue;
+        KISLAY_PROBE1(server__accept, client_fd);
+        kislay_http_set_timeouts(client_fd);
+
+        pthread_mutex_lock(&obj->connections.lock);
+        bool admitted = obj->connections.pending.size() < obj->connections.max_pending;
+        if (admitted) {
+            obj->connections.pending.push_back(client_fd);
+            pthread_cond_signal(&obj->connections.cond);
+        } else {
+            ++obj->connections.shed_pending;
         }
-
-        if (request.method == "PUT") {
-            kislay_server_apply_remote_write(obj, request.path, request.body, client_fd);
-            close(client_fd);
-            continue;
+        pthread_mutex_unlock(&obj->connections.lock);
+        if (!admitted) {
+            kislay_server_shed_connection(obj, client_fd);
         }
-
-        kislay_http_send_response(client_fd, 404, "application/json", "{\"error\":\"not found\"}");
-        close(client_fd);
     }
+    kislay_server_stop_connections(obj);
 
     if (obj->listen_fd >= 0) {
         close(obj->listen_fd);
         obj->listen_fd = -1;
     }
+    kislay_server_remove_unix_socket(obj);
     obj->running = false;
     RETURN_TRUE;
 }
@@ -2266,6 +8121,9 @@ static const zend_function_entry kislayphp_config_runtime_methods[] = {
     PHP_ME(KislayPHPConfigRuntime, loadLocal, arginfo_kislayphp_config_load_local, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     PHP_ME(KislayPHPConfigRuntime, refresh, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     PHP_ME(KislayPHPConfigRuntime, setOverride, arginfo_kislayphp_config_set_override, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_ME(KislayPHPConfigRuntime, setRequestOverride, arginfo_kislayphp_config_set_override, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_ME(KislayPHPConfigRuntime, setOverrides, arginfo_kislayphp_config_set_overrides, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_ME(KislayPHPConfigRuntime, clearOverrides, arginfo_kislayphp_config_clear_overrides, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     PHP_ME(KislayPHPConfigRuntime, has, arginfo_kislayphp_config_has, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     PHP_ME(KislayPHPConfigRuntime, get, arginfo_kislayphp_config_get, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     PHP_ME(KislayPHPConfigRuntime, getString, arginfo_kislayphp_config_get_string, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
@@ -2275,6 +8133,22 @@ static const zend_function_entry kislayphp_config_runtime_methods[] = {
     PHP_ME(KislayPHPConfigRuntime, all, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     PHP_ME(KislayPHPConfigRuntime, version, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     PHP_ME(KislayPHPConfigRuntime, checksum, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_ME(KislayPHPConfigRuntime, snapshot, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_ME(KislayPHPConfigRuntime, stats, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_FE_END
+};
+
+static const zend_function_entry kislayphp_config_snapshot_methods[] = {
+    PHP_ME(KislayPHPConfigSnapshot, __construct, arginfo_kislayphp_config_void, ZEND_ACC_PRIVATE)
+    PHP_ME(KislayPHPConfigSnapshot, has, arginfo_kislayphp_config_has, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigSnapshot, get, arginfo_kislayphp_config_get, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigSnapshot, getString, arginfo_kislayphp_config_get_string, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigSnapshot, getInt, arginfo_kislayphp_config_get_int, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigSnapshot, getBool, arginfo_kislayphp_config_get_bool, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigSnapshot, getArray, arginfo_kislayphp_config_get_array, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigSnapshot, all, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigSnapshot, version, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigSnapshot, checksum, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC)
     PHP_FE_END
 };
 
@@ -2288,10 +8162,13 @@ static const zend_function_entry kislayphp_config_server_methods[] = {
     PHP_ME(KislayPHPConfigServer, setProject, arginfo_kislayphp_server_project_scope, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPConfigServer, setService, arginfo_kislayphp_server_service_scope, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPConfigServer, setNode, arginfo_kislayphp_server_node_scope, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigServer, apply, arginfo_kislayphp_server_apply, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPConfigServer, resolve, arginfo_kislayphp_server_resolve, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPConfigServer, version, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPConfigServer, save, arginfo_kislayphp_config_load_local, ZEND_ACC_PUBLIC)
     PHP_ME(KislayPHPConfigServer, load, arginfo_kislayphp_config_load_local, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigServer, checkpoint, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC)
+    PHP_ME(KislayPHPConfigServer, stats, arginfo_kislayphp_config_void, ZEND_ACC_PUBLIC)
     PHP_FE_END
 };
 
@@ -2321,6 +8198,22 @@ PHP_MINIT_FUNCTION(kislayphp_config) {
     kislayphp_config_runtime_ce = zend_register_internal_class(&ce);
     zend_register_class_alias("KislayPHP\\Config\\Config", kislayphp_config_runtime_ce);
 
+    INIT_NS_CLASS_ENTRY(ce, "Kislay\\Config", "Snapshot", kislayphp_config_snapshot_methods);
+    kislayphp_config_snapshot_ce = zend_register_internal_class(&ce);
+    zend_register_class_alias("KislayPHP\\Config\\Snapshot", kislayphp_config_snapshot_ce);
+#if PHP_VERSION_ID >= 80100
+    kislayphp_config_snapshot_ce->ce_flags |= ZEND_ACC_FINAL | ZEND_ACC_NOT_SERIALIZABLE;
+#else
+    kislayphp_config_snapshot_ce->ce_flags |= ZEND_ACC_FINAL;
+    kislayphp_config_snapshot_ce->serialize = zend_class_serialize_deny;
+    kislayphp_config_snapshot_ce->unserialize = zend_class_unserialize_deny;
+#endif
+    kislayphp_config_snapshot_ce->create_object = kislayphp_config_snapshot_create_object;
+    std::memcpy(&kislayphp_config_snapshot_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    kislayphp_config_snapshot_handlers.offset = XtOffsetOf(php_kislayphp_config_snapshot_t, std);
+    kislayphp_config_snapshot_handlers.free_obj = kislayphp_config_snapshot_free_obj;
+    kislayphp_config_snapshot_handlers.clone_obj = nullptr;
+
     INIT_NS_CLASS_ENTRY(ce, "Kislay\\Config", "Server", kislayphp_config_server_methods);
     kislayphp_config_server_ce = zend_register_internal_class(&ce);
     zend_register_class_alias("KislayPHP\\Config\\Server", kislayphp_config_server_ce);
@@ -2336,12 +8229,41 @@ PHP_MSHUTDOWN_FUNCTION(kislayphp_config) {
     return SUCCESS;
 }
 
+PHP_RSHUTDOWN_FUNCTION(kislayphp_config) {
+    kislay_request_pin.reset();
+    if (!kislay_request_overrides.empty()) {
+        flat_map_t().swap(kislay_request_overrides);
+    }
+    return SUCCESS;
+}
+
 PHP_MINFO_FUNCTION(kislayphp_config) {
     php_info_print_table_start();
     php_info_print_table_header(2, "kislayphp_config support", "enabled");
     php_info_print_table_row(2, "Version", PHP_KISLAYPHP_CONFIG_VERSION);
     php_info_print_table_row(2, "Primary API", "Kislay\\Config\\Config + Kislay\\Config\\Server");
     php_info_print_table_end();
+
+    zval stats;
+    kislay_runtime_stats_to_array(&stats);
+    php_info_print_table_start();
+    php_info_print_table_header(2, "Config runtime", "Value");
+    zend_string *key = nullptr;
+    zval *entry = nullptr;
+    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL(stats), key, entry) {
+        if (Z_TYPE_P(entry) != IS_ARRAY) {
+            php_info_print_table_row(2, ZSTR_VAL(key), kislay_string_from_zval(entry).c_str());
+            continue;
+        }
+        zend_string *inner_key = nullptr;
+        zval *inner = nullptr;
+        ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(entry), inner_key, inner) {
+            std::string label = std::string(ZSTR_VAL(key)) + "." + ZSTR_VAL(inner_key);
+            php_info_print_table_row(2, label.c_str(), kislay_string_from_zval(inner).c_str());
+        } ZEND_HASH_FOREACH_END();
+    } ZEND_HASH_FOREACH_END();
+    php_info_print_table_end();
+    zval_ptr_dtor(&stats);
 }
 
 zend_module_entry kislayphp_config_module_entry = {
@@ -2351,7 +8273,7 @@ zend_module_entry kislayphp_config_module_entry = {
     PHP_MINIT(kislayphp_config),
     PHP_MSHUTDOWN(kislayphp_config),
     nullptr,
-    nullptr,
+    PHP_RSHUTDOWN(kislayphp_config),
     PHP_MINFO(kislayphp_config),
     PHP_KISLAYPHP_CONFIG_VERSION,
     STANDARD_MODULE_PROPERTIES
@@ -0,0 +1,101 @@
+<?php
+
+// Compares N sequential GET /v1/config/resolve calls with one POST /v1/config/resolve-batch.
+//
+//   php -d extension=kislayphp_config.so scripts/bench_resolve_batch.php seed   # terminal 1
+//   php scripts/bench_resolve_batch.php run [http://127.0.0.1:9011] [tuples]   # terminal 2
+//   php scripts/bench_resolve_batch.php check [http://127.0.0.1:9011]          # PUT, resolve, PATCH, resolve
+
+$mode = $argv[1] ?? 'run';
+$services = 50;
+$nodesPerService = 20;
+
+function fill(string $prefix, int $count): array
+{
+    $out = [];
+    for ($i = 0; $i < $count; $i++) {
+        $out[$prefix]['k' . $i] = 'value-' . $i;
+    }
+    return $out;
+}
+
+if ($mode === 'seed') {
+    if (!extension_loaded('kislayphp_config')) {
+        fwrite(STDERR, "kislayphp_config extension is not loaded\n");
+        exit(1);
+    }
+    $server = new Kislay\Config\Server(['host' => '127.0.0.1', 'port' => 9011]);
+    $ops = [
+        ['scope' => 'global', 'config' => fill('g', 300)],
+        ['scope' => 'environments/prod', 'config' => fill('e', 100)],
+        ['scope' => 'projects/shop', 'config' => fill('p', 100)],
+    ];
+    for ($s = 0; $s < $services; $s++) {
+        $ops[] = ['scope' => "projects/shop/services/svc$s", 'config' => fill('s', 60)];
+        for ($n = 0; $n < $nodesPerService; $n += 2) {
+            $ops[] = ['scope' => "projects/shop/services/svc$s/nodes/n$n", 'config' => fill('n', 10)];
+        }
+    }
+    $server->apply($ops);
+    echo "Seeded revision {$server->version()}, serving on http://127.0.0.1:9011\n";
+    $server->run();
+    exit(0);
+}
+
+$base = rtrim($argv[2] ?? 'http://127.0.0.1:9011', '/');
+$count = (int) ($argv[3] ?? 1000);
+
+function request(string $method, string $url, ?array $body = null): array
+{
+    $options = ['method' => $method, 'ignore_errors' => true];
+    if ($body !== null) {
+        $options['header'] = "Content-Type: application/json\r\n";
+        $options['content'] = json_encode($body);
+    }
+    $response = file_get_contents($url, false, stream_context_create(['http' => $options]));
+    return json_decode((string) $response, true) ?? [];
+}
+
+if ($mode === 'check') {
+    // A PATCH may edit a scope in place; the cached resolve of its chain must not outlive it.
+    $scope = $base . '/v1/config/projects/cache-check';
+    $resolve = $base . '/v1/config/resolve?project=cache-check';
+    request('PUT', $scope, ['flag' => 'before']);
+    $first = request('GET', $resolve);
+    request('PATCH', $scope, ['set' => ['flag' => 'after']]);
+    $second = request('GET', $resolve);
+    printf("after PUT:   version %s flag=%s\n", $first['version'] ?? '?', $first['config']['flag'] ?? '?');
+    printf("after PATCH: version %s flag=%s\n", $second['version'] ?? '?', $second['config']['flag'] ?? '?');
+    $ok = ($second['config']['flag'] ?? null) === 'after' && (int) ($second['version'] ?? 0) > (int) ($first['version'] ?? 0);
+    echo $ok ? "OK\n" : "FAIL: resolve served the pre-PATCH body\n";
+    exit($ok ? 0 : 1);
+}
+
+$tuples = [];
+for ($i = 0; $i < $count; $i++) {
+    $tuples[] = [
+        'environment' => 'prod',
+        'project' => 'shop',
+        'service' => 'svc' . (intdiv($i, $nodesPerService) % $services),
+        'node' => 'n' . ($i % $nodesPerService),
+    ];
+}
+
+$start = hrtime(true);
+foreach ($tuples as $tuple) {
+    file_get_contents($base . '/v1/config/resolve?' . http_build_query($tuple));
+}
+$sequentialMs = (hrtime(true) - $start) / 1e6;
+
+$context = stream_context_create(['http' => [
+    'method' => 'POST',
+    'header' => "Content-Type: application/json\r\n",
+    'content' => json_encode(['tuples' => $tuples]),
+]]);
+$start = hrtime(true);
+$body = file_get_contents($base . '/v1/config/resolve-batch', false, $context);
+$batchMs = (hrtime(true) - $start) / 1e6;
+$results = json_decode((string) $body, true)['results'] ?? [];
+
+printf("%d sequential resolves: %.1f ms\n", $count, $sequentialMs);
+printf("1 resolve-batch of %d:   %.1f ms (%d results, %.1f MiB)\n", $count, $batchMs, count($results), strlen((string) $body) / 1048576);